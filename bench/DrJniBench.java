@@ -0,0 +1,35 @@
+// Java side of the FFI benchmarks, loaded from the class path of the benchmark JVM
+public class DrJniBench {
+  public int intField;
+  public String stringField = "field";
+  public static int staticIntField;
+
+  public DrJniBench() {}
+
+  public static int arity0() { return 0; }
+  public static int arity1(int a) { return a; }
+  public static int arity2(int a, int b) { return a + b; }
+  public static int arity3(int a, int b, int c) { return a + b + c; }
+  public static int arity4(int a, int b, int c, int d) { return a + b + c + d; }
+  public static int arity5(int a, int b, int c, int d, int e) { return a + b + c + d + e; }
+  public static int arity6(int a, int b, int c, int d, int e, int f) { return a + b + c + d + e + f; }
+  public static int arity7(int a, int b, int c, int d, int e, int f, int g) { return a + b + c + d + e + f + g; }
+  public static int arity8(int a, int b, int c, int d, int e, int f, int g, int h) { return a + b + c + d + e + f + g + h; }
+
+  public int instanceArity0() { return intField; }
+  public int instanceArity1(int a) { return a; }
+  public int instanceArity2(int a, int b) { return a + b; }
+  public int instanceArity3(int a, int b, int c) { return a + b + c; }
+  public int instanceArity4(int a, int b, int c, int d) { return a + b + c + d; }
+  public int instanceArity5(int a, int b, int c, int d, int e) { return a + b + c + d + e; }
+  public int instanceArity6(int a, int b, int c, int d, int e, int f) { return a + b + c + d + e + f; }
+  public int instanceArity7(int a, int b, int c, int d, int e, int f, int g) { return a + b + c + d + e + f + g; }
+  public int instanceArity8(int a, int b, int c, int d, int e, int f, int g, int h) { return a + b + c + d + e + f + g + h; }
+
+  private static final Object SHARED_OBJECT = new Object();
+
+  public static Object object() { return SHARED_OBJECT; }
+  public static String string() { return "Hello from Java"; }
+
+  public static void fail() { throw new IllegalStateException("Benchmark exception"); }
+}
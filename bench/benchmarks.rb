@@ -0,0 +1,143 @@
+# Measures the FFI entry points of jni.c. Loaded by main.c after lib/jni/ffi.rb.
+#
+# Every benchmark reports the time per operation in nanoseconds and the number of mruby allocations
+# per operation (including the ones jni.c makes through drb->mrb_malloc and friends).
+#
+# By default (frame: :none) returned objects are global references like in the game and are released when
+# their Reference is garbage collected, which is part of the measured time. Benchmarks with
+# frame: :per_call wrap every operation in FFI.with_frame and measure the local reference path instead.
+
+module Bench
+  ITERATIONS = 20_000
+  WARMUP_ITERATIONS = 2_000
+
+  class << self
+    def results
+      @results ||= []
+    end
+
+    def measure(name, iterations: ITERATIONS, frame: :none, &block)
+      name = "#{name} [frame per call]" if frame == :per_call
+      run(WARMUP_ITERATIONS, frame, &block)
+
+      allocations_before = allocation_count
+      start = now_ns
+      run(iterations, frame, &block)
+      elapsed = now_ns - start
+      allocations = allocation_count - allocations_before
+
+      results << {
+        name: name,
+        frame: frame,
+        iterations: iterations,
+        ns_per_op: elapsed.to_f / iterations,
+        allocations_per_op: allocations.to_f / iterations
+      }
+      puts format('%-40s %10.1f ns/op %8.2f allocs/op', name, results.last[:ns_per_op], results.last[:allocations_per_op])
+    end
+
+    def run(iterations, frame)
+      i = 0
+      if frame == :per_call
+        while i < iterations
+          JNI::FFI.with_frame { yield }
+          i += 1
+        end
+      else
+        while i < iterations
+          yield
+          i += 1
+        end
+      end
+    end
+
+    def results_json
+      entries = results.map { |result|
+        format(
+          '{"name":%s,"frame":"%s","iterations":%d,"ns_per_op":%.2f,"allocations_per_op":%.3f}',
+          result[:name].inspect, result[:frame], result[:iterations], result[:ns_per_op], result[:allocations_per_op]
+        )
+      }
+      "{\"benchmarks\":[\n  #{entries.join(",\n  ")}\n]}\n"
+    end
+  end
+end
+
+ffi = JNI::FFI
+bench_class = ffi.find_class('DrJniBench').retain
+constructor_id = ffi.get_method_id(bench_class, '<init>', '()V')
+bench_object = ffi.new_object(bench_class, constructor_id, []).retain
+
+Bench.measure('baseline (empty block)') {}
+
+Bench.measure('find_class') { ffi.find_class('DrJniBench') }
+Bench.measure('get_method_id') { ffi.get_method_id(bench_class, 'instanceArity0', '()I') }
+Bench.measure('new_object') { ffi.new_object(bench_class, constructor_id, []) }
+Bench.measure('new_object', frame: :per_call) { ffi.new_object(bench_class, constructor_id, []) }
+
+(0..8).each do |arity|
+  signature = "(#{'I' * arity})I"
+  argument_types = [:int] * arity
+  args = (1..arity).to_a
+
+  static_method_id = ffi.get_static_method_id(bench_class, "arity#{arity}", signature)
+  Bench.measure("call_static_int_method/#{arity}") {
+    ffi.call_static_int_method(bench_class, static_method_id, argument_types, *args)
+  }
+
+  method_id = ffi.get_method_id(bench_class, "instanceArity#{arity}", signature)
+  Bench.measure("call_int_method/#{arity}") {
+    ffi.call_int_method(bench_object, method_id, argument_types, *args)
+  }
+
+  call_site = ffi.build_call_site(method_id, argument_types, :int, :method)
+  Bench.measure("call/#{arity}") { ffi.call(call_site, bench_object, *args) }
+
+  # Generated from bindings.rb
+  bindings = ffi::Bindings::DrJniBench
+  static_name = :"arity#{arity}"
+  instance_name = :"instance_arity#{arity}"
+  expected = ffi.call_static_int_method(bench_class, static_method_id, argument_types, *args)
+  raise "#{static_name} binding returned a different result" unless bindings.send(static_name, *args) == expected
+
+  Bench.measure("bindings static/#{arity}") { bindings.send(static_name, *args) }
+  Bench.measure("bindings instance/#{arity}") { bindings.send(instance_name, bench_object, *args) }
+end
+
+int_field_id = ffi.get_field_id(bench_class, 'intField', 'I')
+string_field_id = ffi.get_field_id(bench_class, 'stringField', 'Ljava/lang/String;')
+static_int_field_id = ffi.get_static_field_id(bench_class, 'staticIntField', 'I')
+Bench.measure('get_int_field') { ffi.get_int_field(bench_object, int_field_id) }
+Bench.measure('set_int_field') { ffi.set_int_field(bench_object, int_field_id, 42) }
+Bench.measure('get_static_int_field') { ffi.get_static_int_field(bench_class, static_int_field_id) }
+Bench.measure('set_static_int_field') { ffi.set_static_int_field(bench_class, static_int_field_id, 42) }
+Bench.measure('get_object_field (string)') { ffi.get_object_field(bench_object, string_field_id) }
+Bench.measure('set_object_field (string)') { ffi.set_object_field(bench_object, string_field_id, 'value') }
+
+object_method_id = ffi.get_static_method_id(bench_class, 'object', '()Ljava/lang/Object;')
+string_method_id = ffi.get_static_method_id(bench_class, 'string', '()Ljava/lang/String;')
+Bench.measure('call_static_object_method (object)') {
+  ffi.call_static_object_method(bench_class, object_method_id, [])
+}
+Bench.measure('call_static_object_method (object)', frame: :per_call) {
+  ffi.call_static_object_method(bench_class, object_method_id, [])
+}
+Bench.measure('call_static_object_method (string)') {
+  ffi.call_static_object_method(bench_class, string_method_id, [])
+}
+
+fail_method_id = ffi.get_static_method_id(bench_class, 'fail', '()V')
+Bench.measure('call_static_void_method (exception)', iterations: 2_000) {
+  begin
+    ffi.call_static_void_method(bench_class, fail_method_id, [])
+  rescue JNI::FFI::JavaException
+    nil
+  end
+}
+
+config = (1..1_000).to_h { |i| ["key#{i}", i.even? ? i : "value#{i}"] }
+config_map = ffi.new_collection(config)
+Bench.measure('new_collection (1000 entry Hash)', iterations: 200) { ffi.new_collection(config) }
+Bench.measure('read_collection (1000 entry Map)', iterations: 200) { ffi.read_collection(config_map) }
+
+Bench.write_results(Bench.results_json)
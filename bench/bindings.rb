@@ -0,0 +1,8 @@
+# Members of DrJniBench bound by generate-bindings, measured next to the generic entry points
+bind 'DrJniBench' do
+  (0..8).each do |arity|
+    static_method :"arity#{arity}", argument_types: [:int] * arity, return_type: :int
+    method :"instance_arity#{arity}", argument_types: [:int] * arity, return_type: :int
+  end
+  static_method :string, return_type: :string
+end
@@ -0,0 +1,54 @@
+# Compares two results.json files written by `make -C bench run` and exits with status 1 if a benchmark
+# allocates more per operation. Timings come from a single run and are too noisy to gate on, so benchmarks
+# which got slower than the tolerance are only reported.
+#
+#   ruby bench/compare.rb <baseline results.json> <results.json>
+#
+# Only meaningful when both files were written on the same machine, e.g. in the same CI job.
+
+require 'json'
+
+TIME_TOLERANCE = 1.25
+# Differences below this are ignored, however large the ratio
+TIME_FLOOR_NS = 50
+ALLOCATION_TOLERANCE = 0.01
+
+def load_results(path)
+  JSON.parse(File.read(path))['benchmarks'].to_h { |result| [result['name'], result] }
+end
+
+abort "Usage: ruby #{$PROGRAM_NAME} <baseline results.json> <results.json>" unless ARGV.size == 2
+
+baseline = load_results(ARGV[0])
+current = load_results(ARGV[1])
+regressions = []
+slowdowns = []
+
+current.each do |name, result|
+  base = baseline[name]
+  unless base
+    puts format('%-50s %10.1f ns/op (new)', name, result['ns_per_op'])
+    next
+  end
+
+  ratio = result['ns_per_op'] / base['ns_per_op']
+  allocation_difference = result['allocations_per_op'] - base['allocations_per_op']
+  puts format('%-50s %10.1f ns/op %+7.1f%% %+8.2f allocs/op', name, result['ns_per_op'], (ratio - 1) * 100, allocation_difference)
+
+  time_difference = result['ns_per_op'] - base['ns_per_op']
+  slowdowns << "#{name}: #{format('%+.1f', (ratio - 1) * 100)}% time" if ratio > TIME_TOLERANCE && time_difference > TIME_FLOOR_NS
+  regressions << "#{name}: #{format('%+.2f', allocation_difference)} allocations/op" if allocation_difference > ALLOCATION_TOLERANCE
+end
+
+unless slowdowns.empty?
+  puts "\nSlower (advisory, timings are from a single run):"
+  slowdowns.each { |slowdown| puts "  #{slowdown}" }
+end
+
+if regressions.empty?
+  puts 'No regressions.'
+else
+  puts "\nAllocation regressions:"
+  regressions.each { |regression| puts "  #{regression}" }
+  exit 1
+end
@@ -0,0 +1,127 @@
+#ifndef DR_JNI_BENCH_DRAGONRUBY_H
+#define DR_JNI_BENCH_DRAGONRUBY_H
+
+// Minimal stand-in for DragonRuby's dragonruby.h so that jni.c can be built against plain mruby.
+// Only the parts of drb_api_t used by jni.c are provided.
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <mruby.h>
+#include <mruby/array.h>
+#include <mruby/class.h>
+#include <mruby/data.h>
+#include <mruby/hash.h>
+#include <mruby/string.h>
+#include <mruby/variable.h>
+
+#define DRB_FFI_EXPORT
+
+// jni.c calls these through drb->, so any mruby macro with the same name must not be expanded there.
+// drb_api_shim.c keeps the macros to implement the API.
+#ifndef DRB_API_SHIM_IMPLEMENTATION
+#undef mrb_ary_new
+#undef mrb_ary_new_capa
+#undef mrb_ary_new_from_values
+#undef mrb_ary_push
+#undef mrb_calloc
+#undef mrb_class_get
+#undef mrb_class_get_under
+#undef mrb_data_check_get_ptr
+#undef mrb_data_object_alloc
+#undef mrb_define_class_method
+#undef mrb_define_method
+#undef mrb_define_module_under
+#undef mrb_equal
+#undef mrb_exc_new_str
+#undef mrb_exc_raise
+#undef mrb_float_value
+#undef mrb_free
+#undef mrb_gc_arena_restore
+#undef mrb_gc_arena_save
+#undef mrb_get_args
+#undef mrb_hash_get
+#undef mrb_hash_keys
+#undef mrb_hash_new
+#undef mrb_hash_set
+#undef mrb_intern_cstr
+#undef mrb_intern_lit
+#undef mrb_intern_str
+#undef mrb_iv_get
+#undef mrb_iv_set
+#undef mrb_malloc
+#undef mrb_module_get
+#undef mrb_module_get_under
+#undef mrb_obj_is_instance_of
+#undef mrb_object_dead_p
+#undef mrb_obj_value
+#undef mrb_raise
+#undef mrb_raisef
+#undef mrb_realloc
+#undef mrb_str_cat_cstr
+#undef mrb_str_cat_str
+#undef mrb_str_new
+#undef mrb_str_new_cstr
+#undef mrb_string_value_cstr
+#undef mrb_sym2name
+#endif
+
+// mrb_bool is also a function-like macro in mruby, which would expand in front of "(*member)"
+typedef mrb_bool drb_api_bool;
+
+typedef struct drb_api_t {
+  void (*drb_log_write)(const char *subsystem, int level, const char *message);
+  void *(*drb_android_get_jni_env)(void);
+  void *(*drb_android_get_sdl_activity)(void);
+
+  mrb_value (*mrb_ary_new)(mrb_state *mrb);
+  mrb_value (*mrb_ary_new_capa)(mrb_state *mrb, mrb_int capacity);
+  mrb_value (*mrb_ary_new_from_values)(mrb_state *mrb, mrb_int size, const mrb_value *values);
+  void (*mrb_ary_push)(mrb_state *mrb, mrb_value array, mrb_value value);
+  void *(*mrb_calloc)(mrb_state *mrb, size_t count, size_t size);
+  struct RClass *(*mrb_class_get)(mrb_state *mrb, const char *name);
+  struct RClass *(*mrb_class_get_under)(mrb_state *mrb, struct RClass *outer, const char *name);
+  void *(*mrb_data_check_get_ptr)(mrb_state *mrb, mrb_value object, const mrb_data_type *type);
+  struct RData *(*mrb_data_object_alloc)(mrb_state *mrb, struct RClass *klass, void *ptr, const mrb_data_type *type);
+  void (*mrb_define_class_method)(mrb_state *mrb, struct RClass *klass, const char *name, mrb_func_t func, mrb_aspec aspec);
+  void (*mrb_define_method)(mrb_state *mrb, struct RClass *klass, const char *name, mrb_func_t func, mrb_aspec aspec);
+  struct RClass *(*mrb_define_module_under)(mrb_state *mrb, struct RClass *outer, const char *name);
+  drb_api_bool (*mrb_equal)(mrb_state *mrb, mrb_value a, mrb_value b);
+  mrb_value (*mrb_exc_new_str)(mrb_state *mrb, struct RClass *klass, mrb_value message);
+  void (*mrb_exc_raise)(mrb_state *mrb, mrb_value exception);
+  mrb_value (*mrb_float_value)(mrb_state *mrb, mrb_float value);
+  void (*mrb_free)(mrb_state *mrb, void *ptr);
+  void (*mrb_gc_arena_restore)(mrb_state *mrb, int index);
+  int (*mrb_gc_arena_save)(mrb_state *mrb);
+  mrb_int (*mrb_get_args)(mrb_state *mrb, const char *format, ...);
+  mrb_value (*mrb_hash_get)(mrb_state *mrb, mrb_value hash, mrb_value key);
+  mrb_value (*mrb_hash_keys)(mrb_state *mrb, mrb_value hash);
+  mrb_value (*mrb_hash_new)(mrb_state *mrb);
+  void (*mrb_hash_set)(mrb_state *mrb, mrb_value hash, mrb_value key, mrb_value value);
+  mrb_sym (*mrb_intern_cstr)(mrb_state *mrb, const char *name);
+  mrb_sym (*mrb_intern_lit)(mrb_state *mrb, const char *name);
+  mrb_sym (*mrb_intern_str)(mrb_state *mrb, mrb_value string);
+  mrb_value (*mrb_iv_get)(mrb_state *mrb, mrb_value object, mrb_sym name);
+  void (*mrb_iv_set)(mrb_state *mrb, mrb_value object, mrb_sym name, mrb_value value);
+  void *(*mrb_malloc)(mrb_state *mrb, size_t size);
+  struct RClass *(*mrb_module_get)(mrb_state *mrb, const char *name);
+  struct RClass *(*mrb_module_get_under)(mrb_state *mrb, struct RClass *outer, const char *name);
+  drb_api_bool (*mrb_obj_is_instance_of)(mrb_state *mrb, mrb_value object, const struct RClass *klass);
+  mrb_value (*mrb_obj_value)(void *pointer);
+  drb_api_bool (*mrb_object_dead_p)(mrb_state *mrb, struct RBasic *object);
+  void (*mrb_raise)(mrb_state *mrb, struct RClass *klass, const char *message);
+  void (*mrb_raisef)(mrb_state *mrb, struct RClass *klass, const char *format, ...);
+  void *(*mrb_realloc)(mrb_state *mrb, void *ptr, size_t size);
+  mrb_value (*mrb_str_cat_cstr)(mrb_state *mrb, mrb_value string, const char *cstr);
+  mrb_value (*mrb_str_cat_str)(mrb_state *mrb, mrb_value string, mrb_value other);
+  mrb_value (*mrb_str_new)(mrb_state *mrb, const char *pointer, mrb_int length);
+  mrb_value (*mrb_str_new_cstr)(mrb_state *mrb, const char *cstr);
+  const char *(*mrb_string_value_cstr)(mrb_state *mrb, mrb_value *string);
+  const char *(*mrb_sym2name)(mrb_state *mrb, mrb_sym symbol);
+} drb_api_t;
+
+// Fills the API with mruby functions, the JNIEnv and the object standing in for the Android activity
+void drb_api_shim_init(drb_api_t *api, void *jni_env, void *activity);
+
+#endif
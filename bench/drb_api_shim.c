@@ -0,0 +1,101 @@
+#define DRB_API_SHIM_IMPLEMENTATION
+#include "dragonruby.h"
+
+static void *shim_jni_env;
+static void *shim_activity;
+
+static void shim_log_write(const char *subsystem, int level, const char *message) {
+  fprintf(stderr, "[%s] %s\n", subsystem, message);
+}
+
+static void *shim_get_jni_env(void) {
+  return shim_jni_env;
+}
+
+static void *shim_get_sdl_activity(void) {
+  return shim_activity;
+}
+
+// Wrappers for API functions which are macros or inline functions in mruby
+
+static mrb_sym shim_intern_lit(mrb_state *mrb, const char *name) {
+  return mrb_intern_cstr(mrb, name);
+}
+
+static mrb_value shim_float_value(mrb_state *mrb, mrb_float value) {
+  return mrb_float_value(mrb, value);
+}
+
+static int shim_gc_arena_save(mrb_state *mrb) {
+  return mrb_gc_arena_save(mrb);
+}
+
+static void shim_gc_arena_restore(mrb_state *mrb, int index) {
+  mrb_gc_arena_restore(mrb, index);
+}
+
+static mrb_value shim_obj_value(void *pointer) {
+  return mrb_obj_value(pointer);
+}
+
+static const char *shim_sym2name(mrb_state *mrb, mrb_sym symbol) {
+  return mrb_sym_name(mrb, symbol);
+}
+
+static mrb_value shim_str_cat_cstr(mrb_state *mrb, mrb_value string, const char *cstr) {
+  return mrb_str_cat_cstr(mrb, string, cstr);
+}
+
+void drb_api_shim_init(drb_api_t *api, void *jni_env, void *activity) {
+  shim_jni_env = jni_env;
+  shim_activity = activity;
+
+  api->drb_log_write = shim_log_write;
+  api->drb_android_get_jni_env = shim_get_jni_env;
+  api->drb_android_get_sdl_activity = shim_get_sdl_activity;
+
+  api->mrb_ary_new = mrb_ary_new;
+  api->mrb_ary_new_capa = mrb_ary_new_capa;
+  api->mrb_ary_new_from_values = mrb_ary_new_from_values;
+  api->mrb_ary_push = mrb_ary_push;
+  api->mrb_calloc = mrb_calloc;
+  api->mrb_class_get = mrb_class_get;
+  api->mrb_class_get_under = mrb_class_get_under;
+  api->mrb_data_check_get_ptr = mrb_data_check_get_ptr;
+  api->mrb_data_object_alloc = mrb_data_object_alloc;
+  api->mrb_define_class_method = mrb_define_class_method;
+  api->mrb_define_method = mrb_define_method;
+  api->mrb_define_module_under = mrb_define_module_under;
+  api->mrb_equal = mrb_equal;
+  api->mrb_exc_new_str = mrb_exc_new_str;
+  api->mrb_exc_raise = mrb_exc_raise;
+  api->mrb_float_value = shim_float_value;
+  api->mrb_free = mrb_free;
+  api->mrb_gc_arena_restore = shim_gc_arena_restore;
+  api->mrb_gc_arena_save = shim_gc_arena_save;
+  api->mrb_get_args = mrb_get_args;
+  api->mrb_hash_get = mrb_hash_get;
+  api->mrb_hash_keys = mrb_hash_keys;
+  api->mrb_hash_new = mrb_hash_new;
+  api->mrb_hash_set = mrb_hash_set;
+  api->mrb_intern_cstr = mrb_intern_cstr;
+  api->mrb_intern_lit = shim_intern_lit;
+  api->mrb_intern_str = mrb_intern_str;
+  api->mrb_iv_get = mrb_iv_get;
+  api->mrb_iv_set = mrb_iv_set;
+  api->mrb_malloc = mrb_malloc;
+  api->mrb_module_get = mrb_module_get;
+  api->mrb_module_get_under = mrb_module_get_under;
+  api->mrb_obj_is_instance_of = mrb_obj_is_instance_of;
+  api->mrb_obj_value = shim_obj_value;
+  api->mrb_object_dead_p = mrb_object_dead_p;
+  api->mrb_raise = mrb_raise;
+  api->mrb_raisef = mrb_raisef;
+  api->mrb_realloc = mrb_realloc;
+  api->mrb_str_cat_cstr = shim_str_cat_cstr;
+  api->mrb_str_cat_str = mrb_str_cat_str;
+  api->mrb_str_new = mrb_str_new;
+  api->mrb_str_new_cstr = mrb_str_new_cstr;
+  api->mrb_string_value_cstr = mrb_string_value_cstr;
+  api->mrb_sym2name = shim_sym2name;
+}
@@ -0,0 +1,120 @@
+// Runs the FFI benchmarks against a desktop JVM.
+//
+// Usage: jni_bench <class path> <ffi.rb> <benchmarks.rb> <results path>
+
+#include <jni.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <mruby/compile.h>
+
+#include "dragonruby.h"
+
+void drb_register_c_extensions_with_api(mrb_state *mrb, struct drb_api_t *local_drb);
+
+static size_t allocation_count;
+static const char *results_path;
+
+// Counts every allocation made by mruby, including the ones made by jni.c through drb->mrb_malloc & co
+static void *counting_allocf(mrb_state *mrb, void *ptr, size_t size, void *user_data) {
+  if (size == 0) {
+    free(ptr);
+    return NULL;
+  }
+
+  allocation_count++;
+  return realloc(ptr, size);
+}
+
+static mrb_value bench_now_ns_m(mrb_state *mrb, mrb_value self) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return mrb_fixnum_value((mrb_int)now.tv_sec * 1000000000 + now.tv_nsec);
+}
+
+static mrb_value bench_allocation_count_m(mrb_state *mrb, mrb_value self) {
+  return mrb_fixnum_value((mrb_int)allocation_count);
+}
+
+static mrb_value bench_write_results_m(mrb_state *mrb, mrb_value self) {
+  char *contents;
+  mrb_int length;
+  mrb_get_args(mrb, "s", &contents, &length);
+
+  FILE *file = fopen(results_path, "w");
+  if (file == NULL) {
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "Could not open %s", results_path);
+  }
+  fwrite(contents, 1, (size_t)length, file);
+  fclose(file);
+  return mrb_nil_value();
+}
+
+static int load_file(mrb_state *mrb, const char *path) {
+  FILE *file = fopen(path, "r");
+  if (file == NULL) {
+    fprintf(stderr, "Could not open %s\n", path);
+    return 0;
+  }
+
+  mrbc_context *context = mrbc_context_new(mrb);
+  mrbc_filename(mrb, context, path);
+  mrb_load_file_cxt(mrb, file, context);
+  mrbc_context_free(mrb, context);
+  fclose(file);
+
+  if (mrb->exc) {
+    mrb_print_error(mrb);
+    return 0;
+  }
+  return 1;
+}
+
+int main(int argc, char **argv) {
+  if (argc != 5) {
+    fprintf(stderr, "Usage: %s <class path> <ffi.rb> <benchmarks.rb> <results path>\n", argv[0]);
+    return 1;
+  }
+  results_path = argv[4];
+
+  char class_path_option[1024];
+  snprintf(class_path_option, sizeof(class_path_option), "-Djava.class.path=%s", argv[1]);
+  JavaVMOption options[] = {{.optionString = class_path_option}};
+  JavaVMInitArgs vm_args = {
+    .version = JNI_VERSION_1_6,
+    .nOptions = 1,
+    .options = options,
+    .ignoreUnrecognized = JNI_FALSE
+  };
+  JavaVM *vm;
+  JNIEnv *env;
+  if (JNI_CreateJavaVM(&vm, (void **)&env, &vm_args) != JNI_OK) {
+    fprintf(stderr, "Could not create the Java VM\n");
+    return 1;
+  }
+
+  // Any object will do as activity since the benchmarks don't use it
+  jclass object_class = (*env)->FindClass(env, "java/lang/Object");
+  jmethodID object_constructor = (*env)->GetMethodID(env, object_class, "<init>", "()V");
+  jobject activity = (*env)->NewGlobalRef(env, (*env)->NewObject(env, object_class, object_constructor));
+  (*env)->DeleteLocalRef(env, object_class);
+
+  mrb_state *mrb = mrb_open_allocf(counting_allocf, NULL);
+  struct RClass *bench = mrb_define_module(mrb, "Bench");
+  mrb_define_class_method(mrb, bench, "now_ns", bench_now_ns_m, MRB_ARGS_NONE());
+  mrb_define_class_method(mrb, bench, "allocation_count", bench_allocation_count_m, MRB_ARGS_NONE());
+  mrb_define_class_method(mrb, bench, "write_results", bench_write_results_m, MRB_ARGS_REQ(1));
+  mrb_load_string(mrb, "$gtk = Object.new\ndef $gtk.platform?(platform)\n  false\nend");
+
+  int success = load_file(mrb, argv[2]);
+  if (success) {
+    static drb_api_t api;
+    drb_api_shim_init(&api, env, activity);
+    drb_register_c_extensions_with_api(mrb, &api);
+    success = load_file(mrb, argv[3]);
+  }
+
+  mrb_close(mrb);
+  (*vm)->DestroyJavaVM(vm);
+  return success ? 0 : 1;
+}
@@ -1,4 +1,9 @@
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdlib.h>
+#include <time.h>
 #include <dragonruby.h>
 #include <jni.h>
 
@@ -12,10 +17,25 @@ struct references {
   struct RClass *jni_reference;
   struct RClass *jni_pointer;
   struct RClass *jni_exception;
+  struct RClass *jni_java_exception;
+  struct RClass *jni_call_site;
+  struct RClass *jni_command_buffer;
+  struct RClass *jni_future;
+  struct RClass *jni_field_set;
 };
 
 static struct references refs;
 
+// Global references to Java classes and method IDs used by the extension itself
+struct java_references {
+  jclass string_class;
+  jmethodID class_get_name;
+  jmethodID object_to_string;
+  jmethodID throwable_get_message;
+};
+
+static struct java_references java_refs;
+
 // ----- JNI Debugging Helpers -----
 
 static void print_last_jni_exception() {
@@ -36,503 +56,4254 @@ static void drb_log_writef(const char *format, ...) {
 
 // ----- Helper Functions -----
 
+// Copies the string contents directly into a Ruby string of the right size
 static mrb_value jstring_to_mrb_string(mrb_state *mrb, jstring jstring) {
-  const char *cstr = (*jni_env)->GetStringUTFChars(jni_env, jstring, NULL);
-  mrb_value result = drb->mrb_str_new_cstr(mrb, cstr);
-  (*jni_env)->ReleaseStringUTFChars(jni_env, jstring, cstr);
+  jsize length = (*jni_env)->GetStringLength(jni_env, jstring);
+  jsize utf_length = (*jni_env)->GetStringUTFLength(jni_env, jstring);
+  mrb_value result = drb->mrb_str_new(mrb, NULL, utf_length);
+  (*jni_env)->GetStringUTFRegion(jni_env, jstring, 0, length, RSTRING_PTR(result));
+  return result;
+}
+
+// FNV-1a
+static uint32_t hash_bytes(uint32_t hash, const void *data, size_t length) {
+  const uint8_t *bytes = data;
+  for (size_t i = 0; i < length; i++) {
+    hash ^= bytes[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+#define HASH_BYTES_INITIAL_VALUE 2166136261u
+
+static jclass find_global_class(const char *name) {
+  jclass local_class = (*jni_env)->FindClass(jni_env, name);
+  jclass result = (*jni_env)->NewGlobalRef(jni_env, local_class);
+  (*jni_env)->DeleteLocalRef(jni_env, local_class);
   return result;
 }
 
 static jstring get_java_object_class_name(jobject object) {
-  jclass class_class = (*jni_env)->FindClass(jni_env, "java/lang/Class");
-  jmethodID get_name_method = (*jni_env)->GetMethodID(jni_env, class_class, "getName", "()Ljava/lang/String;");
   jclass object_class = (*jni_env)->GetObjectClass(jni_env, object);
-  return (*jni_env)->CallObjectMethod(jni_env, object_class, get_name_method);
+  jstring result = (*jni_env)->CallObjectMethod(jni_env, object_class, java_refs.class_get_name);
+  (*jni_env)->DeleteLocalRef(jni_env, object_class);
+  return result;
 }
 
-static bool jstring_equals_cstr(jstring jstring, const char *expected_cstr) {
-  const char *cstr = (*jni_env)->GetStringUTFChars(jni_env, jstring, NULL);
-  bool result = strcmp(cstr, expected_cstr) == 0;
-  (*jni_env)->ReleaseStringUTFChars(jni_env, jstring, cstr);
-  return result;
+// ----- Intern Tables -----
+
+// Hash tables with byte string keys for values that live as long as the process.
+// Entries are never removed, so global references stored in them can be handed out without being released.
+struct intern_entry {
+  // NULL for empty slots
+  char *key;
+  size_t key_length;
+  uint32_t hash;
+  void *value;
+};
+
+struct intern_table {
+  struct intern_entry *entries;
+  uint32_t size;
+  // Always a power of two
+  uint32_t capacity;
+};
+
+static struct intern_entry *find_intern_entry_slot(struct intern_entry *entries,
+                                                   uint32_t capacity,
+                                                   const void *key,
+                                                   size_t key_length,
+                                                   uint32_t hash) {
+  uint32_t index = hash & (capacity - 1);
+  while (entries[index].key != NULL) {
+    struct intern_entry *entry = &entries[index];
+    if (entry->hash == hash && entry->key_length == key_length && memcmp(entry->key, key, key_length) == 0) {
+      break;
+    }
+    index = (index + 1) & (capacity - 1);
+  }
+  return &entries[index];
 }
 
-// ----- JNI Reference Data Type -----
+static void grow_intern_table(struct intern_table *table) {
+  uint32_t new_capacity = table->capacity == 0 ? 64 : table->capacity * 2;
+  struct intern_entry *new_entries = calloc(new_capacity, sizeof(struct intern_entry));
 
-static const jstring java_object_to_string(jobject object) {
-  jclass class = (*jni_env)->GetObjectClass(jni_env, object);
-  jmethodID to_string_method = (*jni_env)->GetMethodID(jni_env, class, "toString", "()Ljava/lang/String;");
-  return (*jni_env)->CallObjectMethod(jni_env, object, to_string_method);
+  for (uint32_t i = 0; i < table->capacity; i++) {
+    struct intern_entry *entry = &table->entries[i];
+    if (entry->key != NULL) {
+      *find_intern_entry_slot(new_entries, new_capacity, entry->key, entry->key_length, entry->hash) = *entry;
+    }
+  }
+
+  free(table->entries);
+  table->entries = new_entries;
+  table->capacity = new_capacity;
 }
 
-static void jni_reference_free(mrb_state *mrb, void *ptr) {
-  (*jni_env)->DeleteGlobalRef(jni_env, ptr);
+// Returns the entry for the key. If the key is not in the table yet the returned slot has a NULL key
+// and can be filled with intern_table_set before the table is used again.
+static struct intern_entry *intern_table_lookup(struct intern_table *table, const void *key, size_t key_length) {
+  // Keep the load factor at or below 1/2 so that there is always a free slot for a new key
+  if ((table->size + 1) * 2 > table->capacity) {
+    grow_intern_table(table);
+  }
+
+  uint32_t hash = hash_bytes(HASH_BYTES_INITIAL_VALUE, key, key_length);
+  return find_intern_entry_slot(table->entries, table->capacity, key, key_length, hash);
 }
 
-static const mrb_data_type jni_reference_data_type = {
-    "JNI::Reference",
-    jni_reference_free,
-};
+static void intern_table_set(struct intern_table *table,
+                             struct intern_entry *entry,
+                             const void *key,
+                             size_t key_length,
+                             void *value) {
+  // One extra byte so that string keys stay NUL-terminated
+  entry->key = malloc(key_length + 1);
+  memcpy(entry->key, key, key_length);
+  entry->key[key_length] = '\0';
+  entry->key_length = key_length;
+  entry->hash = hash_bytes(HASH_BYTES_INITIAL_VALUE, key, key_length);
+  entry->value = value;
+  table->size++;
+}
 
-static mrb_value wrap_jni_reference_in_object(mrb_state *mrb,
-                                              jobject reference,
-                                              const char *type_name) {
-  jobject global_reference = (*jni_env)->NewGlobalRef(jni_env, reference);
-  struct RData *data = drb->mrb_data_object_alloc(mrb, refs.jni_reference, global_reference, &jni_reference_data_type);
-  mrb_value result = drb->mrb_obj_value(data);
-  drb->mrb_iv_set(mrb, result, drb->mrb_intern_lit(mrb, "@type_name"), drb->mrb_str_new_cstr(mrb, type_name));
+// Java strings for Ruby strings passed as :interned_string arguments
+static struct intern_table interned_strings = {NULL, 0, 0};
+
+// Global jclass references by class name
+static struct intern_table interned_classes = {NULL, 0, 0};
 
-  jstring qualifier = java_object_to_string(reference);
-  drb->mrb_iv_set(mrb, result, drb->mrb_intern_lit(mrb, "@qualifier"), jstring_to_mrb_string(mrb, qualifier));
+// Method and field IDs by interned class, member kind, name and signature
+static struct intern_table interned_member_ids = {NULL, 0, 0};
+
+// Guards interned_classes and interned_member_ids, which are also filled by the warm-up thread
+static pthread_mutex_t intern_tables_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Returns the value for the key or NULL
+static void *find_interned_value(struct intern_table *table, const void *key, size_t key_length) {
+  pthread_mutex_lock(&intern_tables_mutex);
+  struct intern_entry *entry = intern_table_lookup(table, key, key_length);
+  void *result = entry->key != NULL ? entry->value : NULL;
+  pthread_mutex_unlock(&intern_tables_mutex);
   return result;
 }
 
-static jobject unwrap_jni_reference_from_object(mrb_state *mrb, mrb_value object) {
-  return drb->mrb_data_check_get_ptr(mrb, object, &jni_reference_data_type);
+// Stores the value unless another thread stored one for the same key first and returns the value in the table
+static void *publish_interned_value(struct intern_table *table, const void *key, size_t key_length, void *value) {
+  pthread_mutex_lock(&intern_tables_mutex);
+  struct intern_entry *entry = intern_table_lookup(table, key, key_length);
+  if (entry->key == NULL) {
+    intern_table_set(table, entry, key, key_length, value);
+  }
+  void *result = entry->value;
+  pthread_mutex_unlock(&intern_tables_mutex);
+  return result;
 }
 
-// ----- JNI Reference Data Type END -----
+// Returns a global reference owned by the table or NULL if the Java string could not be created
+static jstring intern_string(mrb_state *mrb, mrb_value value) {
+  const char *bytes = drb->mrb_string_value_cstr(mrb, &value);
+  mrb_int length = RSTRING_LEN(value);
 
-// ----- JNI Pointer Data Type -----
+  struct intern_entry *entry = intern_table_lookup(&interned_strings, bytes, length);
+  if (entry->key != NULL) {
+    return entry->value;
+  }
 
-static mrb_value wrap_jni_pointer_in_object(mrb_state *mrb, void *pointer, const char *type_name, mrb_value qualifier) {
-  mrb_value pointer_value = drb->mrb_word_boxing_cptr_value(mrb, pointer);
-  mrb_value result = drb->mrb_obj_new(mrb, refs.jni_pointer, 0, NULL);
-  drb->mrb_iv_set(mrb, result, drb->mrb_intern_lit(mrb, "@pointer"), pointer_value);
-  drb->mrb_iv_set(mrb, result, drb->mrb_intern_lit(mrb, "@type_name"), drb->mrb_str_new_cstr(mrb, type_name));
-  drb->mrb_iv_set(mrb, result, drb->mrb_intern_lit(mrb, "@qualifier"), qualifier);
+  jstring local_string = (*jni_env)->NewStringUTF(jni_env, bytes);
+  if (local_string == NULL) {
+    return NULL;
+  }
+
+  jstring result = (*jni_env)->NewGlobalRef(jni_env, local_string);
+  (*jni_env)->DeleteLocalRef(jni_env, local_string);
+  intern_table_set(&interned_strings, entry, bytes, length, result);
   return result;
 }
 
-static void *unwrap_jni_pointer_from_object(mrb_state *mrb, mrb_value object) {
-  mrb_value pointer_value = drb->mrb_iv_get(mrb, object, drb->mrb_intern_lit(mrb, "@pointer"));
-  return mrb_cptr(pointer_value);
+// ----- Intern Tables END -----
+
+// ----- JNI Reference Data Type -----
+
+static const jstring java_object_to_string(jobject object) {
+  return (*jni_env)->CallObjectMethod(jni_env, object, java_refs.object_to_string);
 }
 
-// ----- JNI Pointer Data Type END -----
+enum jni_reference_type {
+  JNI_REFERENCE_JOBJECT,
+  JNI_REFERENCE_JCLASS
+};
+
+static const char *jni_reference_type_names[] = {
+    "jobject",
+    "jclass",
+};
+
+// ----- Local Reference Frames -----
+
+#define MAX_LOCAL_FRAME_DEPTH 32
+
+// Frames nest strictly, so a local reference is valid as long as the frame it was created in
+// is still on the stack - identified by its depth and a serial that is never reused
+struct local_frames {
+  int depth;
+  uint32_t next_serial;
+  uint32_t serials[MAX_LOCAL_FRAME_DEPTH];
+};
 
-static jstring get_exception_message(jthrowable exception) {
-  jclass exception_class = (*jni_env)->GetObjectClass(jni_env, exception);
-  jmethodID get_message_method = (*jni_env)->GetMethodID(jni_env, exception_class, "getMessage", "()Ljava/lang/String;");
-  return (*jni_env)->CallObjectMethod(jni_env, exception, get_message_method);
+static struct local_frames local_frames = {0, 1, {0}};
+
+static bool inside_local_frame() {
+  return local_frames.depth > 0;
 }
 
-static void handle_jni_exception(mrb_state *mrb) {
-  jthrowable exception = (*jni_env)->ExceptionOccurred(jni_env);
-  if (exception == NULL) {
-    return;
-  }
-  (*jni_env)->ExceptionClear(jni_env);
+static bool local_frame_is_active(int frame_index, uint32_t frame_serial) {
+  return frame_index < local_frames.depth && local_frames.serials[frame_index] == frame_serial;
+}
+
+// ----- Local Reference Frames END -----
 
-  jstring exception_class_name = get_java_object_class_name(exception);
-  mrb_value exception_message = jstring_to_mrb_string(mrb, get_exception_message(exception));
+struct jni_reference {
+  jobject reference;
+  enum jni_reference_type type;
+  // 0 for global references
+  uint32_t frame_serial;
+  int frame_index;
+  // Memory of a direct buffer created by FFI.new_direct_byte_buffer, freed together with the reference
+  void *owned_buffer;
+  // Global reference owned by an intern table which must not be deleted
+  bool is_interned;
+  // Entry of the identity map pointing to this reference or NULL
+  struct identity_map_entry *identity_entry;
+};
 
-  struct RClass *exception_class = drb->mrb_class_get_under(mrb, refs.jni, "JavaException");
+// Global references owned by Reference objects, reported by FFI.stats
+struct global_reference_counts {
+  int64_t live;
+  // Totals since the last FFI.reset_stats
+  int64_t created;
+  int64_t deleted;
+};
 
-  if (jstring_equals_cstr(exception_class_name, "java.lang.ClassNotFoundException")) {
-    exception_class = drb->mrb_class_get_under(mrb, refs.jni, "ClassNotFound");
-  } else if (jstring_equals_cstr(exception_class_name, "java.lang.NoSuchMethodError")) {
-    exception_class = drb->mrb_class_get_under(mrb, refs.jni, "NoSuchMethod");
-  } else if (jstring_equals_cstr(exception_class_name, "java.lang.NoSuchFieldError")) {
-    exception_class = drb->mrb_class_get_under(mrb, refs.jni, "NoSuchField");
-  } else {
-    exception_message = drb->mrb_str_cat_cstr(mrb, exception_message, " (");
-    exception_message = drb->mrb_str_cat_str(mrb, exception_message, jstring_to_mrb_string(mrb, exception_class_name));
-    exception_message = drb->mrb_str_cat_cstr(mrb, exception_message, ")");
-  }
+static struct global_reference_counts global_reference_counts = {0, 0, 0};
 
-  drb->mrb_exc_raise(mrb, drb->mrb_exc_new_str(mrb, exception_class, exception_message));
+static void count_created_global_reference() {
+  global_reference_counts.live++;
+  global_reference_counts.created++;
 }
 
-// ----- JNI to mruby Conversion Functions -----
+static bool jni_reference_is_local(struct jni_reference *reference) {
+  return reference->frame_serial != 0;
+}
 
-#define ASSIGN_JNI_VOID_TO_VARIABLE(varname, value) value
-#define CONVERT_JNI_VOID_TO_MRB_VALUE(varname) mrb_nil_value()
+// ----- Identity Map -----
 
-#define ASSIGN_JNI_OBJECT_TO_VARIABLE(varname, value) jobject varname = value
-#define CONVERT_JNI_OBJECT_TO_MRB_VALUE(varname) convert_jni_object_to_mrb_value(mrb, varname)
-#define CONVERT_MRB_VALUE_TO_JNI_OBJECT(varname) convert_mrb_value_to_jni_object(mrb, varname)
+// While enabled, objects wrapped in global references are mapped to their Reference so that an object
+// returned several times is wrapped only once. Entries are bucketed by System.identityHashCode, compared
+// with IsSameObject and removed when their Reference is freed.
+struct identity_map_entry {
+  jweak object;
+  jint hash;
+  struct RData *wrapper;
+  struct identity_map_entry *next;
+};
 
-static mrb_value convert_jni_object_to_mrb_value(mrb_state *mrb, jobject value) {
-  if (value == NULL) {
-    return mrb_nil_value();
+struct identity_map {
+  bool enabled;
+  struct identity_map_entry **buckets;
+  uint32_t size;
+  // Always a power of two
+  uint32_t bucket_count;
+  jclass system_class;
+  jmethodID identity_hash_code;
+};
+
+static struct identity_map identity_map = {false, NULL, 0, 0, NULL, NULL};
+
+static jint identity_hash_code(jobject object) {
+  return (*jni_env)->CallStaticIntMethod(jni_env, identity_map.system_class, identity_map.identity_hash_code, object);
+}
+
+static struct identity_map_entry **identity_map_bucket(jint hash) {
+  return &identity_map.buckets[(uint32_t)hash & (identity_map.bucket_count - 1)];
+}
+
+static void remove_identity_map_entry(struct identity_map_entry *entry) {
+  struct identity_map_entry **link = identity_map_bucket(entry->hash);
+  while (*link != entry) {
+    link = &(*link)->next;
   }
+  *link = entry->next;
+
+  ((struct jni_reference *)entry->wrapper->data)->identity_entry = NULL;
+  (*jni_env)->DeleteWeakGlobalRef(jni_env, entry->object);
+  free(entry);
+  identity_map.size--;
+}
+
+static void grow_identity_map() {
+  uint32_t new_bucket_count = identity_map.bucket_count == 0 ? 256 : identity_map.bucket_count * 2;
+  struct identity_map_entry **new_buckets = calloc(new_bucket_count, sizeof(struct identity_map_entry *));
 
-  jstring class_name = get_java_object_class_name(value);
-  if (jstring_equals_cstr(class_name, "java.lang.String")) {
-    return jstring_to_mrb_string(mrb, (jstring)value);
+  for (uint32_t i = 0; i < identity_map.bucket_count; i++) {
+    struct identity_map_entry *entry = identity_map.buckets[i];
+    while (entry != NULL) {
+      struct identity_map_entry *next = entry->next;
+      struct identity_map_entry **bucket = &new_buckets[(uint32_t)entry->hash & (new_bucket_count - 1)];
+      entry->next = *bucket;
+      *bucket = entry;
+      entry = next;
+    }
   }
 
-  return wrap_jni_reference_in_object(mrb, value, "jobject");
+  free(identity_map.buckets);
+  identity_map.buckets = new_buckets;
+  identity_map.bucket_count = new_bucket_count;
 }
 
-static jobject convert_mrb_value_to_jni_object(mrb_state *mrb, mrb_value value) {
-  if (mrb_nil_p(value)) {
+// Returns the live Reference wrapping the object or NULL.
+// The identity hash is also returned for add_identity_map_entry.
+static struct RData *find_identity_mapped_wrapper(mrb_state *mrb, jobject object, jint *hash) {
+  *hash = identity_hash_code(object);
+  if (identity_map.size == 0) {
     return NULL;
   }
 
-  if (mrb_string_p(value)) {
-    return (*jni_env)->NewStringUTF(jni_env, drb->mrb_string_value_cstr(mrb, &value));
-  }
+  for (struct identity_map_entry *entry = *identity_map_bucket(*hash); entry != NULL; entry = entry->next) {
+    if (entry->hash != *hash || !(*jni_env)->IsSameObject(jni_env, entry->object, object)) {
+      continue;
+    }
 
-  if (drb->mrb_obj_is_instance_of(mrb, value, refs.jni_reference)) {
-    return unwrap_jni_reference_from_object(mrb, value);
+    // Unreachable wrappers waiting to be swept by the GC must not be handed out again
+    if (drb->mrb_object_dead_p(mrb, (struct RBasic *)entry->wrapper)) {
+      remove_identity_map_entry(entry);
+      return NULL;
+    }
+    return entry->wrapper;
   }
-
-  drb->mrb_raise(mrb, refs.jni_exception, "Unknown type");
   return NULL;
 }
 
-#define ASSIGN_JNI_BOOLEAN_TO_VARIABLE(varname, value) jboolean varname = value
-#define CONVERT_JNI_BOOLEAN_TO_MRB_VALUE(varname) mrb_bool_value(varname)
-#define CONVERT_MRB_VALUE_TO_JNI_BOOLEAN(varname) mrb_bool(varname)
-
-#define ASSIGN_JNI_BYTE_TO_VARIABLE(varname, value) jbyte varname = value
-#define CONVERT_JNI_BYTE_TO_MRB_VALUE(varname) mrb_fixnum_value(varname)
-#define CONVERT_MRB_VALUE_TO_JNI_BYTE(varname) mrb_integer(varname)
+static void add_identity_map_entry(jobject object, jint hash, struct RData *wrapper) {
+  if (identity_map.size >= identity_map.bucket_count) {
+    grow_identity_map();
+  }
 
-#define ASSIGN_JNI_CHAR_TO_VARIABLE(varname, value) jchar varname = value
-#define CONVERT_JNI_CHAR_TO_MRB_VALUE(varname) drb->mrb_str_new_cstr(mrb, (char *)&varname)
-#define CONVERT_MRB_VALUE_TO_JNI_CHAR(varname) RSTRING_PTR(varname)[0]
+  struct identity_map_entry *entry = malloc(sizeof(struct identity_map_entry));
+  entry->object = (*jni_env)->NewWeakGlobalRef(jni_env, object);
+  entry->hash = hash;
+  entry->wrapper = wrapper;
+  struct identity_map_entry **bucket = identity_map_bucket(hash);
+  entry->next = *bucket;
+  *bucket = entry;
+  identity_map.size++;
 
-#define ASSIGN_JNI_SHORT_TO_VARIABLE(varname, value) jshort varname = value
-#define CONVERT_JNI_SHORT_TO_MRB_VALUE(varname) mrb_fixnum_value(varname)
-#define CONVERT_MRB_VALUE_TO_JNI_SHORT(varname) mrb_integer(varname)
+  ((struct jni_reference *)wrapper->data)->identity_entry = entry;
+}
 
-#define ASSIGN_JNI_INT_TO_VARIABLE(varname, value) jint varname = value
-#define CONVERT_JNI_INT_TO_MRB_VALUE(varname) mrb_fixnum_value(varname)
-#define CONVERT_MRB_VALUE_TO_JNI_INT(varname) mrb_integer(varname)
+static void clear_identity_map() {
+  for (uint32_t i = 0; i < identity_map.bucket_count; i++) {
+    while (identity_map.buckets[i] != NULL) {
+      remove_identity_map_entry(identity_map.buckets[i]);
+    }
+  }
+}
 
-#define ASSIGN_JNI_LONG_TO_VARIABLE(varname, value) jlong varname = value
-#define CONVERT_JNI_LONG_TO_MRB_VALUE(varname) mrb_fixnum_value(varname)
-#define CONVERT_MRB_VALUE_TO_JNI_LONG(varname) mrb_integer(varname)
+// ----- Identity Map END -----
 
-#define ASSIGN_JNI_FLOAT_TO_VARIABLE(varname, value) jfloat varname = value
-#define CONVERT_JNI_FLOAT_TO_MRB_VALUE(varname) drb->mrb_float_value(mrb, varname)
-#define CONVERT_MRB_VALUE_TO_JNI_FLOAT(varname) mrb_float(varname)
+static void jni_reference_free(mrb_state *mrb, void *ptr) {
+  struct jni_reference *reference = ptr;
+  if (reference->identity_entry != NULL) {
+    remove_identity_map_entry(reference->identity_entry);
+  }
+  if (reference->is_interned) {
+    // Owned by the intern table
+  } else if (!jni_reference_is_local(reference)) {
+    (*jni_env)->DeleteGlobalRef(jni_env, reference->reference);
+    global_reference_counts.live--;
+    global_reference_counts.deleted++;
+  } else if (local_frame_is_active(reference->frame_index, reference->frame_serial)) {
+    (*jni_env)->DeleteLocalRef(jni_env, reference->reference);
+  }
+  drb->mrb_free(mrb, reference->owned_buffer);
+  drb->mrb_free(mrb, reference);
+}
 
-#define ASSIGN_JNI_DOUBLE_TO_VARIABLE(varname, value) jdouble varname = value
-#define CONVERT_JNI_DOUBLE_TO_MRB_VALUE(varname) drb->mrb_float_value(mrb, varname)
-#define CONVERT_MRB_VALUE_TO_JNI_DOUBLE(varname) mrb_float(varname)
+static const mrb_data_type jni_reference_data_type = {
+    "JNI::Reference",
+    jni_reference_free,
+};
 
-// ----- JNI Methods -----
+static mrb_value wrap_jni_reference_struct_in_object(mrb_state *mrb,
+                                                     jobject reference,
+                                                     enum jni_reference_type type,
+                                                     uint32_t frame_serial) {
+  struct jni_reference *data_reference = drb->mrb_malloc(mrb, sizeof(struct jni_reference));
+  data_reference->reference = reference;
+  data_reference->type = type;
+  data_reference->frame_serial = frame_serial;
+  data_reference->frame_index = local_frames.depth - 1;
+  data_reference->owned_buffer = NULL;
+  data_reference->is_interned = false;
+  data_reference->identity_entry = NULL;
+  struct RData *data = drb->mrb_data_object_alloc(mrb, refs.jni_reference, data_reference, &jni_reference_data_type);
+  return drb->mrb_obj_value(data);
+}
 
-static mrb_value jni_find_class_m(mrb_state *mrb, mrb_value self) {
-  const char *class_name;
-  drb->mrb_get_args(mrb, "z", &class_name);
+// Wraps a reference owned by someone else (the reference itself is left untouched)
+static mrb_value wrap_jni_reference_in_object(mrb_state *mrb,
+                                              jobject reference,
+                                              enum jni_reference_type type) {
+  bool use_identity_map = identity_map.enabled && reference != NULL;
+  jint identity_hash = 0;
+  if (use_identity_map) {
+    struct RData *wrapper = find_identity_mapped_wrapper(mrb, reference, &identity_hash);
+    if (wrapper != NULL && ((struct jni_reference *)wrapper->data)->type == type) {
+      return drb->mrb_obj_value(wrapper);
+    }
+    // An object already mapped with another reference type keeps its entry
+    use_identity_map = wrapper == NULL;
+  }
 
-  jclass class = (*jni_env)->FindClass(jni_env, class_name);
-  handle_jni_exception(mrb);
+  jobject global_reference = (*jni_env)->NewGlobalRef(jni_env, reference);
+  count_created_global_reference();
+  mrb_value result = wrap_jni_reference_struct_in_object(mrb, global_reference, type, 0);
+  if (use_identity_map) {
+    add_identity_map_entry(reference, identity_hash, (struct RData *)mrb_obj_ptr(result));
+  }
+  return result;
+}
 
-  return wrap_jni_reference_in_object(mrb, class, "jclass");
+// Wraps a global reference from an intern table without creating a new reference
+static mrb_value wrap_interned_jni_reference_in_object(mrb_state *mrb,
+                                                       jobject interned_reference,
+                                                       enum jni_reference_type type) {
+  mrb_value result = wrap_jni_reference_struct_in_object(mrb, interned_reference, type, 0);
+  ((struct jni_reference *)DATA_PTR(result))->is_interned = true;
+  return result;
 }
 
-static mrb_value append_to_qualifier_of(mrb_state *mrb, mrb_value qualifier_source, int argc, ...) {
-  mrb_value result = drb->mrb_iv_get(mrb, qualifier_source, drb->mrb_intern_lit(mrb, "@qualifier"));
-  result = drb->mrb_str_dup(mrb, result);
-  va_list args;
-  va_start(args, argc);
-  for (int i = 0; i < argc; i++) {
-    const char *arg = va_arg(args, const char *);
-    result = drb->mrb_str_cat_cstr(mrb, result, arg);
+// Wraps a local reference returned by JNI and takes ownership of it.
+// Inside a local frame it is kept as is, otherwise it is promoted to a global reference.
+static mrb_value wrap_jni_local_reference_in_object(mrb_state *mrb,
+                                                    jobject local_reference,
+                                                    enum jni_reference_type type) {
+  if (inside_local_frame()) {
+    return wrap_jni_reference_struct_in_object(mrb,
+                                               local_reference,
+                                               type,
+                                               local_frames.serials[local_frames.depth - 1]);
   }
-  va_end(args);
+
+  mrb_value result = wrap_jni_reference_in_object(mrb, local_reference, type);
+  (*jni_env)->DeleteLocalRef(jni_env, local_reference);
   return result;
 }
 
-#define GET_ID(identifier, getter_name)\
-  mrb_value class_reference;\
-  const char *name;\
-  const char *signature;\
-  drb->mrb_get_args(mrb, "ozz", &class_reference, &name, &signature);\
-  \
-  jclass class = (jclass)unwrap_jni_reference_from_object(mrb, class_reference);\
-  identifier = (*jni_env)->getter_name(jni_env, class, name, signature);\
-  handle_jni_exception(mrb);
+#define POPPED_LOCAL_REFERENCE_MESSAGE "Local reference used after its frame was popped (use #retain to keep it)"
 
-static mrb_value jni_get_static_method_id_m(mrb_state *mrb, mrb_value self) {
-  GET_ID(jmethodID method_id, GetStaticMethodID);
+static bool jni_reference_is_popped(struct jni_reference *reference) {
+  return jni_reference_is_local(reference) && !local_frame_is_active(reference->frame_index, reference->frame_serial);
+}
 
-  mrb_value qualifier = append_to_qualifier_of(mrb, class_reference, 3, " static ", name, "()");
+static struct jni_reference *unwrap_jni_reference_struct_from_object(mrb_state *mrb, mrb_value object) {
+  struct jni_reference *reference = drb->mrb_data_check_get_ptr(mrb, object, &jni_reference_data_type);
+  if (jni_reference_is_popped(reference)) {
+    drb->mrb_raise(mrb, refs.jni_exception, POPPED_LOCAL_REFERENCE_MESSAGE);
+  }
+  return reference;
+}
 
-  return wrap_jni_pointer_in_object(mrb, method_id, "jmethodID", qualifier);
+static jobject unwrap_jni_reference_from_object(mrb_state *mrb, mrb_value object) {
+  return unwrap_jni_reference_struct_from_object(mrb, object)->reference;
 }
 
-static mrb_value jni_get_method_id_m(mrb_state *mrb, mrb_value self) {
-  GET_ID(jmethodID method_id, GetMethodID);
+// For argument conversions which must not raise before their local references are released.
+// object must be a JNI::Reference. Returns an error message or NULL.
+static const char *unwrap_jni_reference_argument(mrb_state *mrb, mrb_value object, jobject *result) {
+  struct jni_reference *reference = drb->mrb_data_check_get_ptr(mrb, object, &jni_reference_data_type);
+  if (jni_reference_is_popped(reference)) {
+    return POPPED_LOCAL_REFERENCE_MESSAGE;
+  }
+  *result = reference->reference;
+  return NULL;
+}
 
-  mrb_value qualifier = append_to_qualifier_of(mrb, class_reference, 3, " ", name, "()");
+#define NULL_BYTE_IN_STRING_MESSAGE "String argument contains a null byte"
 
-  return wrap_jni_pointer_in_object(mrb, method_id, "jmethodID", qualifier);
+// mrb_string_value_cstr raises for these, so argument conversions check them first
+static bool mrb_string_has_null_byte(mrb_value string) {
+  return memchr(RSTRING_PTR(string), '\0', RSTRING_LEN(string)) != NULL;
 }
 
-static mrb_value jni_get_field_id_m(mrb_state *mrb, mrb_value self) {
-  GET_ID(jfieldID field_id, GetFieldID);
-
-  mrb_value qualifier = append_to_qualifier_of(mrb, class_reference, 2, " ", name);
+// Describes the referenced object via toString() - only computed on demand since it calls into Java
+static mrb_value java_object_qualifier(mrb_state *mrb, jobject object) {
+  jstring qualifier = java_object_to_string(object);
+  if (qualifier == NULL) {
+    (*jni_env)->ExceptionClear(jni_env);
+    return drb->mrb_str_new_cstr(mrb, "null");
+  }
 
-  return wrap_jni_pointer_in_object(mrb, field_id, "jfieldID", qualifier);
+  mrb_value result = jstring_to_mrb_string(mrb, qualifier);
+  (*jni_env)->DeleteLocalRef(jni_env, qualifier);
+  return result;
 }
 
-static mrb_value jni_get_static_field_id_m(mrb_state *mrb, mrb_value self) {
-  GET_ID(jfieldID field_id, GetStaticFieldID);
+static mrb_value jni_reference_type_name_m(mrb_state *mrb, mrb_value self) {
+  struct jni_reference *reference = unwrap_jni_reference_struct_from_object(mrb, self);
+  return drb->mrb_str_new_cstr(mrb, jni_reference_type_names[reference->type]);
+}
 
-  mrb_value qualifier = append_to_qualifier_of(mrb, class_reference, 2, " static ", name);
+static mrb_value jni_reference_qualifier_m(mrb_state *mrb, mrb_value self) {
+  struct jni_reference *reference = unwrap_jni_reference_struct_from_object(mrb, self);
+  return java_object_qualifier(mrb, reference->reference);
+}
 
-  return wrap_jni_pointer_in_object(mrb, field_id, "jfieldID", qualifier);
+static mrb_value jni_reference_retain_m(mrb_state *mrb, mrb_value self) {
+  struct jni_reference *reference = unwrap_jni_reference_struct_from_object(mrb, self);
+  if (jni_reference_is_local(reference)) {
+    jobject local_reference = reference->reference;
+    reference->reference = (*jni_env)->NewGlobalRef(jni_env, local_reference);
+    reference->frame_serial = 0;
+    count_created_global_reference();
+    (*jni_env)->DeleteLocalRef(jni_env, local_reference);
+  }
+  return self;
 }
 
-static mrb_value jni_get_object_class_m(mrb_state *mrb, mrb_value self) {
-  mrb_value object_reference;
-  drb->mrb_get_args(mrb, "o", &object_reference);
+// ----- JNI Reference Data Type END -----
 
-  jobject object = unwrap_jni_reference_from_object(mrb, object_reference);
-  jclass class = (*jni_env)->GetObjectClass(jni_env, object);
-  handle_jni_exception(mrb);
+// ----- JNI Pointer Data Type -----
 
-  return wrap_jni_reference_in_object(mrb, class, "jclass");
+enum jni_pointer_type {
+  JNI_POINTER_METHOD_ID,
+  JNI_POINTER_FIELD_ID
+};
+
+static const char *jni_pointer_type_names[] = {
+    "jmethodID",
+    "jfieldID",
+};
+
+struct jni_pointer {
+  void *pointer;
+  enum jni_pointer_type type;
+  bool is_static;
+  mrb_sym name;
+  mrb_sym signature;
+  // Only kept to build the qualifier
+  jclass class;
+  // Classes from the intern table are borrowed
+  bool owns_class;
+};
+
+static void jni_pointer_free(mrb_state *mrb, void *ptr) {
+  struct jni_pointer *pointer = ptr;
+  if (pointer->owns_class) {
+    (*jni_env)->DeleteGlobalRef(jni_env, pointer->class);
+  }
+  drb->mrb_free(mrb, pointer);
 }
 
-static jvalue *convert_mrb_args_to_jni_args(mrb_state *mrb,
-                                            mrb_value *args,
-                                            mrb_int argc,
-                                            mrb_value argument_types_array) {
-  jvalue *jni_args = drb->mrb_malloc(mrb, sizeof(jvalue) * argc);
+static const mrb_data_type jni_pointer_data_type = {
+    "JNI::Pointer",
+    jni_pointer_free,
+};
 
-  // error message
-  char *error_message = NULL;
-  int error_argument_index = -1;
+static mrb_value wrap_jni_pointer_in_object(mrb_state *mrb,
+                                            void *pointer,
+                                            enum jni_pointer_type type,
+                                            bool is_static,
+                                            struct jni_reference *class,
+                                            const char *name,
+                                            const char *signature) {
+  struct jni_pointer *data_pointer = drb->mrb_malloc(mrb, sizeof(struct jni_pointer));
+  data_pointer->pointer = pointer;
+  data_pointer->type = type;
+  data_pointer->is_static = is_static;
+  data_pointer->name = drb->mrb_intern_cstr(mrb, name);
+  data_pointer->signature = drb->mrb_intern_cstr(mrb, signature);
+  data_pointer->owns_class = !class->is_interned;
+  data_pointer->class = class->is_interned ? class->reference : (*jni_env)->NewGlobalRef(jni_env, class->reference);
+  struct RData *data = drb->mrb_data_object_alloc(mrb, refs.jni_pointer, data_pointer, &jni_pointer_data_type);
+  return drb->mrb_obj_value(data);
+}
 
-  for (int i = 0; i < argc; i++) {
-    mrb_value type = RARRAY_PTR(argument_types_array)[i];
+static struct jni_pointer *unwrap_jni_pointer_struct_from_object(mrb_state *mrb, mrb_value object) {
+  return drb->mrb_data_check_get_ptr(mrb, object, &jni_pointer_data_type);
+}
 
-    if (mrb_symbol_p(type)) {
-      const char *type_name = drb->mrb_sym2name(mrb, mrb_symbol(type));
+static void *unwrap_jni_pointer_from_object(mrb_state *mrb, mrb_value object) {
+  return unwrap_jni_pointer_struct_from_object(mrb, object)->pointer;
+}
 
-      if (strcmp(type_name, "boolean") == 0) {
-        if (mrb_true_p(args[i]) || mrb_false_p(args[i])) {
-          jni_args[i].z = (jboolean)mrb_bool(args[i]);
-        } else {
-          error_message = "Expected boolean argument";
-        }
-      } else if (strcmp(type_name, "byte") == 0) {
-        if (mrb_integer_p(args[i])) {
-          jni_args[i].b = (jbyte)mrb_integer(args[i]);
-        } else {
-          error_message = "Expected byte argument";
-        }
-      } else if (strcmp(type_name, "char") == 0) {
-        if (mrb_string_p(args[i]) && RSTRING_LEN(args[i]) == 1) {
-          jni_args[i].c = (jchar)RSTRING_PTR(args[i])[0];
-        } else {
-          error_message = "Expected char argument";
-        }
-      } else if (strcmp(type_name, "short") == 0) {
-        if (mrb_integer_p(args[i])) {
-          jni_args[i].s = (jshort)mrb_integer(args[i]);
-        } else {
-          error_message = "Expected short argument";
-        }
-      } else if (strcmp(type_name, "int") == 0) {
-        if (mrb_integer_p(args[i])) {
-          jni_args[i].i = (jint)mrb_integer(args[i]);
-        } else {
-          error_message = "Expected int argument";
-        }
-      } else if (strcmp(type_name, "long") == 0) {
-        if (mrb_integer_p(args[i])) {
-          jni_args[i].j = (jlong)mrb_integer(args[i]);
-        } else {
-          error_message = "Expected long argument";
-        }
-      } else if (strcmp(type_name, "float") == 0) {
-        if (mrb_float_p(args[i])) {
-          jni_args[i].f = (jfloat)mrb_float(args[i]);
-        } else {
-          error_message = "Expected float argument";
-        }
-      } else if (strcmp(type_name, "double") == 0) {
-        if (mrb_float_p(args[i])) {
-          jni_args[i].d = (jdouble)mrb_float(args[i]);
-        } else {
-          error_message = "Expected double argument";
-        }
-      } else if (strcmp(type_name, "string") == 0) {
-        if (mrb_string_p(args[i])) {
-          jni_args[i].l = (*jni_env)->NewStringUTF(jni_env, drb->mrb_string_value_cstr(mrb, &args[i]));
-        } else if (mrb_nil_p(args[i])) {
-          jni_args[i].l = NULL;
-        } else {
-          error_message = "Expected string argument or nil";
-        }
-      } else {
-        error_message = "Unknown type symbol";
-      }
-    } else if (mrb_string_p(type)) {
-      // Java class type
-      if (drb->mrb_obj_is_instance_of(mrb, args[i], refs.jni_reference)) {
-        jobject obj = unwrap_jni_reference_from_object(mrb, args[i]);
-        jni_args[i].l = obj;
-      } else if (mrb_nil_p(args[i])) {
-        jni_args[i].l = NULL;
-      } else {
-        error_message = "Expected JNI::Reference object or nil";
-      }
-    } else {
-      error_message = "Type must be a symbol or string";
-    }
+static mrb_value jni_pointer_type_name_m(mrb_state *mrb, mrb_value self) {
+  struct jni_pointer *pointer = unwrap_jni_pointer_struct_from_object(mrb, self);
+  return drb->mrb_str_new_cstr(mrb, jni_pointer_type_names[pointer->type]);
+}
 
-    if (error_message) {
-      error_argument_index = i;
-      break;
-    }
+static mrb_value member_qualifier(mrb_state *mrb,
+                                  jclass class,
+                                  enum jni_pointer_type type,
+                                  bool is_static,
+                                  mrb_sym name) {
+  mrb_value result = java_object_qualifier(mrb, class);
+  result = drb->mrb_str_cat_cstr(mrb, result, is_static ? " static " : " ");
+  result = drb->mrb_str_cat_cstr(mrb, result, drb->mrb_sym2name(mrb, name));
+  if (type == JNI_POINTER_METHOD_ID) {
+    result = drb->mrb_str_cat_cstr(mrb, result, "()");
   }
+  return result;
+}
 
-  if (error_message) {
-    drb->mrb_free(mrb, jni_args);
-    struct RClass *exception_class = drb->mrb_class_get_under(mrb, refs.jni, "WrongArgumentType");
-    drb->mrb_raisef(mrb, exception_class, "Argument %d: %s", error_argument_index + 1, error_message);
-  }
+static mrb_value jni_pointer_qualifier_m(mrb_state *mrb, mrb_value self) {
+  struct jni_pointer *pointer = unwrap_jni_pointer_struct_from_object(mrb, self);
+  return member_qualifier(mrb, pointer->class, pointer->type, pointer->is_static, pointer->name);
+}
 
-  return jni_args;
+static mrb_value jni_pointer_signature_m(mrb_state *mrb, mrb_value self) {
+  struct jni_pointer *pointer = unwrap_jni_pointer_struct_from_object(mrb, self);
+  return drb->mrb_str_new_cstr(mrb, drb->mrb_sym2name(mrb, pointer->signature));
 }
 
-#define CALL_METHOD_BEGINNING\
-  mrb_value object_reference;\
-  mrb_value method_id_reference;\
-  mrb_value argument_types_array;\
-  mrb_value *args;\
-  mrb_int argc;\
-  drb->mrb_get_args(mrb, "ooo*", &object_reference, &method_id_reference, &argument_types_array, &args, &argc);\
-  \
-  jobject object = unwrap_jni_reference_from_object(mrb, object_reference);\
-  jmethodID method_id = (jmethodID)unwrap_jni_pointer_from_object(mrb, method_id_reference);\
-  \
-  if (!mrb_array_p(argument_types_array) || RARRAY_LEN(argument_types_array) != argc) {\
-    drb->mrb_raise(mrb, refs.jni_exception, "argument_types must be an array with the same length as args");\
-  }\
-  \
-  jvalue *jni_args = convert_mrb_args_to_jni_args(mrb, args, argc, argument_types_array);
+// ----- JNI Pointer Data Type END -----
 
-#define CALL_METHOD_CLEANUP\
-  drb->mrb_free(mrb, jni_args);\
+// ----- FFI Statistics -----
+
+// Calls through FFI methods, call sites and command buffers are counted per member while enabled with
+// FFI.stats_enabled = true. While disabled every instrumented call only checks the flag.
+// Async calls are not counted since they run on the worker thread.
+struct member_stats {
+  // NULL for empty slots
+  void *member_id;
+  // Method and field IDs can have the same value, so the rest of the member identifies the entry too
+  enum jni_pointer_type type;
+  bool is_static;
+  mrb_sym name;
+  mrb_sym signature;
+  // Global reference owned by the entry
+  jclass class;
+  uint64_t call_count;
+  uint64_t exception_count;
+  uint64_t total_ns;
+  uint64_t max_ns;
+};
+
+struct ffi_stats {
+  bool enabled;
+  struct member_stats *entries;
+  uint32_t size;
+  // Always a power of two
+  uint32_t capacity;
+};
+
+static struct ffi_stats ffi_stats = {false, NULL, 0, 0};
+
+static uint64_t monotonic_time_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+// Returns 0 while disabled
+static uint64_t start_stats_timer() {
+  return ffi_stats.enabled ? monotonic_time_ns() : 0;
+}
+
+static uint32_t hash_member_stats_key(void *member_id, enum jni_pointer_type type, bool is_static) {
+  uint32_t hash = hash_bytes(HASH_BYTES_INITIAL_VALUE, &member_id, sizeof(member_id));
+  hash = hash_bytes(hash, &type, sizeof(type));
+  return hash_bytes(hash, &is_static, sizeof(is_static));
+}
+
+static bool member_stats_matches(struct member_stats *entry,
+                                 void *member_id,
+                                 enum jni_pointer_type type,
+                                 bool is_static,
+                                 mrb_sym name,
+                                 mrb_sym signature,
+                                 jclass class) {
+  return entry->member_id == member_id &&
+         entry->type == type &&
+         entry->is_static == is_static &&
+         entry->name == name &&
+         entry->signature == signature &&
+         (*jni_env)->IsSameObject(jni_env, entry->class, class);
+}
+
+static struct member_stats *find_member_stats_slot(struct member_stats *entries,
+                                                   uint32_t capacity,
+                                                   void *member_id,
+                                                   enum jni_pointer_type type,
+                                                   bool is_static,
+                                                   mrb_sym name,
+                                                   mrb_sym signature,
+                                                   jclass class) {
+  uint32_t index = hash_member_stats_key(member_id, type, is_static) & (capacity - 1);
+  while (entries[index].member_id != NULL &&
+         !member_stats_matches(&entries[index], member_id, type, is_static, name, signature, class)) {
+    index = (index + 1) & (capacity - 1);
+  }
+  return &entries[index];
+}
+
+static void grow_member_stats(struct ffi_stats *stats) {
+  uint32_t new_capacity = stats->capacity == 0 ? 64 : stats->capacity * 2;
+  struct member_stats *new_entries = calloc(new_capacity, sizeof(struct member_stats));
+
+  for (uint32_t i = 0; i < stats->capacity; i++) {
+    struct member_stats *entry = &stats->entries[i];
+    if (entry->member_id != NULL) {
+      struct member_stats *slot = find_member_stats_slot(new_entries,
+                                                         new_capacity,
+                                                         entry->member_id,
+                                                         entry->type,
+                                                         entry->is_static,
+                                                         entry->name,
+                                                         entry->signature,
+                                                         entry->class);
+      *slot = *entry;
+    }
+  }
+
+  free(stats->entries);
+  stats->entries = new_entries;
+  stats->capacity = new_capacity;
+}
+
+static struct member_stats *get_member_stats(struct jni_pointer *member) {
+  if ((ffi_stats.size + 1) * 2 > ffi_stats.capacity) {
+    grow_member_stats(&ffi_stats);
+  }
+
+  struct member_stats *entry = find_member_stats_slot(ffi_stats.entries,
+                                                      ffi_stats.capacity,
+                                                      member->pointer,
+                                                      member->type,
+                                                      member->is_static,
+                                                      member->name,
+                                                      member->signature,
+                                                      member->class);
+  if (entry->member_id == NULL) {
+    entry->member_id = member->pointer;
+    entry->type = member->type;
+    entry->is_static = member->is_static;
+    entry->name = member->name;
+    entry->signature = member->signature;
+    entry->class = (*jni_env)->NewGlobalRef(jni_env, member->class);
+    ffi_stats.size++;
+  }
+  return entry;
+}
+
+// Must be called before a pending Java exception is cleared so that it is counted
+static void record_member_stats(struct jni_pointer *member, uint64_t start_ns) {
+  if (!ffi_stats.enabled || start_ns == 0) {
+    return;
+  }
+
+  uint64_t elapsed_ns = monotonic_time_ns() - start_ns;
+  struct member_stats *entry = get_member_stats(member);
+  entry->call_count++;
+  entry->total_ns += elapsed_ns;
+  if (elapsed_ns > entry->max_ns) {
+    entry->max_ns = elapsed_ns;
+  }
+  if ((*jni_env)->ExceptionCheck(jni_env)) {
+    entry->exception_count++;
+  }
+}
+
+// Like the member qualifier but with the signature, e.g. "class java.lang.Integer static valueOf(I)Ljava/lang/Integer;"
+// for methods and "class java.lang.Integer static MAX_VALUE:I" for fields, so that overloads are told apart
+static mrb_value member_stats_key(mrb_state *mrb, struct member_stats *entry) {
+  mrb_value result = java_object_qualifier(mrb, entry->class);
+  result = drb->mrb_str_cat_cstr(mrb, result, entry->is_static ? " static " : " ");
+  result = drb->mrb_str_cat_cstr(mrb, result, drb->mrb_sym2name(mrb, entry->name));
+  if (entry->type == JNI_POINTER_FIELD_ID) {
+    result = drb->mrb_str_cat_cstr(mrb, result, ":");
+  }
+  return drb->mrb_str_cat_cstr(mrb, result, drb->mrb_sym2name(mrb, entry->signature));
+}
+
+static void reset_member_stats() {
+  for (uint32_t i = 0; i < ffi_stats.capacity; i++) {
+    struct member_stats *entry = &ffi_stats.entries[i];
+    if (entry->member_id != NULL) {
+      (*jni_env)->DeleteGlobalRef(jni_env, entry->class);
+    }
+  }
+  free(ffi_stats.entries);
+  ffi_stats.entries = NULL;
+  ffi_stats.size = 0;
+  ffi_stats.capacity = 0;
+}
+
+// ----- FFI Statistics END -----
+
+static mrb_value get_exception_message(mrb_state *mrb, jthrowable exception) {
+  jstring message = (*jni_env)->CallObjectMethod(jni_env, exception, java_refs.throwable_get_message);
+  if (message == NULL) {
+    return drb->mrb_str_new_cstr(mrb, "");
+  }
+
+  mrb_value result = jstring_to_mrb_string(mrb, message);
+  (*jni_env)->DeleteLocalRef(jni_env, message);
+  return result;
+}
+
+// ----- Exception Mapping -----
+
+#define MAX_EXCEPTION_MAPPINGS 64
+
+struct exception_mapping {
+  // Global reference
+  jclass java_class;
+  struct RClass *ruby_class;
+};
+
+struct exception_mappings {
+  int size;
+  struct exception_mapping entries[MAX_EXCEPTION_MAPPINGS];
+};
+
+static struct exception_mappings exception_mappings = {0};
+
+static void clear_exception_mappings() {
+  for (int i = 0; i < exception_mappings.size; i++) {
+    (*jni_env)->DeleteGlobalRef(jni_env, exception_mappings.entries[i].java_class);
+  }
+  exception_mappings.size = 0;
+}
+
+static bool mrb_class_inherits_from(struct RClass *klass, struct RClass *superclass) {
+  for (struct RClass *current = klass; current != NULL; current = current->super) {
+    if (current == superclass) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Takes ownership of the global class reference
+static void map_exception(mrb_state *mrb, jclass java_class, struct RClass *ruby_class) {
+  for (int i = 0; i < exception_mappings.size; i++) {
+    struct exception_mapping *mapping = &exception_mappings.entries[i];
+    if ((*jni_env)->IsSameObject(jni_env, mapping->java_class, java_class)) {
+      (*jni_env)->DeleteGlobalRef(jni_env, java_class);
+      mapping->ruby_class = ruby_class;
+      return;
+    }
+  }
+
+  if (exception_mappings.size >= MAX_EXCEPTION_MAPPINGS) {
+    (*jni_env)->DeleteGlobalRef(jni_env, java_class);
+    drb->mrb_raise(mrb, refs.jni_exception, "Too many exception mappings");
+  }
+
+  struct exception_mapping *mapping = &exception_mappings.entries[exception_mappings.size++];
+  mapping->java_class = java_class;
+  mapping->ruby_class = ruby_class;
+}
+
+// Returns the mapping of the most specific mapped superclass of the exception or NULL
+static struct exception_mapping *find_exception_mapping(jthrowable exception) {
+  struct exception_mapping *result = NULL;
+  for (int i = 0; i < exception_mappings.size; i++) {
+    struct exception_mapping *mapping = &exception_mappings.entries[i];
+    if (!(*jni_env)->IsInstanceOf(jni_env, exception, mapping->java_class)) {
+      continue;
+    }
+    if (result == NULL || (*jni_env)->IsAssignableFrom(jni_env, mapping->java_class, result->java_class)) {
+      result = mapping;
+    }
+  }
+  return result;
+}
+
+// ----- Exception Mapping END -----
+
+// Clears the pending Java exception and returns it as Ruby exception
+static mrb_value take_pending_jni_exception(mrb_state *mrb) {
+  jthrowable exception = (*jni_env)->ExceptionOccurred(jni_env);
+  (*jni_env)->ExceptionClear(jni_env);
+
+  mrb_value exception_message = get_exception_message(mrb, exception);
+  struct exception_mapping *mapping = find_exception_mapping(exception);
+  struct RClass *exception_class;
+
+  if (mapping != NULL) {
+    exception_class = mapping->ruby_class;
+  } else {
+    exception_class = refs.jni_java_exception;
+    jstring exception_class_name = get_java_object_class_name(exception);
+    exception_message = drb->mrb_str_cat_cstr(mrb, exception_message, " (");
+    exception_message = drb->mrb_str_cat_str(mrb, exception_message, jstring_to_mrb_string(mrb, exception_class_name));
+    exception_message = drb->mrb_str_cat_cstr(mrb, exception_message, ")");
+    (*jni_env)->DeleteLocalRef(jni_env, exception_class_name);
+  }
+  (*jni_env)->DeleteLocalRef(jni_env, exception);
+
+  return drb->mrb_exc_new_str(mrb, exception_class, exception_message);
+}
+
+static void handle_jni_exception(mrb_state *mrb) {
+  // Fast path without creating any local reference
+  if (!(*jni_env)->ExceptionCheck(jni_env)) {
+    return;
+  }
+
+  drb->mrb_exc_raise(mrb, take_pending_jni_exception(mrb));
+}
+
+// ----- JNI to mruby Conversion Functions -----
+
+#define ASSIGN_JNI_VOID_TO_VARIABLE(varname, value) value
+#define CONVERT_JNI_VOID_TO_MRB_VALUE(varname) mrb_nil_value()
+
+#define ASSIGN_JNI_OBJECT_TO_VARIABLE(varname, value) jobject varname = value
+#define JNI_OBJECT_JVALUE_MEMBER l
+#define CONVERT_JNI_OBJECT_TO_MRB_VALUE(varname) convert_jni_object_to_mrb_value(mrb, varname)
+#define CONVERT_MRB_VALUE_TO_JNI_OBJECT(varname) convert_mrb_value_to_jni_object(mrb, varname)
+// Strings are converted to new local references which are not needed after the call
+#define RELEASE_CONVERTED_JNI_OBJECT(varname, mrb_varname)\
+  if (mrb_string_p(mrb_varname)) {\
+    (*jni_env)->DeleteLocalRef(jni_env, varname);\
+  }
+
+struct boxed_type;
+static struct boxed_type *find_boxed_type(jobject object);
+static mrb_value unbox_jni_object(mrb_state *mrb, struct boxed_type *boxed_type, jobject object);
+
+// may_be_boxed is false when the declared type (e.g. of a call site) cannot hold a boxed primitive
+static mrb_value convert_jni_reference_to_mrb_value(mrb_state *mrb, jobject value, bool may_be_boxed) {
+  if (value == NULL) {
+    return mrb_nil_value();
+  }
+
+  if ((*jni_env)->IsInstanceOf(jni_env, value, java_refs.string_class)) {
+    mrb_value result = jstring_to_mrb_string(mrb, (jstring)value);
+    (*jni_env)->DeleteLocalRef(jni_env, value);
+    return result;
+  }
+
+  // Boxed primitives (e.g. from generic methods) are unboxed to save the xxxValue call from Ruby
+  struct boxed_type *boxed_type = may_be_boxed ? find_boxed_type(value) : NULL;
+  if (boxed_type != NULL) {
+    mrb_value result = unbox_jni_object(mrb, boxed_type, value);
+    (*jni_env)->DeleteLocalRef(jni_env, value);
+    return result;
+  }
+
+  return wrap_jni_local_reference_in_object(mrb, value, JNI_REFERENCE_JOBJECT);
+}
+
+static mrb_value convert_jni_object_to_mrb_value(mrb_state *mrb, jobject value) {
+  return convert_jni_reference_to_mrb_value(mrb, value, true);
+}
+
+static jobject convert_mrb_value_to_jni_object(mrb_state *mrb, mrb_value value) {
+  if (mrb_nil_p(value)) {
+    return NULL;
+  }
+
+  if (mrb_string_p(value)) {
+    return (*jni_env)->NewStringUTF(jni_env, drb->mrb_string_value_cstr(mrb, &value));
+  }
+
+  if (drb->mrb_obj_is_instance_of(mrb, value, refs.jni_reference)) {
+    return unwrap_jni_reference_from_object(mrb, value);
+  }
+
+  drb->mrb_raise(mrb, refs.jni_exception, "Unknown type");
+  return NULL;
+}
+
+// Encodes the UTF-16 code unit as UTF-8 (surrogates are encoded separately)
+static mrb_value convert_jni_char_to_mrb_string(mrb_state *mrb, jchar value) {
+  char bytes[3];
+  mrb_int length;
+  if (value < 0x80) {
+    bytes[0] = (char)value;
+    length = 1;
+  } else if (value < 0x800) {
+    bytes[0] = (char)(0xC0 | (value >> 6));
+    bytes[1] = (char)(0x80 | (value & 0x3F));
+    length = 2;
+  } else {
+    bytes[0] = (char)(0xE0 | (value >> 12));
+    bytes[1] = (char)(0x80 | ((value >> 6) & 0x3F));
+    bytes[2] = (char)(0x80 | (value & 0x3F));
+    length = 3;
+  }
+  return drb->mrb_str_new(mrb, bytes, length);
+}
+
+// Returns the UTF-16 code unit of a String holding a single UTF-8 encoded character up to U+FFFF or -1.
+// Surrogates are accepted so that everything convert_jni_char_to_mrb_string returns can be passed back.
+static int32_t decode_mrb_string_to_jni_char(mrb_value string) {
+  const unsigned char *bytes = (const unsigned char *)RSTRING_PTR(string);
+  mrb_int length = RSTRING_LEN(string);
+
+  if (length == 1 && bytes[0] < 0x80) {
+    return bytes[0];
+  }
+  if (length == 2 && (bytes[0] & 0xE0) == 0xC0 && (bytes[1] & 0xC0) == 0x80) {
+    int32_t value = ((bytes[0] & 0x1F) << 6) | (bytes[1] & 0x3F);
+    // Overlong encodings are invalid UTF-8
+    return value >= 0x80 ? value : -1;
+  }
+  if (length == 3 && (bytes[0] & 0xF0) == 0xE0 && (bytes[1] & 0xC0) == 0x80 && (bytes[2] & 0xC0) == 0x80) {
+    int32_t value = ((bytes[0] & 0x0F) << 12) | ((bytes[1] & 0x3F) << 6) | (bytes[2] & 0x3F);
+    return value >= 0x800 ? value : -1;
+  }
+  return -1;
+}
+
+#define ASSIGN_JNI_BOOLEAN_TO_VARIABLE(varname, value) jboolean varname = value
+#define JNI_BOOLEAN_JVALUE_MEMBER z
+#define CONVERT_JNI_BOOLEAN_TO_MRB_VALUE(varname) mrb_bool_value(varname)
+#define CONVERT_MRB_VALUE_TO_JNI_BOOLEAN(varname) mrb_bool(varname)
+#define RELEASE_CONVERTED_JNI_BOOLEAN(varname, mrb_varname)
+#define IS_MRB_VALUE_JNI_BOOLEAN(value) (mrb_true_p(value) || mrb_false_p(value))
+
+#define ASSIGN_JNI_BYTE_TO_VARIABLE(varname, value) jbyte varname = value
+#define JNI_BYTE_JVALUE_MEMBER b
+#define CONVERT_JNI_BYTE_TO_MRB_VALUE(varname) mrb_fixnum_value(varname)
+#define CONVERT_MRB_VALUE_TO_JNI_BYTE(varname) mrb_integer(varname)
+#define RELEASE_CONVERTED_JNI_BYTE(varname, mrb_varname)
+#define IS_MRB_VALUE_JNI_BYTE(value) mrb_integer_p(value)
+
+#define ASSIGN_JNI_CHAR_TO_VARIABLE(varname, value) jchar varname = value
+#define JNI_CHAR_JVALUE_MEMBER c
+#define CONVERT_JNI_CHAR_TO_MRB_VALUE(varname) convert_jni_char_to_mrb_string(mrb, varname)
+#define CONVERT_MRB_VALUE_TO_JNI_CHAR(varname) (jchar)decode_mrb_string_to_jni_char(varname)
+#define RELEASE_CONVERTED_JNI_CHAR(varname, mrb_varname)
+#define IS_MRB_VALUE_JNI_CHAR(value) (mrb_string_p(value) && decode_mrb_string_to_jni_char(value) >= 0)
+
+#define ASSIGN_JNI_SHORT_TO_VARIABLE(varname, value) jshort varname = value
+#define JNI_SHORT_JVALUE_MEMBER s
+#define CONVERT_JNI_SHORT_TO_MRB_VALUE(varname) mrb_fixnum_value(varname)
+#define CONVERT_MRB_VALUE_TO_JNI_SHORT(varname) mrb_integer(varname)
+#define RELEASE_CONVERTED_JNI_SHORT(varname, mrb_varname)
+#define IS_MRB_VALUE_JNI_SHORT(value) mrb_integer_p(value)
+
+#define ASSIGN_JNI_INT_TO_VARIABLE(varname, value) jint varname = value
+#define JNI_INT_JVALUE_MEMBER i
+#define CONVERT_JNI_INT_TO_MRB_VALUE(varname) mrb_fixnum_value(varname)
+#define CONVERT_MRB_VALUE_TO_JNI_INT(varname) mrb_integer(varname)
+#define RELEASE_CONVERTED_JNI_INT(varname, mrb_varname)
+#define IS_MRB_VALUE_JNI_INT(value) mrb_integer_p(value)
+
+#define ASSIGN_JNI_LONG_TO_VARIABLE(varname, value) jlong varname = value
+#define JNI_LONG_JVALUE_MEMBER j
+#define CONVERT_JNI_LONG_TO_MRB_VALUE(varname) mrb_fixnum_value(varname)
+#define CONVERT_MRB_VALUE_TO_JNI_LONG(varname) mrb_integer(varname)
+#define RELEASE_CONVERTED_JNI_LONG(varname, mrb_varname)
+#define IS_MRB_VALUE_JNI_LONG(value) mrb_integer_p(value)
+
+#define ASSIGN_JNI_FLOAT_TO_VARIABLE(varname, value) jfloat varname = value
+#define JNI_FLOAT_JVALUE_MEMBER f
+#define CONVERT_JNI_FLOAT_TO_MRB_VALUE(varname) drb->mrb_float_value(mrb, varname)
+#define CONVERT_MRB_VALUE_TO_JNI_FLOAT(varname) mrb_float(varname)
+#define RELEASE_CONVERTED_JNI_FLOAT(varname, mrb_varname)
+#define IS_MRB_VALUE_JNI_FLOAT(value) mrb_float_p(value)
+
+#define ASSIGN_JNI_DOUBLE_TO_VARIABLE(varname, value) jdouble varname = value
+#define JNI_DOUBLE_JVALUE_MEMBER d
+#define CONVERT_JNI_DOUBLE_TO_MRB_VALUE(varname) drb->mrb_float_value(mrb, varname)
+#define CONVERT_MRB_VALUE_TO_JNI_DOUBLE(varname) mrb_float(varname)
+#define RELEASE_CONVERTED_JNI_DOUBLE(varname, mrb_varname)
+#define IS_MRB_VALUE_JNI_DOUBLE(value) mrb_float_p(value)
+
+// ----- JNI Methods -----
+
+// Returns NULL with a pending Java exception if the class could not be found
+static jclass find_interned_class(const char *class_name) {
+  size_t class_name_length = strlen(class_name);
+  jclass interned_class = find_interned_value(&interned_classes, class_name, class_name_length);
+  if (interned_class != NULL) {
+    return interned_class;
+  }
+
+  jclass class = (*jni_env)->FindClass(jni_env, class_name);
+  if (class == NULL) {
+    return NULL;
+  }
+
+  jclass global_class = (*jni_env)->NewGlobalRef(jni_env, class);
+  (*jni_env)->DeleteLocalRef(jni_env, class);
+  interned_class = publish_interned_value(&interned_classes, class_name, class_name_length, global_class);
+  if (interned_class != global_class) {
+    // Loaded by the warm-up thread in the meantime
+    (*jni_env)->DeleteGlobalRef(jni_env, global_class);
+  }
+  return interned_class;
+}
+
+static mrb_value jni_find_class_m(mrb_state *mrb, mrb_value self) {
+  const char *class_name;
+  drb->mrb_get_args(mrb, "z", &class_name);
+
+  jclass interned_class = find_interned_class(class_name);
   handle_jni_exception(mrb);
 
-#define FOR_JNI_TYPE(type, type_pascal_case, type_upper_case)\
-static mrb_value jni_call_static_##type##_method_m(mrb_state *mrb, mrb_value self) {\
-  CALL_METHOD_BEGINNING;\
-  \
-  ASSIGN_JNI_##type_upper_case##_TO_VARIABLE(\
-    jni_result,\
-    (*jni_env)->CallStatic##type_pascal_case##MethodA(jni_env, (jclass)object, method_id, jni_args)\
-  );\
-  \
-  CALL_METHOD_CLEANUP;\
-  \
-  return CONVERT_JNI_##type_upper_case##_TO_MRB_VALUE(jni_result);\
-}\
-\
-static mrb_value jni_call_##type##_method_m(mrb_state *mrb, mrb_value self) {\
-  CALL_METHOD_BEGINNING;\
-  \
-  ASSIGN_JNI_##type_upper_case##_TO_VARIABLE(\
-    jni_result,\
-    (*jni_env)->Call##type_pascal_case##MethodA(jni_env, object, method_id, jni_args)\
-  );\
-  \
-  CALL_METHOD_CLEANUP;\
-  \
-  return CONVERT_JNI_##type_upper_case##_TO_MRB_VALUE(jni_result);\
+  return wrap_interned_jni_reference_in_object(mrb, interned_class, JNI_REFERENCE_JCLASS);
+}
+
+enum member_kind {
+  MEMBER_METHOD,
+  MEMBER_STATIC_METHOD,
+  MEMBER_FIELD,
+  MEMBER_STATIC_FIELD
+};
+
+#define MAX_MEMBER_ID_KEY_LENGTH 512
+
+// The class part of the key is the address of the interned global class reference
+struct member_id_key {
+  size_t length;
+  char bytes[MAX_MEMBER_ID_KEY_LENGTH];
+};
+
+// Returns false if the key would be too long to be cached
+static bool build_member_id_key(struct member_id_key *key,
+                                jclass class,
+                                enum member_kind kind,
+                                const char *name,
+                                const char *signature) {
+  size_t name_length = strlen(name) + 1;
+  size_t signature_length = strlen(signature);
+  key->length = sizeof(jclass) + 1 + name_length + signature_length;
+  if (key->length > MAX_MEMBER_ID_KEY_LENGTH) {
+    return false;
+  }
+
+  char *position = key->bytes;
+  memcpy(position, &class, sizeof(jclass));
+  position += sizeof(jclass);
+  *position++ = (char)kind;
+  memcpy(position, name, name_length);
+  position += name_length;
+  memcpy(position, signature, signature_length);
+  return true;
+}
+
+static void *get_member_id(JNIEnv *env, jclass class, enum member_kind kind, const char *name, const char *signature) {
+  switch (kind) {
+  case MEMBER_METHOD:
+    return (*env)->GetMethodID(env, class, name, signature);
+  case MEMBER_STATIC_METHOD:
+    return (*env)->GetStaticMethodID(env, class, name, signature);
+  case MEMBER_FIELD:
+    return (*env)->GetFieldID(env, class, name, signature);
+  case MEMBER_STATIC_FIELD:
+    return (*env)->GetStaticFieldID(env, class, name, signature);
+  }
+  return NULL;
+}
+
+// IDs of members of interned classes (from find_class) are cached for the life of the process
+static void *lookup_member_id(mrb_state *mrb,
+                              struct jni_reference *class,
+                              enum member_kind kind,
+                              const char *name,
+                              const char *signature) {
+  struct member_id_key key;
+  bool cacheable = class->is_interned && build_member_id_key(&key, class->reference, kind, name, signature);
+  if (cacheable) {
+    void *cached_id = find_interned_value(&interned_member_ids, key.bytes, key.length);
+    if (cached_id != NULL) {
+      return cached_id;
+    }
+  }
+
+  void *result = get_member_id(jni_env, class->reference, kind, name, signature);
+  handle_jni_exception(mrb);
+
+  if (cacheable) {
+    publish_interned_value(&interned_member_ids, key.bytes, key.length, result);
+  }
+  return result;
+}
+
+#define GET_ID(member_kind)\
+  mrb_value class_reference;\
+  const char *name;\
+  const char *signature;\
+  drb->mrb_get_args(mrb, "ozz", &class_reference, &name, &signature);\
+  \
+  struct jni_reference *class = unwrap_jni_reference_struct_from_object(mrb, class_reference);\
+  void *member_id = lookup_member_id(mrb, class, member_kind, name, signature);
+
+static mrb_value jni_get_static_method_id_m(mrb_state *mrb, mrb_value self) {
+  GET_ID(MEMBER_STATIC_METHOD);
+
+  return wrap_jni_pointer_in_object(mrb, member_id, JNI_POINTER_METHOD_ID, true, class, name, signature);
+}
+
+static mrb_value jni_get_method_id_m(mrb_state *mrb, mrb_value self) {
+  GET_ID(MEMBER_METHOD);
+
+  return wrap_jni_pointer_in_object(mrb, member_id, JNI_POINTER_METHOD_ID, false, class, name, signature);
+}
+
+static mrb_value jni_get_field_id_m(mrb_state *mrb, mrb_value self) {
+  GET_ID(MEMBER_FIELD);
+
+  return wrap_jni_pointer_in_object(mrb, member_id, JNI_POINTER_FIELD_ID, false, class, name, signature);
+}
+
+static mrb_value jni_get_static_field_id_m(mrb_state *mrb, mrb_value self) {
+  GET_ID(MEMBER_STATIC_FIELD);
+
+  return wrap_jni_pointer_in_object(mrb, member_id, JNI_POINTER_FIELD_ID, true, class, name, signature);
+}
+
+static mrb_value jni_get_object_class_m(mrb_state *mrb, mrb_value self) {
+  mrb_value object_reference;
+  drb->mrb_get_args(mrb, "o", &object_reference);
+
+  jobject object = unwrap_jni_reference_from_object(mrb, object_reference);
+  jclass class = (*jni_env)->GetObjectClass(jni_env, object);
+  handle_jni_exception(mrb);
+
+  return wrap_jni_local_reference_in_object(mrb, class, JNI_REFERENCE_JCLASS);
+}
+
+// ----- Primitive Arrays -----
+
+// Returns an error message or NULL if start and length describe a region inside the array
+static const char *check_array_region(jarray array, mrb_int start, mrb_int length) {
+  jsize array_length = (*jni_env)->GetArrayLength(jni_env, array);
+  if (start < 0 || length < 0 || start + length > array_length) {
+    return "Region is outside of the array";
+  }
+  return NULL;
+}
+
+// Values can either be a packed string (like the result of Array#pack) or an array of Ruby values.
+// The conversion of array elements happens directly in the memory of the Java array.
+#define FOR_JNI_TYPE(type, type_pascal_case, type_upper_case)\
+static const char *count_jni_##type##_array_values(mrb_value values, mrb_int *count) {\
+  if (mrb_string_p(values)) {\
+    if (RSTRING_LEN(values) % sizeof(j##type) != 0) {\
+      return "Packed string length must be a multiple of the " #type " size";\
+    }\
+    *count = RSTRING_LEN(values) / sizeof(j##type);\
+    return NULL;\
+  }\
+  \
+  if (!mrb_array_p(values)) {\
+    return "Expected packed string or array of " #type " values";\
+  }\
+  \
+  for (mrb_int i = 0; i < RARRAY_LEN(values); i++) {\
+    if (!IS_MRB_VALUE_JNI_##type_upper_case(RARRAY_PTR(values)[i])) {\
+      return "Expected packed string or array of " #type " values";\
+    }\
+  }\
+  *count = RARRAY_LEN(values);\
+  return NULL;\
+}\
+\
+static void write_jni_##type##_array_region(j##type##Array array, jsize start, jsize count, mrb_value values) {\
+  if (mrb_string_p(values)) {\
+    (*jni_env)->Set##type_pascal_case##ArrayRegion(jni_env, array, start, count, (const j##type *)RSTRING_PTR(values));\
+    return;\
+  }\
+  \
+  j##type *elements = (*jni_env)->GetPrimitiveArrayCritical(jni_env, array, NULL);\
+  if (elements == NULL) {\
+    return;\
+  }\
+  for (jsize i = 0; i < count; i++) {\
+    mrb_value value = RARRAY_PTR(values)[i];\
+    elements[start + i] = CONVERT_MRB_VALUE_TO_JNI_##type_upper_case(value);\
+  }\
+  (*jni_env)->ReleasePrimitiveArrayCritical(jni_env, array, elements, 0);\
+}\
+\
+/* Returns an error message or NULL if the array could be created */\
+static const char *new_jni_##type##_array(mrb_value values, jarray *result) {\
+  mrb_int count;\
+  const char *error_message = count_jni_##type##_array_values(values, &count);\
+  if (error_message) {\
+    return error_message;\
+  }\
+  \
+  j##type##Array array = (*jni_env)->New##type_pascal_case##Array(jni_env, (jsize)count);\
+  if (array == NULL) {\
+    (*jni_env)->ExceptionClear(jni_env);\
+    return "Could not allocate " #type " array";\
+  }\
+  write_jni_##type##_array_region(array, 0, (jsize)count, values);\
+  *result = array;\
+  return NULL;\
+}\
+\
+static mrb_value read_jni_##type##_array_region(mrb_state *mrb, j##type##Array array, jsize start, jsize length) {\
+  mrb_value result = drb->mrb_str_new(mrb, NULL, length * sizeof(j##type));\
+  (*jni_env)->Get##type_pascal_case##ArrayRegion(jni_env, array, start, length, (j##type *)RSTRING_PTR(result));\
+  return result;\
+}\
+\
+static mrb_value read_jni_##type##_array_values(mrb_state *mrb, j##type##Array array, jsize start, jsize length) {\
+  j##type *elements = drb->mrb_malloc(mrb, length * sizeof(j##type));\
+  (*jni_env)->Get##type_pascal_case##ArrayRegion(jni_env, array, start, length, elements);\
+  \
+  mrb_value result = drb->mrb_ary_new_capa(mrb, length);\
+  for (jsize i = 0; i < length; i++) {\
+    ASSIGN_JNI_##type_upper_case##_TO_VARIABLE(element, elements[i]);\
+    drb->mrb_ary_push(mrb, result, CONVERT_JNI_##type_upper_case##_TO_MRB_VALUE(element));\
+  }\
+  drb->mrb_free(mrb, elements);\
+  return result;\
+}
+
+#include "define_for_jni_primitive_types.c.inc"
+
+#undef FOR_JNI_TYPE
+
+// ----- Primitive Arrays END -----
+
+// ----- Argument Conversion -----
+
+enum jni_type {
+#define FOR_JNI_TYPE(type, type_pascal_case, type_upper_case) JNI_TYPE_##type_upper_case,
+#include "define_for_jni_types_with_void.c.inc"
+#undef FOR_JNI_TYPE
+  // Boxed primitives like java.lang.Integer are converted from Ruby values and passed as object references
+#define FOR_JNI_TYPE(type, type_pascal_case, type_upper_case) JNI_TYPE_BOXED_##type_upper_case,
+#include "define_for_jni_primitive_types.c.inc"
+#undef FOR_JNI_TYPE
+  // Held by the interned string cache, so they are passed like object references
+  JNI_TYPE_INTERNED_STRING,
+  JNI_TYPE_STRING,
+  // Primitive array types are all listed after JNI_TYPE_STRING
+#define FOR_JNI_TYPE(type, type_pascal_case, type_upper_case) JNI_TYPE_##type_upper_case##_ARRAY,
+#include "define_for_jni_primitive_types.c.inc"
+#undef FOR_JNI_TYPE
+};
+
+static bool is_primitive_array_type(uint8_t type) {
+  return type > JNI_TYPE_STRING;
+}
+
+static bool is_boxed_type(uint8_t type) {
+  return type >= JNI_TYPE_BOXED_BOOLEAN && type <= JNI_TYPE_BOXED_DOUBLE;
+}
+
+// Strings, boxed primitives and primitive arrays are converted into new local references
+static bool argument_type_creates_local_ref(uint8_t type) {
+  return type == JNI_TYPE_STRING || is_boxed_type(type) || is_primitive_array_type(type);
+}
+
+// ----- Boxed Values -----
+
+struct boxed_type {
+  enum jni_type type;
+  const char *class_name;
+  const char *value_of_signature;
+  const char *unbox_method_name;
+  const char *unbox_signature;
+  jclass class;
+  jmethodID value_of;
+  jmethodID unbox;
+};
+
+#define BOXED_TYPE_COUNT 8
+
+// In the order of the JNI_TYPE_BOXED_* types.
+// Classes and method IDs are resolved by init_boxed_types when the extension is loaded.
+static struct boxed_type boxed_types[BOXED_TYPE_COUNT] = {
+    {JNI_TYPE_BOOLEAN, "java/lang/Boolean", "(Z)Ljava/lang/Boolean;", "booleanValue", "()Z", NULL, NULL, NULL},
+    {JNI_TYPE_BYTE, "java/lang/Byte", "(B)Ljava/lang/Byte;", "byteValue", "()B", NULL, NULL, NULL},
+    {JNI_TYPE_CHAR, "java/lang/Character", "(C)Ljava/lang/Character;", "charValue", "()C", NULL, NULL, NULL},
+    {JNI_TYPE_SHORT, "java/lang/Short", "(S)Ljava/lang/Short;", "shortValue", "()S", NULL, NULL, NULL},
+    {JNI_TYPE_INT, "java/lang/Integer", "(I)Ljava/lang/Integer;", "intValue", "()I", NULL, NULL, NULL},
+    {JNI_TYPE_LONG, "java/lang/Long", "(J)Ljava/lang/Long;", "longValue", "()J", NULL, NULL, NULL},
+    {JNI_TYPE_FLOAT, "java/lang/Float", "(F)Ljava/lang/Float;", "floatValue", "()F", NULL, NULL, NULL},
+    {JNI_TYPE_DOUBLE, "java/lang/Double", "(D)Ljava/lang/Double;", "doubleValue", "()D", NULL, NULL, NULL},
+};
+
+// Number, Boolean and Character - objects which are no instance of any of them are not searched
+#define BOXED_SUPERCLASS_COUNT 3
+
+static jclass boxed_superclasses[BOXED_SUPERCLASS_COUNT];
+
+// Declared types other than these (and the boxed classes themselves) cannot hold a boxed primitive
+static const char *boxed_supertype_names[] = {
+    "java/lang/Object",
+    "java/lang/Number",
+    "java/lang/Comparable",
+    "java/io/Serializable",
+    "java/lang/constant/Constable",
+    "java/lang/constant/ConstantDesc",
+};
+
+static void init_boxed_types() {
+  boxed_superclasses[0] = find_global_class("java/lang/Number");
+  boxed_superclasses[1] = find_global_class("java/lang/Boolean");
+  boxed_superclasses[2] = find_global_class("java/lang/Character");
+
+  for (int i = 0; i < BOXED_TYPE_COUNT; i++) {
+    struct boxed_type *boxed_type = &boxed_types[i];
+    boxed_type->class = find_global_class(boxed_type->class_name);
+    boxed_type->value_of = (*jni_env)->GetStaticMethodID(jni_env,
+                                                         boxed_type->class,
+                                                         "valueOf",
+                                                         boxed_type->value_of_signature);
+    boxed_type->unbox = (*jni_env)->GetMethodID(jni_env,
+                                                boxed_type->class,
+                                                boxed_type->unbox_method_name,
+                                                boxed_type->unbox_signature);
+  }
+}
+
+static struct boxed_type *get_boxed_type(enum jni_type type) {
+  for (int i = 0; i < BOXED_TYPE_COUNT; i++) {
+    if (boxed_types[i].type == type) {
+      return &boxed_types[i];
+    }
+  }
+  return NULL;
+}
+
+// Compares a class name like java.lang.Integer or java/lang/Integer with an internal name like java/lang/Integer
+static bool class_name_equals(const char *class_name, const char *internal_name) {
+  size_t i = 0;
+  while (class_name[i] != '\0' &&
+         (class_name[i] == internal_name[i] || (class_name[i] == '.' && internal_name[i] == '/'))) {
+    i++;
+  }
+  return class_name[i] == '\0' && internal_name[i] == '\0';
+}
+
+// Returns the boxed type for a class name like java.lang.Integer or java/lang/Integer or NULL
+static struct boxed_type *find_boxed_type_by_class_name(const char *class_name) {
+  for (int i = 0; i < BOXED_TYPE_COUNT; i++) {
+    if (class_name_equals(class_name, boxed_types[i].class_name)) {
+      return &boxed_types[i];
+    }
+  }
+  return NULL;
+}
+
+// Returns the boxed type of the object or NULL if it is no boxed primitive.
+// Boxed classes are final so comparing the class is enough.
+static struct boxed_type *find_boxed_type(jobject object) {
+  bool is_boxed_candidate = false;
+  for (int i = 0; i < BOXED_SUPERCLASS_COUNT && !is_boxed_candidate; i++) {
+    is_boxed_candidate = (*jni_env)->IsInstanceOf(jni_env, object, boxed_superclasses[i]);
+  }
+  if (!is_boxed_candidate) {
+    return NULL;
+  }
+
+  jclass object_class = (*jni_env)->GetObjectClass(jni_env, object);
+  struct boxed_type *result = NULL;
+  for (int i = 0; i < BOXED_TYPE_COUNT; i++) {
+    if ((*jni_env)->IsSameObject(jni_env, object_class, boxed_types[i].class)) {
+      result = &boxed_types[i];
+      break;
+    }
+  }
+  (*jni_env)->DeleteLocalRef(jni_env, object_class);
+  return result;
+}
+
+// Returns false for class names like java.util.List whose instances are never boxed primitives
+static bool class_name_may_be_boxed(const char *class_name) {
+  if (find_boxed_type_by_class_name(class_name) != NULL) {
+    return true;
+  }
+
+  size_t count = sizeof(boxed_supertype_names) / sizeof(boxed_supertype_names[0]);
+  for (size_t i = 0; i < count; i++) {
+    if (class_name_equals(class_name, boxed_supertype_names[i])) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Calls the xxxValue method of the boxed object
+static mrb_value unbox_jni_object(mrb_state *mrb, struct boxed_type *boxed_type, jobject object) {
+  switch (boxed_type->type) {
+#define FOR_JNI_TYPE(type, type_pascal_case, type_upper_case)\
+  case JNI_TYPE_##type_upper_case: {\
+    ASSIGN_JNI_##type_upper_case##_TO_VARIABLE(jni_result,\
+                                               (*jni_env)->Call##type_pascal_case##Method(jni_env, object, boxed_type->unbox));\
+    return CONVERT_JNI_##type_upper_case##_TO_MRB_VALUE(jni_result);\
+  }
+
+#include "define_for_jni_primitive_types.c.inc"
+
+#undef FOR_JNI_TYPE
+  default:
+    return mrb_nil_value();
+  }
+}
+
+// Takes ownership of the local reference to an object declared with the boxed type, so no class check is needed
+static mrb_value convert_boxed_jni_object_to_mrb_value(mrb_state *mrb, struct boxed_type *boxed_type, jobject object) {
+  if (object == NULL) {
+    return mrb_nil_value();
+  }
+
+  mrb_value result = unbox_jni_object(mrb, boxed_type, object);
+  (*jni_env)->DeleteLocalRef(jni_env, object);
+  return result;
+}
+
+static jobject box_jni_value(struct boxed_type *boxed_type, jvalue value) {
+  return (*jni_env)->CallStaticObjectMethodA(jni_env, boxed_type->class, boxed_type->value_of, &value);
+}
+
+// ----- Boxed Values END -----
+
+struct jni_type_name {
+  const char *name;
+  enum jni_type type;
+};
+
+static const struct jni_type_name argument_type_names[] = {
+    {"boolean", JNI_TYPE_BOOLEAN},
+    {"byte", JNI_TYPE_BYTE},
+    {"char", JNI_TYPE_CHAR},
+    {"short", JNI_TYPE_SHORT},
+    {"int", JNI_TYPE_INT},
+    {"long", JNI_TYPE_LONG},
+    {"float", JNI_TYPE_FLOAT},
+    {"double", JNI_TYPE_DOUBLE},
+    {"string", JNI_TYPE_STRING},
+    {"interned_string", JNI_TYPE_INTERNED_STRING},
+};
+
+// Parses array types like [:int] or ['java.lang.String'].
+// Returns an error message or NULL if the type could be parsed
+static const char *parse_array_type(mrb_state *mrb, mrb_value type, enum jni_type *result) {
+  if (RARRAY_LEN(type) != 1) {
+    return "Array type must have exactly one element type";
+  }
+
+  mrb_value element_type = RARRAY_PTR(type)[0];
+  if (mrb_symbol_p(element_type)) {
+    const char *element_type_name = drb->mrb_sym2name(mrb, mrb_symbol(element_type));
+#define FOR_JNI_TYPE(type, type_pascal_case, type_upper_case)\
+    if (strcmp(element_type_name, #type) == 0) {\
+      *result = JNI_TYPE_##type_upper_case##_ARRAY;\
+      return NULL;\
+    }
+
+#include "define_for_jni_primitive_types.c.inc"
+
+#undef FOR_JNI_TYPE
+    if (strcmp(element_type_name, "string") != 0) {
+      return "Unknown array element type symbol";
+    }
+  } else if (!mrb_string_p(element_type) && !mrb_array_p(element_type)) {
+    return "Array element type must be a symbol, string or array";
+  }
+
+  // Arrays of objects are passed around as references
+  *result = JNI_TYPE_OBJECT;
+  return NULL;
+}
+
+// Returns an error message or NULL if the type could be parsed
+static const char *parse_argument_type(mrb_state *mrb, mrb_value type, enum jni_type *result) {
+  if (mrb_string_p(type)) {
+    // Java class type
+    struct boxed_type *boxed_type = find_boxed_type_by_class_name(drb->mrb_string_value_cstr(mrb, &type));
+    *result = boxed_type != NULL ? JNI_TYPE_BOXED_BOOLEAN + (boxed_type - boxed_types) : JNI_TYPE_OBJECT;
+    return NULL;
+  }
+
+  if (mrb_array_p(type)) {
+    return parse_array_type(mrb, type, result);
+  }
+
+  if (!mrb_symbol_p(type)) {
+    return "Type must be a symbol or string";
+  }
+
+  const char *type_name = drb->mrb_sym2name(mrb, mrb_symbol(type));
+  for (size_t i = 0; i < sizeof(argument_type_names) / sizeof(argument_type_names[0]); i++) {
+    if (strcmp(type_name, argument_type_names[i].name) == 0) {
+      *result = argument_type_names[i].type;
+      return NULL;
+    }
+  }
+
+  return "Unknown type symbol";
+}
+
+// Returns an error message or NULL if the value could be converted
+static const char *convert_mrb_value_to_jni_argument(mrb_state *mrb,
+                                                     enum jni_type type,
+                                                     mrb_value value,
+                                                     jvalue *result) {
+  switch (type) {
+  case JNI_TYPE_BOOLEAN:
+    if (!mrb_true_p(value) && !mrb_false_p(value)) {
+      return "Expected boolean argument";
+    }
+    result->z = (jboolean)mrb_bool(value);
+    return NULL;
+  case JNI_TYPE_BYTE:
+    if (!mrb_integer_p(value)) {
+      return "Expected byte argument";
+    }
+    result->b = (jbyte)mrb_integer(value);
+    return NULL;
+  case JNI_TYPE_CHAR:
+    if (!IS_MRB_VALUE_JNI_CHAR(value)) {
+      return "Expected char argument";
+    }
+    result->c = CONVERT_MRB_VALUE_TO_JNI_CHAR(value);
+    return NULL;
+  case JNI_TYPE_SHORT:
+    if (!mrb_integer_p(value)) {
+      return "Expected short argument";
+    }
+    result->s = (jshort)mrb_integer(value);
+    return NULL;
+  case JNI_TYPE_INT:
+    if (!mrb_integer_p(value)) {
+      return "Expected int argument";
+    }
+    result->i = (jint)mrb_integer(value);
+    return NULL;
+  case JNI_TYPE_LONG:
+    if (!mrb_integer_p(value)) {
+      return "Expected long argument";
+    }
+    result->j = (jlong)mrb_integer(value);
+    return NULL;
+  case JNI_TYPE_FLOAT:
+    if (!mrb_float_p(value)) {
+      return "Expected float argument";
+    }
+    result->f = (jfloat)mrb_float(value);
+    return NULL;
+  case JNI_TYPE_DOUBLE:
+    if (!mrb_float_p(value)) {
+      return "Expected double argument";
+    }
+    result->d = (jdouble)mrb_float(value);
+    return NULL;
+  case JNI_TYPE_STRING:
+    if (mrb_string_p(value)) {
+      if (mrb_string_has_null_byte(value)) {
+        return NULL_BYTE_IN_STRING_MESSAGE;
+      }
+      result->l = (*jni_env)->NewStringUTF(jni_env, drb->mrb_string_value_cstr(mrb, &value));
+    } else if (mrb_nil_p(value)) {
+      result->l = NULL;
+    } else {
+      return "Expected string argument or nil";
+    }
+    return NULL;
+  case JNI_TYPE_INTERNED_STRING:
+    if (mrb_string_p(value)) {
+      if (mrb_string_has_null_byte(value)) {
+        return NULL_BYTE_IN_STRING_MESSAGE;
+      }
+      result->l = intern_string(mrb, value);
+      if (result->l == NULL) {
+        (*jni_env)->ExceptionClear(jni_env);
+        return "Could not create Java string";
+      }
+    } else if (mrb_nil_p(value)) {
+      result->l = NULL;
+    } else {
+      return "Expected string argument or nil";
+    }
+    return NULL;
+  case JNI_TYPE_OBJECT:
+    if (drb->mrb_obj_is_instance_of(mrb, value, refs.jni_reference)) {
+      return unwrap_jni_reference_argument(mrb, value, &result->l);
+    } else if (mrb_nil_p(value)) {
+      result->l = NULL;
+    } else {
+      return "Expected JNI::Reference object or nil";
+    }
+    return NULL;
+#define FOR_JNI_TYPE(type, type_pascal_case, type_upper_case)\
+  case JNI_TYPE_##type_upper_case##_ARRAY:\
+    if (drb->mrb_obj_is_instance_of(mrb, value, refs.jni_reference)) {\
+      /* Existing arrays get their own local reference so they can be released like new ones */\
+      jobject array;\
+      const char *error_message = unwrap_jni_reference_argument(mrb, value, &array);\
+      if (error_message) {\
+        return error_message;\
+      }\
+      result->l = (*jni_env)->NewLocalRef(jni_env, array);\
+    } else if (mrb_nil_p(value)) {\
+      result->l = NULL;\
+    } else {\
+      return new_jni_##type##_array(value, &result->l);\
+    }\
+    return NULL;
+
+#include "define_for_jni_primitive_types.c.inc"
+
+#undef FOR_JNI_TYPE
+#define FOR_JNI_TYPE(type, type_pascal_case, type_upper_case) case JNI_TYPE_BOXED_##type_upper_case:
+#include "define_for_jni_primitive_types.c.inc"
+#undef FOR_JNI_TYPE
+  {
+    if (drb->mrb_obj_is_instance_of(mrb, value, refs.jni_reference)) {
+      // Existing objects get their own local reference so they can be released like new ones
+      jobject object;
+      const char *error_message = unwrap_jni_reference_argument(mrb, value, &object);
+      if (error_message) {
+        return error_message;
+      }
+      result->l = (*jni_env)->NewLocalRef(jni_env, object);
+      return NULL;
+    }
+    if (mrb_nil_p(value)) {
+      result->l = NULL;
+      return NULL;
+    }
+
+    struct boxed_type *boxed_type = &boxed_types[type - JNI_TYPE_BOXED_BOOLEAN];
+    jvalue primitive_value;
+    const char *error_message = convert_mrb_value_to_jni_argument(mrb, boxed_type->type, value, &primitive_value);
+    if (error_message) {
+      return error_message;
+    }
+    result->l = box_jni_value(boxed_type, primitive_value);
+    return NULL;
+  }
+  default:
+    return "Unknown type symbol";
+  }
+}
+
+static void raise_wrong_argument_type(mrb_state *mrb, int argument_index, const char *error_message) {
+  struct RClass *exception_class = drb->mrb_class_get_under(mrb, refs.jni, "WrongArgumentType");
+  drb->mrb_raisef(mrb, exception_class, "Argument %d: %s", argument_index + 1, error_message);
+}
+
+// Deletes the local references created while converting arguments (i.e. Java strings and arrays)
+static void delete_local_argument_refs(const uint8_t *argument_types, const jvalue *jni_args, mrb_int argc) {
+  for (int i = 0; i < argc; i++) {
+    if (argument_type_creates_local_ref(argument_types[i]) && jni_args[i].l != NULL) {
+      (*jni_env)->DeleteLocalRef(jni_env, jni_args[i].l);
+    }
+  }
+}
+
+// The type codes of the arguments are stored right after the converted values
+#define CONVERTED_ARGUMENT_TYPES(jni_args, argc) ((uint8_t *)((jni_args) + (argc)))
+
+static jvalue *convert_mrb_args_to_jni_args(mrb_state *mrb,
+                                            mrb_value *args,
+                                            mrb_int argc,
+                                            mrb_value argument_types_array) {
+  jvalue *jni_args = drb->mrb_malloc(mrb, (sizeof(jvalue) + sizeof(uint8_t)) * argc);
+  uint8_t *argument_types = CONVERTED_ARGUMENT_TYPES(jni_args, argc);
+
+  for (int i = 0; i < argc; i++) {
+    enum jni_type type;
+    const char *error_message = parse_argument_type(mrb, RARRAY_PTR(argument_types_array)[i], &type);
+    if (!error_message) {
+      error_message = convert_mrb_value_to_jni_argument(mrb, type, args[i], &jni_args[i]);
+    }
+
+    if (error_message) {
+      delete_local_argument_refs(argument_types, jni_args, i);
+      drb->mrb_free(mrb, jni_args);
+      raise_wrong_argument_type(mrb, i, error_message);
+    }
+    argument_types[i] = (uint8_t)type;
+  }
+
+  return jni_args;
+}
+
+// Converts an argument that is kept beyond the current call.
+// Object and string arguments are held as global references and must be released with
+// release_retained_jni_args.
+static const char *convert_mrb_value_to_retained_jni_argument(mrb_state *mrb,
+                                                              enum jni_type type,
+                                                              mrb_value value,
+                                                              jvalue *result) {
+  const char *error_message = convert_mrb_value_to_jni_argument(mrb, type, value, result);
+  bool is_reference = type == JNI_TYPE_OBJECT || argument_type_creates_local_ref(type);
+  if (error_message || !is_reference || result->l == NULL) {
+    return error_message;
+  }
+
+  jobject reference = result->l;
+  result->l = (*jni_env)->NewGlobalRef(jni_env, reference);
+  if (argument_type_creates_local_ref(type)) {
+    (*jni_env)->DeleteLocalRef(jni_env, reference);
+  }
+  return NULL;
+}
+
+// env is a parameter since retained arguments can also be released on other threads
+static void release_retained_jni_args(JNIEnv *env, const uint8_t *argument_types, const jvalue *jni_args, mrb_int argc) {
+  for (int i = 0; i < argc; i++) {
+    bool is_reference = argument_types[i] == JNI_TYPE_OBJECT || argument_type_creates_local_ref(argument_types[i]);
+    if (is_reference && jni_args[i].l != NULL) {
+      (*env)->DeleteGlobalRef(env, jni_args[i].l);
+    }
+  }
+}
+
+static void convert_mrb_args_to_retained_jni_args(mrb_state *mrb,
+                                                  const uint8_t *argument_types,
+                                                  mrb_value *args,
+                                                  mrb_int argc,
+                                                  jvalue *result) {
+  for (int i = 0; i < argc; i++) {
+    const char *error_message = convert_mrb_value_to_retained_jni_argument(mrb, argument_types[i], args[i], &result[i]);
+    if (error_message) {
+      release_retained_jni_args(jni_env, argument_types, result, i);
+      raise_wrong_argument_type(mrb, i, error_message);
+    }
+  }
+}
+
+// ----- Argument Conversion END -----
+
+static mrb_value convert_jni_value_to_mrb_value(mrb_state *mrb, enum jni_type type, jvalue value) {
+  switch (type) {
+#define FOR_JNI_TYPE(type, type_pascal_case, type_upper_case)\
+  case JNI_TYPE_##type_upper_case: {\
+    ASSIGN_JNI_##type_upper_case##_TO_VARIABLE(jni_result, value.JNI_##type_upper_case##_JVALUE_MEMBER);\
+    return CONVERT_JNI_##type_upper_case##_TO_MRB_VALUE(jni_result);\
+  }
+
+#include "define_for_jni_types_without_void.c.inc"
+
+#undef FOR_JNI_TYPE
+  // Returned arrays are copied into a packed string in one go
+#define FOR_JNI_TYPE(type, type_pascal_case, type_upper_case)\
+  case JNI_TYPE_##type_upper_case##_ARRAY: {\
+    if (value.l == NULL) {\
+      return mrb_nil_value();\
+    }\
+    jsize length = (*jni_env)->GetArrayLength(jni_env, value.l);\
+    mrb_value result = read_jni_##type##_array_region(mrb, value.l, 0, length);\
+    (*jni_env)->DeleteLocalRef(jni_env, value.l);\
+    return result;\
+  }
+
+#include "define_for_jni_primitive_types.c.inc"
+
+#undef FOR_JNI_TYPE
+#define FOR_JNI_TYPE(type, type_pascal_case, type_upper_case)\
+  case JNI_TYPE_BOXED_##type_upper_case:\
+    return convert_boxed_jni_object_to_mrb_value(mrb, get_boxed_type(JNI_TYPE_##type_upper_case), value.l);
+
+#include "define_for_jni_primitive_types.c.inc"
+
+#undef FOR_JNI_TYPE
+  default:
+    return mrb_nil_value();
+  }
+}
+
+// ----- Collections -----
+
+struct collection_references {
+  jclass object_array_class;
+  jclass collection_class;
+  jmethodID collection_to_array;
+  jclass map_class;
+  jmethodID map_entry_set;
+  jmethodID map_entry_get_key;
+  jmethodID map_entry_get_value;
+  jclass array_list_class;
+  jmethodID array_list_constructor;
+  jmethodID array_list_add;
+  jclass hash_map_class;
+  jmethodID hash_map_constructor;
+  jmethodID hash_map_put;
+};
+
+static struct collection_references collection_refs;
+
+static void init_collection_references() {
+  if (collection_refs.object_array_class != NULL) {
+    return;
+  }
+
+  collection_refs.object_array_class = find_global_class("[Ljava/lang/Object;");
+
+  collection_refs.collection_class = find_global_class("java/util/Collection");
+  collection_refs.collection_to_array = (*jni_env)->GetMethodID(jni_env,
+                                                                collection_refs.collection_class,
+                                                                "toArray",
+                                                                "()[Ljava/lang/Object;");
+
+  collection_refs.map_class = find_global_class("java/util/Map");
+  collection_refs.map_entry_set = (*jni_env)->GetMethodID(jni_env,
+                                                          collection_refs.map_class,
+                                                          "entrySet",
+                                                          "()Ljava/util/Set;");
+  jclass map_entry_class = (*jni_env)->FindClass(jni_env, "java/util/Map$Entry");
+  collection_refs.map_entry_get_key = (*jni_env)->GetMethodID(jni_env, map_entry_class, "getKey", "()Ljava/lang/Object;");
+  collection_refs.map_entry_get_value = (*jni_env)->GetMethodID(jni_env, map_entry_class, "getValue", "()Ljava/lang/Object;");
+  (*jni_env)->DeleteLocalRef(jni_env, map_entry_class);
+
+  collection_refs.array_list_class = find_global_class("java/util/ArrayList");
+  collection_refs.array_list_constructor = (*jni_env)->GetMethodID(jni_env, collection_refs.array_list_class, "<init>", "(I)V");
+  collection_refs.array_list_add = (*jni_env)->GetMethodID(jni_env,
+                                                           collection_refs.array_list_class,
+                                                           "add",
+                                                           "(Ljava/lang/Object;)Z");
+
+  collection_refs.hash_map_class = find_global_class("java/util/HashMap");
+  collection_refs.hash_map_constructor = (*jni_env)->GetMethodID(jni_env, collection_refs.hash_map_class, "<init>", "(I)V");
+  collection_refs.hash_map_put = (*jni_env)->GetMethodID(jni_env,
+                                                         collection_refs.hash_map_class,
+                                                         "put",
+                                                         "(Ljava/lang/Object;Ljava/lang/Object;)Ljava/lang/Object;");
+}
+
+// Appends the converted elements of an Object[] to the Ruby Array
+static void read_object_array_elements(mrb_state *mrb, jobjectArray array, mrb_value result) {
+  jsize length = (*jni_env)->GetArrayLength(jni_env, array);
+  int arena_index = drb->mrb_gc_arena_save(mrb);
+
+  for (jsize i = 0; i < length; i++) {
+    jobject element = (*jni_env)->GetObjectArrayElement(jni_env, array, i);
+    drb->mrb_ary_push(mrb, result, convert_jni_object_to_mrb_value(mrb, element));
+    drb->mrb_gc_arena_restore(mrb, arena_index);
+  }
+}
+
+// Stores the converted keys and values of an array of Map.Entry objects in the Ruby Hash.
+// Stops with the Java exception pending if getKey or getValue throws.
+static void read_map_entries(mrb_state *mrb, jobjectArray entries, mrb_value result) {
+  jsize length = (*jni_env)->GetArrayLength(jni_env, entries);
+  int arena_index = drb->mrb_gc_arena_save(mrb);
+
+  for (jsize i = 0; i < length; i++) {
+    jobject entry = (*jni_env)->GetObjectArrayElement(jni_env, entries, i);
+    jobject key = (*jni_env)->CallObjectMethod(jni_env, entry, collection_refs.map_entry_get_key);
+    jobject value = NULL;
+    if (!(*jni_env)->ExceptionCheck(jni_env)) {
+      value = (*jni_env)->CallObjectMethod(jni_env, entry, collection_refs.map_entry_get_value);
+    }
+    (*jni_env)->DeleteLocalRef(jni_env, entry);
+    if ((*jni_env)->ExceptionCheck(jni_env)) {
+      (*jni_env)->DeleteLocalRef(jni_env, key);
+      (*jni_env)->DeleteLocalRef(jni_env, value);
+      drb->mrb_gc_arena_restore(mrb, arena_index);
+      return;
+    }
+
+    drb->mrb_hash_set(mrb,
+                      result,
+                      convert_jni_object_to_mrb_value(mrb, key),
+                      convert_jni_object_to_mrb_value(mrb, value));
+    drb->mrb_gc_arena_restore(mrb, arena_index);
+  }
+}
+
+// Returned by the collection building functions when a Java exception is pending
+static const char *const collection_java_exception = "Java exception while building the collection";
+
+static const char *new_java_collection(mrb_state *mrb, mrb_value value, jobject *result);
+
+// Converts a Ruby value into a new local reference.
+// Returns an error message or NULL if the value could be converted
+static const char *convert_mrb_value_to_collection_element(mrb_state *mrb, mrb_value value, jobject *result) {
+  jvalue boxed_value;
+
+  if (mrb_nil_p(value)) {
+    *result = NULL;
+  } else if (mrb_string_p(value)) {
+    if (mrb_string_has_null_byte(value)) {
+      return NULL_BYTE_IN_STRING_MESSAGE;
+    }
+    *result = (*jni_env)->NewStringUTF(jni_env, drb->mrb_string_value_cstr(mrb, &value));
+  } else if (mrb_symbol_p(value)) {
+    *result = (*jni_env)->NewStringUTF(jni_env, drb->mrb_sym2name(mrb, mrb_symbol(value)));
+  } else if (mrb_true_p(value) || mrb_false_p(value)) {
+    boxed_value.z = (jboolean)mrb_bool(value);
+    *result = box_jni_value(get_boxed_type(JNI_TYPE_BOOLEAN), boxed_value);
+  } else if (mrb_integer_p(value)) {
+    // Integers which fit are boxed as Integer like int literals in Java
+    mrb_int integer = mrb_integer(value);
+    if (integer >= INT32_MIN && integer <= INT32_MAX) {
+      boxed_value.i = (jint)integer;
+      *result = box_jni_value(get_boxed_type(JNI_TYPE_INT), boxed_value);
+    } else {
+      boxed_value.j = (jlong)integer;
+      *result = box_jni_value(get_boxed_type(JNI_TYPE_LONG), boxed_value);
+    }
+  } else if (mrb_float_p(value)) {
+    boxed_value.d = (jdouble)mrb_float(value);
+    *result = box_jni_value(get_boxed_type(JNI_TYPE_DOUBLE), boxed_value);
+  } else if (mrb_array_p(value) || mrb_hash_p(value)) {
+    return new_java_collection(mrb, value, result);
+  } else if (drb->mrb_obj_is_instance_of(mrb, value, refs.jni_reference)) {
+    jobject object;
+    const char *error_message = unwrap_jni_reference_argument(mrb, value, &object);
+    if (error_message) {
+      return error_message;
+    }
+    *result = (*jni_env)->NewLocalRef(jni_env, object);
+  } else {
+    return "Expected nil, String, Symbol, true, false, Integer, Float, Array, Hash or JNI::Reference element";
+  }
+
+  // String creation and boxing fail with a pending exception (e.g. OutOfMemoryError)
+  if ((*jni_env)->ExceptionCheck(jni_env)) {
+    (*jni_env)->DeleteLocalRef(jni_env, *result);
+    *result = NULL;
+    return collection_java_exception;
+  }
+  return NULL;
+}
+
+// Builds an ArrayList from an Array or a HashMap from a Hash, converting nested Arrays and Hashes too.
+// Returns an error message or NULL if the collection could be built. The partial collection is released on
+// errors, and the Java exception is left pending if the error message is collection_java_exception.
+static const char *new_java_collection(mrb_state *mrb, mrb_value value, jobject *result) {
+  const char *error_message = NULL;
+  int arena_index = drb->mrb_gc_arena_save(mrb);
+
+  if (mrb_array_p(value)) {
+    mrb_int length = RARRAY_LEN(value);
+    *result = (*jni_env)->NewObject(jni_env,
+                                    collection_refs.array_list_class,
+                                    collection_refs.array_list_constructor,
+                                    (jint)length);
+    if (*result == NULL) {
+      error_message = collection_java_exception;
+    }
+    for (mrb_int i = 0; i < length && error_message == NULL; i++) {
+      jobject element;
+      error_message = convert_mrb_value_to_collection_element(mrb, RARRAY_PTR(value)[i], &element);
+      if (error_message == NULL) {
+        (*jni_env)->CallBooleanMethod(jni_env, *result, collection_refs.array_list_add, element);
+        (*jni_env)->DeleteLocalRef(jni_env, element);
+        if ((*jni_env)->ExceptionCheck(jni_env)) {
+          error_message = collection_java_exception;
+        }
+      }
+    }
+  } else {
+    mrb_value keys = drb->mrb_hash_keys(mrb, value);
+    mrb_int length = RARRAY_LEN(keys);
+    // Capacity for the default load factor of 0.75
+    *result = (*jni_env)->NewObject(jni_env,
+                                    collection_refs.hash_map_class,
+                                    collection_refs.hash_map_constructor,
+                                    (jint)(length * 4 / 3 + 1));
+    if (*result == NULL) {
+      error_message = collection_java_exception;
+    }
+    for (mrb_int i = 0; i < length && error_message == NULL; i++) {
+      mrb_value key = RARRAY_PTR(keys)[i];
+      jobject java_key;
+      jobject java_value = NULL;
+      error_message = convert_mrb_value_to_collection_element(mrb, key, &java_key);
+      if (error_message == NULL) {
+        error_message = convert_mrb_value_to_collection_element(mrb, drb->mrb_hash_get(mrb, value, key), &java_value);
+        if (error_message == NULL) {
+          jobject previous_value = (*jni_env)->CallObjectMethod(jni_env,
+                                                                *result,
+                                                                collection_refs.hash_map_put,
+                                                                java_key,
+                                                                java_value);
+          (*jni_env)->DeleteLocalRef(jni_env, previous_value);
+          if ((*jni_env)->ExceptionCheck(jni_env)) {
+            error_message = collection_java_exception;
+          }
+        }
+        (*jni_env)->DeleteLocalRef(jni_env, java_key);
+        (*jni_env)->DeleteLocalRef(jni_env, java_value);
+      }
+    }
+  }
+
+  drb->mrb_gc_arena_restore(mrb, arena_index);
+  if (error_message != NULL) {
+    (*jni_env)->DeleteLocalRef(jni_env, *result);
+    *result = NULL;
+  }
+  return error_message;
+}
+
+// ----- Collections END -----
+
+static void set_field_value(jobject object, jfieldID field_id, bool is_static, enum jni_type type, jvalue value) {
+  switch (type) {
+  // Strings, boxed primitives and arrays are accessed like any other object (the first type in the list below)
+  case JNI_TYPE_STRING:
+  case JNI_TYPE_INTERNED_STRING:
+#define FOR_JNI_TYPE(type, type_pascal_case, type_upper_case)\
+  case JNI_TYPE_BOXED_##type_upper_case:\
+  case JNI_TYPE_##type_upper_case##_ARRAY:
+#include "define_for_jni_primitive_types.c.inc"
+#undef FOR_JNI_TYPE
+#define FOR_JNI_TYPE(type, type_pascal_case, type_upper_case)\
+  case JNI_TYPE_##type_upper_case:\
+    if (is_static) {\
+      (*jni_env)->SetStatic##type_pascal_case##Field(jni_env,\
+                                                     (jclass)object,\
+                                                     field_id,\
+                                                     value.JNI_##type_upper_case##_JVALUE_MEMBER);\
+    } else {\
+      (*jni_env)->Set##type_pascal_case##Field(jni_env, object, field_id, value.JNI_##type_upper_case##_JVALUE_MEMBER);\
+    }\
+    break;
+
+#include "define_for_jni_types_without_void.c.inc"
+
+#undef FOR_JNI_TYPE
+  default:
+    break;
+  }
+}
+
+static jvalue get_field_value(jobject object, jfieldID field_id, enum jni_type type) {
+  jvalue result;
+  result.j = 0;
+
+  switch (type) {
+  // Strings, boxed primitives and arrays are accessed like any other object (the first type in the list below)
+  case JNI_TYPE_STRING:
+  case JNI_TYPE_INTERNED_STRING:
+#define FOR_JNI_TYPE(type, type_pascal_case, type_upper_case)\
+  case JNI_TYPE_BOXED_##type_upper_case:\
+  case JNI_TYPE_##type_upper_case##_ARRAY:
+#include "define_for_jni_primitive_types.c.inc"
+#undef FOR_JNI_TYPE
+#define FOR_JNI_TYPE(type, type_pascal_case, type_upper_case)\
+  case JNI_TYPE_##type_upper_case:\
+    result.JNI_##type_upper_case##_JVALUE_MEMBER = (*jni_env)->Get##type_pascal_case##Field(jni_env, object, field_id);\
+    break;
+
+#include "define_for_jni_types_without_void.c.inc"
+
+#undef FOR_JNI_TYPE
+  default:
+    break;
+  }
+
+  return result;
+}
+
+#define CALL_METHOD_BEGINNING\
+  mrb_value object_reference;\
+  mrb_value method_id_reference;\
+  mrb_value argument_types_array;\
+  mrb_value *args;\
+  mrb_int argc;\
+  drb->mrb_get_args(mrb, "ooo*", &object_reference, &method_id_reference, &argument_types_array, &args, &argc);\
+  \
+  jobject object = unwrap_jni_reference_from_object(mrb, object_reference);\
+  struct jni_pointer *method_id_pointer = unwrap_jni_pointer_struct_from_object(mrb, method_id_reference);\
+  jmethodID method_id = (jmethodID)method_id_pointer->pointer;\
+  \
+  if (!mrb_array_p(argument_types_array) || RARRAY_LEN(argument_types_array) != argc) {\
+    drb->mrb_raise(mrb, refs.jni_exception, "argument_types must be an array with the same length as args");\
+  }\
+  \
+  jvalue *jni_args = convert_mrb_args_to_jni_args(mrb, args, argc, argument_types_array);\
+  uint64_t stats_start_ns = start_stats_timer();
+
+#define CALL_METHOD_CLEANUP\
+  record_member_stats(method_id_pointer, stats_start_ns);\
+  delete_local_argument_refs(CONVERTED_ARGUMENT_TYPES(jni_args, argc), jni_args, argc);\
+  drb->mrb_free(mrb, jni_args);\
+  handle_jni_exception(mrb);
+
+#define FOR_JNI_TYPE(type, type_pascal_case, type_upper_case)\
+static mrb_value jni_call_static_##type##_method_m(mrb_state *mrb, mrb_value self) {\
+  CALL_METHOD_BEGINNING;\
+  \
+  ASSIGN_JNI_##type_upper_case##_TO_VARIABLE(\
+    jni_result,\
+    (*jni_env)->CallStatic##type_pascal_case##MethodA(jni_env, (jclass)object, method_id, jni_args)\
+  );\
+  \
+  CALL_METHOD_CLEANUP;\
+  \
+  return CONVERT_JNI_##type_upper_case##_TO_MRB_VALUE(jni_result);\
+}\
+\
+static mrb_value jni_call_##type##_method_m(mrb_state *mrb, mrb_value self) {\
+  CALL_METHOD_BEGINNING;\
+  \
+  ASSIGN_JNI_##type_upper_case##_TO_VARIABLE(\
+    jni_result,\
+    (*jni_env)->Call##type_pascal_case##MethodA(jni_env, object, method_id, jni_args)\
+  );\
+  \
+  CALL_METHOD_CLEANUP;\
+  \
+  return CONVERT_JNI_##type_upper_case##_TO_MRB_VALUE(jni_result);\
+}
+
+#include "define_for_jni_types_with_void.c.inc"
+
+#undef FOR_JNI_TYPE
+
+#define GET_FIELD_BEGINNING\
+  mrb_value object_reference;\
+  mrb_value field_id_reference;\
+  drb->mrb_get_args(mrb, "oo", &object_reference, &field_id_reference);\
+  \
+  jobject object = unwrap_jni_reference_from_object(mrb, object_reference);\
+  struct jni_pointer *field_id_pointer = unwrap_jni_pointer_struct_from_object(mrb, field_id_reference);\
+  jfieldID field_id = (jfieldID)field_id_pointer->pointer;\
+  uint64_t stats_start_ns = start_stats_timer();
+
+#define SET_FIELD_BEGINNING\
+  mrb_value object_reference;\
+  mrb_value field_id_reference;\
+  mrb_value value;\
+  drb->mrb_get_args(mrb, "ooo", &object_reference, &field_id_reference, &value);\
+  \
+  jobject object = unwrap_jni_reference_from_object(mrb, object_reference);\
+  struct jni_pointer *field_id_pointer = unwrap_jni_pointer_struct_from_object(mrb, field_id_reference);\
+  jfieldID field_id = (jfieldID)field_id_pointer->pointer;\
+  handle_jni_exception(mrb);\
+  uint64_t stats_start_ns = start_stats_timer();
+
+#define FOR_JNI_TYPE(type, type_pascal_case, type_upper_case)\
+static mrb_value jni_get_##type##_field_m(mrb_state *mrb, mrb_value self) {\
+  GET_FIELD_BEGINNING;\
+  \
+  ASSIGN_JNI_##type_upper_case##_TO_VARIABLE(\
+    jni_result,\
+    (*jni_env)->Get##type_pascal_case##Field(jni_env, object, field_id)\
+  );\
+  record_member_stats(field_id_pointer, stats_start_ns);\
+  \
+  return CONVERT_JNI_##type_upper_case##_TO_MRB_VALUE(jni_result);\
+}\
+\
+static mrb_value jni_set_##type##_field_m(mrb_state *mrb, mrb_value self) {\
+  SET_FIELD_BEGINNING;\
+  \
+  ASSIGN_JNI_##type_upper_case##_TO_VARIABLE(jni_value, CONVERT_MRB_VALUE_TO_JNI_##type_upper_case(value));\
+  (*jni_env)->Set##type_pascal_case##Field(jni_env, object, field_id, jni_value);\
+  record_member_stats(field_id_pointer, stats_start_ns);\
+  RELEASE_CONVERTED_JNI_##type_upper_case(jni_value, value);\
+  \
+  return mrb_nil_value();\
+}\
+\
+static mrb_value jni_get_static_##type##_field_m(mrb_state *mrb, mrb_value self) {\
+  GET_FIELD_BEGINNING;\
+  \
+  ASSIGN_JNI_##type_upper_case##_TO_VARIABLE(\
+    jni_result,\
+    (*jni_env)->GetStatic##type_pascal_case##Field(jni_env, (jclass)object, field_id)\
+  );\
+  record_member_stats(field_id_pointer, stats_start_ns);\
+  \
+  return CONVERT_JNI_##type_upper_case##_TO_MRB_VALUE(jni_result);\
+}\
+\
+static mrb_value jni_set_static_##type##_field_m(mrb_state *mrb, mrb_value self) {\
+  SET_FIELD_BEGINNING;\
+  \
+  ASSIGN_JNI_##type_upper_case##_TO_VARIABLE(jni_value, CONVERT_MRB_VALUE_TO_JNI_##type_upper_case(value));\
+  (*jni_env)->SetStatic##type_pascal_case##Field(jni_env, (jclass)object, field_id, jni_value);\
+  record_member_stats(field_id_pointer, stats_start_ns);\
+  RELEASE_CONVERTED_JNI_##type_upper_case(jni_value, value);\
+  \
+  return mrb_nil_value();\
+}
+
+#include "define_for_jni_types_without_void.c.inc"
+
+#undef FOR_JNI_TYPE
+
+static mrb_value jni_new_object_m(mrb_state *mrb, mrb_value self) {
+  CALL_METHOD_BEGINNING;
+
+  jobject jni_result = (*jni_env)->NewObjectA(jni_env, (jclass)object, method_id, jni_args);
+
+  CALL_METHOD_CLEANUP;
+
+  return wrap_jni_local_reference_in_object(mrb, jni_result, JNI_REFERENCE_JOBJECT);
+}
+
+// ----- JNI Call Site Data Type -----
+
+enum call_site_kind {
+  CALL_SITE_METHOD,
+  CALL_SITE_STATIC_METHOD,
+  CALL_SITE_CONSTRUCTOR
+};
+
+// A method signature compiled once so that calls need no type parsing or allocation
+struct call_site {
+  jmethodID method_id;
+  // Borrowed from the Pointer kept in @method_id, used for FFI.stats
+  struct jni_pointer *method_id_pointer;
+  enum call_site_kind kind;
+  enum jni_type return_type;
+  // False if the declared return class can never be a boxed primitive, so returned objects are not checked
+  bool return_may_be_boxed;
+  mrb_int argc;
+  uint8_t *argument_types;
+  jvalue *args;
+};
+
+static void call_site_free(mrb_state *mrb, void *ptr) {
+  drb->mrb_free(mrb, ptr);
+}
+
+static const mrb_data_type call_site_data_type = {
+    "JNI::CallSite",
+    call_site_free,
+};
+
+static struct call_site *unwrap_call_site_from_object(mrb_state *mrb, mrb_value object) {
+  return drb->mrb_data_check_get_ptr(mrb, object, &call_site_data_type);
+}
+
+static enum call_site_kind parse_call_site_kind(mrb_state *mrb, mrb_sym kind) {
+  if (kind == drb->mrb_intern_lit(mrb, "method")) {
+    return CALL_SITE_METHOD;
+  }
+  if (kind == drb->mrb_intern_lit(mrb, "static_method")) {
+    return CALL_SITE_STATIC_METHOD;
+  }
+  if (kind == drb->mrb_intern_lit(mrb, "constructor")) {
+    return CALL_SITE_CONSTRUCTOR;
+  }
+
+  drb->mrb_raise(mrb, refs.jni_exception, "kind must be :method, :static_method or :constructor");
+  return CALL_SITE_METHOD;
+}
+
+// Declared boxed classes are unboxed without looking up the class of the returned object
+static enum jni_type parse_return_type(mrb_state *mrb, mrb_value type, bool *may_be_boxed) {
+  *may_be_boxed = false;
+
+  if (mrb_string_p(type)) {
+    const char *class_name = drb->mrb_string_value_cstr(mrb, &type);
+    struct boxed_type *boxed_type = find_boxed_type_by_class_name(class_name);
+    if (boxed_type != NULL) {
+      return JNI_TYPE_BOXED_BOOLEAN + (boxed_type - boxed_types);
+    }
+    *may_be_boxed = class_name_may_be_boxed(class_name);
+    return JNI_TYPE_OBJECT;
+  }
+
+  if (mrb_array_p(type)) {
+    enum jni_type result;
+    const char *error_message = parse_array_type(mrb, type, &result);
+    if (error_message) {
+      drb->mrb_raise(mrb, refs.jni_exception, error_message);
+    }
+    return result;
+  }
+
+  if (mrb_symbol_p(type)) {
+    const char *type_name = drb->mrb_sym2name(mrb, mrb_symbol(type));
+    if (strcmp(type_name, "string") == 0 || strcmp(type_name, "interned_string") == 0) {
+      return JNI_TYPE_OBJECT;
+    }
+
+    // Nothing is known about the class of :object return values
+    *may_be_boxed = strcmp(type_name, "object") == 0;
+
+#define FOR_JNI_TYPE(type, type_pascal_case, type_upper_case)\
+    if (strcmp(type_name, #type) == 0) {\
+      return JNI_TYPE_##type_upper_case;\
+    }
+
+#include "define_for_jni_types_with_void.c.inc"
+
+#undef FOR_JNI_TYPE
+  }
+
+  drb->mrb_raise(mrb, refs.jni_exception, "Unknown return type");
+  return JNI_TYPE_VOID;
+}
+
+// env is a parameter since call sites are also invoked on the async worker thread
+static jvalue invoke_call_site(JNIEnv *env, struct call_site *call_site, jobject object, const jvalue *jni_args) {
+  jvalue result;
+  result.j = 0;
+  jmethodID method_id = call_site->method_id;
+
+  if (call_site->kind == CALL_SITE_CONSTRUCTOR) {
+    result.l = (*env)->NewObjectA(env, (jclass)object, method_id, jni_args);
+    return result;
+  }
+
+  bool is_static = call_site->kind == CALL_SITE_STATIC_METHOD;
+
+  switch (call_site->return_type) {
+  case JNI_TYPE_VOID:
+    if (is_static) {
+      (*env)->CallStaticVoidMethodA(env, (jclass)object, method_id, jni_args);
+    } else {
+      (*env)->CallVoidMethodA(env, object, method_id, jni_args);
+    }
+    break;
+#define FOR_JNI_TYPE(type, type_pascal_case, type_upper_case)\
+  case JNI_TYPE_##type_upper_case:\
+    result.JNI_##type_upper_case##_JVALUE_MEMBER =\
+      is_static ? (*env)->CallStatic##type_pascal_case##MethodA(env, (jclass)object, method_id, jni_args)\
+                : (*env)->Call##type_pascal_case##MethodA(env, object, method_id, jni_args);\
+    break;
+
+#include "define_for_jni_types_without_void.c.inc"
+
+#undef FOR_JNI_TYPE
+  default:
+    if (is_primitive_array_type(call_site->return_type) || is_boxed_type(call_site->return_type)) {
+      result.l = is_static ? (*env)->CallStaticObjectMethodA(env, (jclass)object, method_id, jni_args)
+                           : (*env)->CallObjectMethodA(env, object, method_id, jni_args);
+    }
+    break;
+  }
+
+  return result;
+}
+
+static bool call_site_returns_reference(struct call_site *call_site) {
+  return call_site->kind == CALL_SITE_CONSTRUCTOR ||
+         call_site->return_type == JNI_TYPE_OBJECT ||
+         is_boxed_type(call_site->return_type) ||
+         is_primitive_array_type(call_site->return_type);
+}
+
+// Takes ownership of returned local references
+static mrb_value convert_call_site_result(mrb_state *mrb, struct call_site *call_site, jvalue result) {
+  if (call_site->kind == CALL_SITE_CONSTRUCTOR) {
+    return wrap_jni_local_reference_in_object(mrb, result.l, JNI_REFERENCE_JOBJECT);
+  }
+  if (call_site->return_type == JNI_TYPE_OBJECT) {
+    return convert_jni_reference_to_mrb_value(mrb, result.l, call_site->return_may_be_boxed);
+  }
+
+  return convert_jni_value_to_mrb_value(mrb, call_site->return_type, result);
+}
+
+// ----- JNI Call Site Data Type END -----
+
+static mrb_value jni_build_call_site_m(mrb_state *mrb, mrb_value self) {
+  mrb_value method_id_reference;
+  mrb_value argument_types_array;
+  mrb_value return_type;
+  mrb_sym kind;
+  drb->mrb_get_args(mrb, "oAon", &method_id_reference, &argument_types_array, &return_type, &kind);
+
+  struct jni_pointer *method_id_pointer = unwrap_jni_pointer_struct_from_object(mrb, method_id_reference);
+  enum call_site_kind call_site_kind = parse_call_site_kind(mrb, kind);
+  bool return_may_be_boxed;
+  enum jni_type call_site_return_type = parse_return_type(mrb, return_type, &return_may_be_boxed);
+  mrb_int argc = RARRAY_LEN(argument_types_array);
+
+  // Type codes and argument buffer live in the same allocation as the call site itself
+  struct call_site *call_site = drb->mrb_malloc(mrb, sizeof(struct call_site) + argc * (sizeof(jvalue) + sizeof(uint8_t)));
+  call_site->method_id = (jmethodID)method_id_pointer->pointer;
+  call_site->method_id_pointer = method_id_pointer;
+  call_site->kind = call_site_kind;
+  call_site->return_type = call_site_return_type;
+  call_site->return_may_be_boxed = return_may_be_boxed;
+  call_site->argc = argc;
+  call_site->args = (jvalue *)(call_site + 1);
+  call_site->argument_types = (uint8_t *)(call_site->args + argc);
+
+  for (int i = 0; i < argc; i++) {
+    enum jni_type type;
+    const char *error_message = parse_argument_type(mrb, RARRAY_PTR(argument_types_array)[i], &type);
+    if (error_message) {
+      drb->mrb_free(mrb, call_site);
+      raise_wrong_argument_type(mrb, i, error_message);
+    }
+    call_site->argument_types[i] = (uint8_t)type;
+  }
+
+  struct RData *data = drb->mrb_data_object_alloc(mrb, refs.jni_call_site, call_site, &call_site_data_type);
+  mrb_value result = drb->mrb_obj_value(data);
+  drb->mrb_iv_set(mrb, result, drb->mrb_intern_lit(mrb, "@method_id"), method_id_reference);
+  return result;
+}
+
+static mrb_value jni_call_m(mrb_state *mrb, mrb_value self) {
+  mrb_value call_site_object;
+  mrb_value object_reference;
+  mrb_value *args;
+  mrb_int argc;
+  drb->mrb_get_args(mrb, "oo*", &call_site_object, &object_reference, &args, &argc);
+
+  struct call_site *call_site = unwrap_call_site_from_object(mrb, call_site_object);
+  jobject object = unwrap_jni_reference_from_object(mrb, object_reference);
+
+  if (argc != call_site->argc) {
+    drb->mrb_raisef(mrb, refs.jni_exception, "wrong number of arguments (given %d, expected %d)", (int)argc, (int)call_site->argc);
+  }
+
+  jvalue *jni_args = call_site->args;
+  for (int i = 0; i < argc; i++) {
+    const char *error_message = convert_mrb_value_to_jni_argument(mrb, call_site->argument_types[i], args[i], &jni_args[i]);
+    if (error_message) {
+      delete_local_argument_refs(call_site->argument_types, jni_args, i);
+      raise_wrong_argument_type(mrb, i, error_message);
+    }
+  }
+
+  uint64_t stats_start_ns = start_stats_timer();
+  jvalue jni_result = invoke_call_site(jni_env, call_site, object, jni_args);
+  record_member_stats(call_site->method_id_pointer, stats_start_ns);
+  delete_local_argument_refs(call_site->argument_types, jni_args, argc);
+  handle_jni_exception(mrb);
+
+  return convert_call_site_result(mrb, call_site, jni_result);
+}
+
+// ----- JNI Command Buffer Data Type -----
+
+enum command_type {
+  COMMAND_CALL,
+  COMMAND_SET_FIELD,
+  COMMAND_SET_STATIC_FIELD,
+  COMMAND_CHECKPOINT
+};
+
+struct command {
+  enum command_type command_type;
+  // Global reference to the receiver
+  jobject object;
+  // Call sites are kept alive by the @call_sites array of the buffer object
+  struct call_site *call_site;
+  jfieldID field_id;
+  mrb_int argc;
+  uint8_t *argument_types;
+  jvalue *args;
+};
+
+struct command_buffer {
+  struct command *commands;
+  mrb_int size;
+  mrb_int capacity;
+  // Arguments of a reserved command that was never committed because its conversion failed
+  jvalue *uncommitted_args;
+};
+
+static void command_free(mrb_state *mrb, struct command *command) {
+  release_retained_jni_args(jni_env, command->argument_types, command->args, command->argc);
+  if (command->object != NULL) {
+    (*jni_env)->DeleteGlobalRef(jni_env, command->object);
+  }
+  drb->mrb_free(mrb, command->args);
+}
+
+static void command_buffer_free(mrb_state *mrb, void *ptr) {
+  struct command_buffer *buffer = ptr;
+  for (mrb_int i = 0; i < buffer->size; i++) {
+    command_free(mrb, &buffer->commands[i]);
+  }
+  drb->mrb_free(mrb, buffer->uncommitted_args);
+  drb->mrb_free(mrb, buffer->commands);
+  drb->mrb_free(mrb, buffer);
+}
+
+static const mrb_data_type command_buffer_data_type = {
+    "JNI::CommandBuffer",
+    command_buffer_free,
+};
+
+static struct command_buffer *unwrap_command_buffer_from_object(mrb_state *mrb, mrb_value object) {
+  return drb->mrb_data_check_get_ptr(mrb, object, &command_buffer_data_type);
+}
+
+// Returns a new command with argc argument slots which becomes part of the buffer once it is committed
+static struct command *command_buffer_reserve(mrb_state *mrb,
+                                              struct command_buffer *buffer,
+                                              enum command_type type,
+                                              mrb_int argc) {
+  drb->mrb_free(mrb, buffer->uncommitted_args);
+  buffer->uncommitted_args = NULL;
+
+  if (buffer->size == buffer->capacity) {
+    buffer->capacity = buffer->capacity == 0 ? 8 : buffer->capacity * 2;
+    buffer->commands = drb->mrb_realloc(mrb, buffer->commands, sizeof(struct command) * buffer->capacity);
+  }
+
+  struct command *command = &buffer->commands[buffer->size];
+  command->command_type = type;
+  command->object = NULL;
+  command->call_site = NULL;
+  command->field_id = NULL;
+  command->argc = argc;
+  command->args = drb->mrb_calloc(mrb, 1, (sizeof(jvalue) + sizeof(uint8_t)) * argc);
+  command->argument_types = CONVERTED_ARGUMENT_TYPES(command->args, argc);
+  buffer->uncommitted_args = command->args;
+  return command;
+}
+
+static mrb_value command_buffer_commit(struct command_buffer *buffer) {
+  buffer->uncommitted_args = NULL;
+  buffer->size++;
+  return mrb_fixnum_value(buffer->size - 1);
+}
+
+static void command_buffer_set_field(struct command *command) {
+  set_field_value(command->object,
+                  command->field_id,
+                  command->command_type == COMMAND_SET_STATIC_FIELD,
+                  command->argument_types[0],
+                  command->args[0]);
+}
+
+static void command_buffer_execute(struct command_buffer *buffer) {
+  jthrowable first_exception = NULL;
+  bool skipping = false;
+
+  for (mrb_int i = 0; i < buffer->size; i++) {
+    struct command *command = &buffer->commands[i];
+
+    if (command->command_type == COMMAND_CHECKPOINT) {
+      skipping = false;
+      continue;
+    }
+    if (skipping) {
+      continue;
+    }
+
+    if (command->command_type == COMMAND_CALL) {
+      uint64_t stats_start_ns = start_stats_timer();
+      jvalue result = invoke_call_site(jni_env, command->call_site, command->object, command->args);
+      record_member_stats(command->call_site->method_id_pointer, stats_start_ns);
+      if (call_site_returns_reference(command->call_site) && result.l != NULL) {
+        (*jni_env)->DeleteLocalRef(jni_env, result.l);
+      }
+    } else {
+      command_buffer_set_field(command);
+    }
+
+    // No further JNI calls are allowed while an exception is pending
+    if ((*jni_env)->ExceptionCheck(jni_env)) {
+      jthrowable exception = (*jni_env)->ExceptionOccurred(jni_env);
+      (*jni_env)->ExceptionClear(jni_env);
+      if (first_exception == NULL) {
+        first_exception = (*jni_env)->NewGlobalRef(jni_env, exception);
+      }
+      (*jni_env)->DeleteLocalRef(jni_env, exception);
+      skipping = true;
+    }
+  }
+
+  if (first_exception != NULL) {
+    (*jni_env)->Throw(jni_env, first_exception);
+    (*jni_env)->DeleteGlobalRef(jni_env, first_exception);
+  }
+}
+
+// ----- JNI Command Buffer Data Type END -----
+
+static mrb_value jni_new_command_buffer_m(mrb_state *mrb, mrb_value self) {
+  struct command_buffer *buffer = drb->mrb_malloc(mrb, sizeof(struct command_buffer));
+  buffer->commands = NULL;
+  buffer->size = 0;
+  buffer->capacity = 0;
+  buffer->uncommitted_args = NULL;
+
+  struct RData *data = drb->mrb_data_object_alloc(mrb, refs.jni_command_buffer, buffer, &command_buffer_data_type);
+  mrb_value result = drb->mrb_obj_value(data);
+  drb->mrb_iv_set(mrb, result, drb->mrb_intern_lit(mrb, "@call_sites"), drb->mrb_ary_new(mrb));
+  return result;
+}
+
+static mrb_value jni_command_buffer_add_call_m(mrb_state *mrb, mrb_value self) {
+  mrb_value call_site_object;
+  mrb_value object_reference;
+  mrb_value *args;
+  mrb_int argc;
+  drb->mrb_get_args(mrb, "oo*", &call_site_object, &object_reference, &args, &argc);
+
+  struct command_buffer *buffer = unwrap_command_buffer_from_object(mrb, self);
+  struct call_site *call_site = unwrap_call_site_from_object(mrb, call_site_object);
+  jobject object = unwrap_jni_reference_from_object(mrb, object_reference);
+
+  if (argc != call_site->argc) {
+    drb->mrb_raisef(mrb, refs.jni_exception, "wrong number of arguments (given %d, expected %d)", (int)argc, (int)call_site->argc);
+  }
+
+  struct command *command = command_buffer_reserve(mrb, buffer, COMMAND_CALL, argc);
+  memcpy(command->argument_types, call_site->argument_types, argc);
+  convert_mrb_args_to_retained_jni_args(mrb, call_site->argument_types, args, argc, command->args);
+  command->call_site = call_site;
+  command->object = (*jni_env)->NewGlobalRef(jni_env, object);
+
+  drb->mrb_ary_push(mrb, drb->mrb_iv_get(mrb, self, drb->mrb_intern_lit(mrb, "@call_sites")), call_site_object);
+  return command_buffer_commit(buffer);
+}
+
+#define ADD_SET_FIELD_COMMAND(command_type)\
+  mrb_value object_reference;\
+  mrb_value field_id_reference;\
+  mrb_value type;\
+  mrb_value value;\
+  drb->mrb_get_args(mrb, "oooo", &object_reference, &field_id_reference, &type, &value);\
+  \
+  struct command_buffer *buffer = unwrap_command_buffer_from_object(mrb, self);\
+  jobject object = unwrap_jni_reference_from_object(mrb, object_reference);\
+  jfieldID field_id = (jfieldID)unwrap_jni_pointer_from_object(mrb, field_id_reference);\
+  \
+  enum jni_type field_type;\
+  const char *error_message = parse_argument_type(mrb, type, &field_type);\
+  if (error_message) {\
+    raise_wrong_argument_type(mrb, 0, error_message);\
+  }\
+  \
+  struct command *command = command_buffer_reserve(mrb, buffer, command_type, 1);\
+  command->argument_types[0] = field_type;\
+  convert_mrb_args_to_retained_jni_args(mrb, command->argument_types, &value, 1, command->args);\
+  command->field_id = field_id;\
+  command->object = (*jni_env)->NewGlobalRef(jni_env, object);\
+  \
+  return command_buffer_commit(buffer);
+
+static mrb_value jni_command_buffer_add_set_field_m(mrb_state *mrb, mrb_value self) {
+  ADD_SET_FIELD_COMMAND(COMMAND_SET_FIELD);
+}
+
+static mrb_value jni_command_buffer_add_set_static_field_m(mrb_state *mrb, mrb_value self) {
+  ADD_SET_FIELD_COMMAND(COMMAND_SET_STATIC_FIELD);
+}
+
+static mrb_value jni_command_buffer_add_checkpoint_m(mrb_state *mrb, mrb_value self) {
+  struct command_buffer *buffer = unwrap_command_buffer_from_object(mrb, self);
+  command_buffer_reserve(mrb, buffer, COMMAND_CHECKPOINT, 0);
+  return command_buffer_commit(buffer);
+}
+
+static mrb_value jni_command_buffer_set_argument_m(mrb_state *mrb, mrb_value self) {
+  mrb_int command_index;
+  mrb_int argument_index;
+  mrb_value value;
+  drb->mrb_get_args(mrb, "iio", &command_index, &argument_index, &value);
+
+  struct command_buffer *buffer = unwrap_command_buffer_from_object(mrb, self);
+  if (command_index < 0 || command_index >= buffer->size) {
+    drb->mrb_raisef(mrb, refs.jni_exception, "No command at index %d", (int)command_index);
+  }
+
+  struct command *command = &buffer->commands[command_index];
+  if (argument_index < 0 || argument_index >= command->argc) {
+    drb->mrb_raisef(mrb, refs.jni_exception, "Command %d has no argument at index %d", (int)command_index, (int)argument_index);
+  }
+
+  uint8_t *argument_type = &command->argument_types[argument_index];
+  jvalue jni_value;
+  const char *error_message = convert_mrb_value_to_retained_jni_argument(mrb, *argument_type, value, &jni_value);
+  if (error_message) {
+    raise_wrong_argument_type(mrb, argument_index, error_message);
+  }
+
+  release_retained_jni_args(jni_env, argument_type, &command->args[argument_index], 1);
+  command->args[argument_index] = jni_value;
+  return mrb_nil_value();
+}
+
+static mrb_value jni_command_buffer_size_m(mrb_state *mrb, mrb_value self) {
+  struct command_buffer *buffer = unwrap_command_buffer_from_object(mrb, self);
+  return mrb_fixnum_value(buffer->size);
+}
+
+static mrb_value jni_command_buffer_execute_m(mrb_state *mrb, mrb_value self) {
+  struct command_buffer *buffer = unwrap_command_buffer_from_object(mrb, self);
+  command_buffer_execute(buffer);
+  handle_jni_exception(mrb);
+  return mrb_nil_value();
+}
+
+// ----- JNI Field Set Data Type -----
+
+// Instance fields which are read and written together
+struct field_set {
+  mrb_int count;
+  jfieldID *field_ids;
+  uint8_t *types;
+};
+
+static void field_set_free(mrb_state *mrb, void *ptr) {
+  drb->mrb_free(mrb, ptr);
+}
+
+static const mrb_data_type field_set_data_type = {
+    "JNI::FieldSet",
+    field_set_free,
+};
+
+static struct field_set *unwrap_field_set_from_object(mrb_state *mrb, mrb_value object) {
+  return drb->mrb_data_check_get_ptr(mrb, object, &field_set_data_type);
+}
+
+// ----- JNI Field Set Data Type END -----
+
+static mrb_value jni_build_field_set_m(mrb_state *mrb, mrb_value self) {
+  mrb_value field_ids_array;
+  mrb_value types_array;
+  drb->mrb_get_args(mrb, "AA", &field_ids_array, &types_array);
+
+  mrb_int count = RARRAY_LEN(field_ids_array);
+  if (RARRAY_LEN(types_array) != count) {
+    drb->mrb_raise(mrb, refs.jni_exception, "field_ids and types must have the same length");
+  }
+
+  // Field IDs and type codes live in the same allocation as the field set itself
+  struct field_set *field_set = drb->mrb_malloc(mrb, sizeof(struct field_set) + count * (sizeof(jfieldID) + sizeof(uint8_t)));
+  field_set->count = count;
+  field_set->field_ids = (jfieldID *)(field_set + 1);
+  field_set->types = (uint8_t *)(field_set->field_ids + count);
+  struct RData *data = drb->mrb_data_object_alloc(mrb, refs.jni_field_set, field_set, &field_set_data_type);
+  mrb_value result = drb->mrb_obj_value(data);
+
+  for (mrb_int i = 0; i < count; i++) {
+    field_set->field_ids[i] = (jfieldID)unwrap_jni_pointer_from_object(mrb, RARRAY_PTR(field_ids_array)[i]);
+    enum jni_type type;
+    const char *error_message = parse_argument_type(mrb, RARRAY_PTR(types_array)[i], &type);
+    if (error_message) {
+      raise_wrong_argument_type(mrb, (int)i, error_message);
+    }
+    field_set->types[i] = (uint8_t)type;
+  }
+
+  drb->mrb_iv_set(mrb, result, drb->mrb_intern_lit(mrb, "@field_ids"), field_ids_array);
+  return result;
+}
+
+static mrb_value jni_read_fields_m(mrb_state *mrb, mrb_value self) {
+  mrb_value field_set_object;
+  mrb_value object_reference;
+  drb->mrb_get_args(mrb, "oo", &field_set_object, &object_reference);
+
+  struct field_set *field_set = unwrap_field_set_from_object(mrb, field_set_object);
+  jobject object = unwrap_jni_reference_from_object(mrb, object_reference);
+
+  mrb_value result = drb->mrb_ary_new_capa(mrb, field_set->count);
+  for (mrb_int i = 0; i < field_set->count; i++) {
+    enum jni_type type = field_set->types[i];
+    jvalue value = get_field_value(object, field_set->field_ids[i], type);
+    handle_jni_exception(mrb);
+
+    // Java strings and boxed primitives are converted like objects returned from methods
+    if (type == JNI_TYPE_STRING || type == JNI_TYPE_INTERNED_STRING || is_boxed_type(type)) {
+      type = JNI_TYPE_OBJECT;
+    }
+    drb->mrb_ary_push(mrb, result, convert_jni_value_to_mrb_value(mrb, type, value));
+  }
+  return result;
+}
+
+// Only writes the values which differ from the previous values
+static mrb_value jni_write_fields_m(mrb_state *mrb, mrb_value self) {
+  mrb_value field_set_object;
+  mrb_value object_reference;
+  mrb_value values;
+  mrb_value previous_values;
+  drb->mrb_get_args(mrb, "ooAA", &field_set_object, &object_reference, &values, &previous_values);
+
+  struct field_set *field_set = unwrap_field_set_from_object(mrb, field_set_object);
+  jobject object = unwrap_jni_reference_from_object(mrb, object_reference);
+
+  if (RARRAY_LEN(values) != field_set->count || RARRAY_LEN(previous_values) != field_set->count) {
+    drb->mrb_raise(mrb, refs.jni_exception, "values and previous_values must have one entry per field");
+  }
+
+  mrb_int written_count = 0;
+  for (mrb_int i = 0; i < field_set->count; i++) {
+    mrb_value value = RARRAY_PTR(values)[i];
+    if (drb->mrb_equal(mrb, value, RARRAY_PTR(previous_values)[i])) {
+      continue;
+    }
+
+    jvalue jni_value;
+    const char *error_message = convert_mrb_value_to_jni_argument(mrb, field_set->types[i], value, &jni_value);
+    if (error_message) {
+      raise_wrong_argument_type(mrb, (int)i, error_message);
+    }
+    set_field_value(object, field_set->field_ids[i], false, field_set->types[i], jni_value);
+    delete_local_argument_refs(&field_set->types[i], &jni_value, 1);
+    handle_jni_exception(mrb);
+    written_count++;
+  }
+
+  return mrb_fixnum_value(written_count);
+}
+
+// ----- JNI Async Calls -----
+
+#define ASYNC_QUEUE_CAPACITY 256
+
+enum async_call_state {
+  ASYNC_CALL_PENDING,
+  ASYNC_CALL_DONE
+};
+
+// Shared by the Future object and the worker thread and freed once both released it
+struct async_call {
+  _Atomic int state;
+  _Atomic int reference_count;
+  // Copied so that the call site object does not need to outlive the call
+  struct call_site call_site;
+  // Global references
+  jobject object;
+  jthrowable exception;
+  // Returned references are global references until the future is drained
+  jvalue result;
+  mrb_int argc;
+  uint8_t *argument_types;
+  jvalue *args;
+};
+
+// Single producer (main thread) single consumer (worker thread) ring buffer.
+// The semaphore only wakes up the worker, handing over calls needs no lock.
+struct async_queue {
+  struct async_call *calls[ASYNC_QUEUE_CAPACITY];
+  // Only written by the main thread
+  _Atomic uint32_t tail;
+  // Only written by the worker thread
+  _Atomic uint32_t head;
+  sem_t pending_calls;
+};
+
+static struct async_queue async_queue;
+static bool async_worker_started = false;
+static JavaVM *java_vm;
+
+// env is the JNIEnv of the thread releasing the call
+static void async_call_release(JNIEnv *env, struct async_call *call) {
+  if (atomic_fetch_sub_explicit(&call->reference_count, 1, memory_order_acq_rel) != 1) {
+    return;
+  }
+
+  // Result or exception of a future that was never drained
+  if (call->exception != NULL) {
+    (*env)->DeleteGlobalRef(env, call->exception);
+  }
+  if (call_site_returns_reference(&call->call_site) && call->result.l != NULL) {
+    (*env)->DeleteGlobalRef(env, call->result.l);
+  }
+  free(call);
+}
+
+static void async_call_free(mrb_state *mrb, void *ptr) {
+  async_call_release(jni_env, ptr);
+}
+
+static const mrb_data_type async_call_data_type = {
+    "JNI::Future",
+    async_call_free,
+};
+
+static struct async_call *unwrap_async_call_from_object(mrb_state *mrb, mrb_value object) {
+  return drb->mrb_data_check_get_ptr(mrb, object, &async_call_data_type);
+}
+
+static void execute_async_call(JNIEnv *env, struct async_call *call) {
+  jvalue result = invoke_call_site(env, &call->call_site, call->object, call->args);
+
+  if ((*env)->ExceptionCheck(env)) {
+    jthrowable exception = (*env)->ExceptionOccurred(env);
+    (*env)->ExceptionClear(env);
+    call->exception = (*env)->NewGlobalRef(env, exception);
+    (*env)->DeleteLocalRef(env, exception);
+    result.j = 0;
+  } else if (call_site_returns_reference(&call->call_site) && result.l != NULL) {
+    jobject local_result = result.l;
+    result.l = (*env)->NewGlobalRef(env, local_result);
+    (*env)->DeleteLocalRef(env, local_result);
+  }
+  call->result = result;
+
+  release_retained_jni_args(env, call->argument_types, call->args, call->argc);
+  (*env)->DeleteGlobalRef(env, call->object);
+  call->object = NULL;
+
+  atomic_store_explicit(&call->state, ASYNC_CALL_DONE, memory_order_release);
+  async_call_release(env, call);
+}
+
+static void *async_worker_main(void *argument) {
+  JNIEnv *env;
+  (*java_vm)->AttachCurrentThreadAsDaemon(java_vm, (void *)&env, NULL);
+
+  for (;;) {
+    while (sem_wait(&async_queue.pending_calls) != 0) {
+      // Interrupted by a signal
+    }
+
+    uint32_t head = atomic_load_explicit(&async_queue.head, memory_order_relaxed);
+    struct async_call *call = async_queue.calls[head % ASYNC_QUEUE_CAPACITY];
+    atomic_store_explicit(&async_queue.head, head + 1, memory_order_release);
+    execute_async_call(env, call);
+  }
+
+  return NULL;
+}
+
+static void start_async_worker(mrb_state *mrb) {
+  if (async_worker_started) {
+    return;
+  }
+
+  (*jni_env)->GetJavaVM(jni_env, &java_vm);
+  sem_init(&async_queue.pending_calls, 0, 0);
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, async_worker_main, NULL) != 0) {
+    sem_destroy(&async_queue.pending_calls);
+    drb->mrb_raise(mrb, refs.jni_exception, "Could not start the async worker thread");
+  }
+  pthread_detach(thread);
+  async_worker_started = true;
+}
+
+// ----- JNI Async Calls END -----
+
+static mrb_value jni_call_async_m(mrb_state *mrb, mrb_value self) {
+  mrb_value call_site_object;
+  mrb_value object_reference;
+  mrb_value *args;
+  mrb_int argc;
+  drb->mrb_get_args(mrb, "oo*", &call_site_object, &object_reference, &args, &argc);
+
+  struct call_site *call_site = unwrap_call_site_from_object(mrb, call_site_object);
+  jobject object = unwrap_jni_reference_from_object(mrb, object_reference);
+
+  if (argc != call_site->argc) {
+    drb->mrb_raisef(mrb, refs.jni_exception, "wrong number of arguments (given %d, expected %d)", (int)argc, (int)call_site->argc);
+  }
+
+  uint32_t tail = atomic_load_explicit(&async_queue.tail, memory_order_relaxed);
+  uint32_t head = atomic_load_explicit(&async_queue.head, memory_order_acquire);
+  if (tail - head == ASYNC_QUEUE_CAPACITY) {
+    drb->mrb_raise(mrb, refs.jni_exception, "Too many pending async calls");
+  }
+  start_async_worker(mrb);
+
+  // Not allocated with mrb_malloc since it might be freed on the worker thread
+  struct async_call *call = calloc(1, sizeof(struct async_call) + argc * (sizeof(jvalue) + sizeof(uint8_t)));
+  atomic_init(&call->state, ASYNC_CALL_PENDING);
+  // Only owned by the future until it is queued
+  atomic_init(&call->reference_count, 1);
+  call->call_site = *call_site;
+  call->argc = argc;
+  call->args = (jvalue *)(call + 1);
+  call->argument_types = (uint8_t *)(call->args + argc);
+  call->call_site.args = call->args;
+  call->call_site.argument_types = call->argument_types;
+  memcpy(call->argument_types, call_site->argument_types, argc);
+
+  struct RData *data = drb->mrb_data_object_alloc(mrb, refs.jni_future, call, &async_call_data_type);
+  mrb_value result = drb->mrb_obj_value(data);
+
+  convert_mrb_args_to_retained_jni_args(mrb, call->argument_types, args, argc, call->args);
+  call->object = (*jni_env)->NewGlobalRef(jni_env, object);
+
+  atomic_fetch_add_explicit(&call->reference_count, 1, memory_order_relaxed);
+  async_queue.calls[tail % ASYNC_QUEUE_CAPACITY] = call;
+  atomic_store_explicit(&async_queue.tail, tail + 1, memory_order_release);
+  sem_post(&async_queue.pending_calls);
+
+  return result;
+}
+
+static mrb_value jni_future_done_m(mrb_state *mrb, mrb_value self) {
+  struct async_call *call = unwrap_async_call_from_object(mrb, self);
+  return mrb_bool_value(atomic_load_explicit(&call->state, memory_order_acquire) == ASYNC_CALL_DONE);
+}
+
+// Converts the result on the main thread the first time and returns the same value afterwards
+static mrb_value jni_future_value_m(mrb_state *mrb, mrb_value self) {
+  struct async_call *call = unwrap_async_call_from_object(mrb, self);
+  mrb_sym value_symbol = drb->mrb_intern_lit(mrb, "@value");
+  mrb_sym exception_symbol = drb->mrb_intern_lit(mrb, "@exception");
+  mrb_sym drained_symbol = drb->mrb_intern_lit(mrb, "@drained");
+
+  if (mrb_true_p(drb->mrb_iv_get(mrb, self, drained_symbol))) {
+    mrb_value exception = drb->mrb_iv_get(mrb, self, exception_symbol);
+    if (!mrb_nil_p(exception)) {
+      drb->mrb_exc_raise(mrb, exception);
+    }
+    return drb->mrb_iv_get(mrb, self, value_symbol);
+  }
+
+  if (atomic_load_explicit(&call->state, memory_order_acquire) != ASYNC_CALL_DONE) {
+    drb->mrb_raise(mrb, refs.jni_exception, "Async call has not finished yet (check #done? first)");
+  }
+  drb->mrb_iv_set(mrb, self, drained_symbol, mrb_true_value());
+
+  if (call->exception != NULL) {
+    (*jni_env)->Throw(jni_env, call->exception);
+    (*jni_env)->DeleteGlobalRef(jni_env, call->exception);
+    call->exception = NULL;
+
+    mrb_value exception = take_pending_jni_exception(mrb);
+    drb->mrb_iv_set(mrb, self, exception_symbol, exception);
+    drb->mrb_exc_raise(mrb, exception);
+  }
+
+  jvalue result = call->result;
+  if (call_site_returns_reference(&call->call_site) && result.l != NULL) {
+    result.l = (*jni_env)->NewLocalRef(jni_env, call->result.l);
+    (*jni_env)->DeleteGlobalRef(jni_env, call->result.l);
+    call->result.l = NULL;
+  }
+
+  mrb_value value = convert_call_site_result(mrb, &call->call_site, result);
+  drb->mrb_iv_set(mrb, self, value_symbol, value);
+  return value;
+}
+
+// ----- Deferred Calls -----
+
+// Calls executed on the main thread by FFI.pump within a time budget
+struct deferred_call {
+  mrb_int priority;
+  // Keeps calls of the same priority in order, also after coalescing
+  uint64_t sequence;
+  // 0 if the call is not coalesced
+  mrb_sym key;
+  // Copied so that the call site object does not need to outlive the call
+  struct call_site call_site;
+  // Global reference
+  jobject object;
+  mrb_int argc;
+  uint8_t *argument_types;
+  jvalue *args;
+};
+
+// Sorted by priority (highest first) and sequence
+struct deferred_queue {
+  struct deferred_call **calls;
+  mrb_int count;
+  mrb_int capacity;
+  uint64_t next_sequence;
+};
+
+static struct deferred_queue deferred_queue = {NULL, 0, 0, 0};
+
+static void deferred_call_free(struct deferred_call *call) {
+  release_retained_jni_args(jni_env, call->argument_types, call->args, call->argc);
+  (*jni_env)->DeleteGlobalRef(jni_env, call->object);
+  free(call);
+}
+
+static bool deferred_call_runs_before(struct deferred_call *call, struct deferred_call *other) {
+  if (call->priority != other->priority) {
+    return call->priority > other->priority;
+  }
+  return call->sequence < other->sequence;
+}
+
+static void insert_deferred_call(struct deferred_call *call) {
+  if (deferred_queue.count == deferred_queue.capacity) {
+    deferred_queue.capacity = deferred_queue.capacity == 0 ? 64 : deferred_queue.capacity * 2;
+    deferred_queue.calls = realloc(deferred_queue.calls, deferred_queue.capacity * sizeof(struct deferred_call *));
+  }
+
+  // Binary search for the first call running after the new one
+  mrb_int low = 0;
+  mrb_int high = deferred_queue.count;
+  while (low < high) {
+    mrb_int middle = (low + high) / 2;
+    if (deferred_call_runs_before(deferred_queue.calls[middle], call)) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+
+  memmove(&deferred_queue.calls[low + 1],
+          &deferred_queue.calls[low],
+          (deferred_queue.count - low) * sizeof(struct deferred_call *));
+  deferred_queue.calls[low] = call;
+  deferred_queue.count++;
+}
+
+// Removes and returns the queued call with the key or NULL
+static struct deferred_call *remove_deferred_call_with_key(mrb_sym key) {
+  for (mrb_int i = 0; i < deferred_queue.count; i++) {
+    struct deferred_call *call = deferred_queue.calls[i];
+    if (call->key == key) {
+      memmove(&deferred_queue.calls[i],
+              &deferred_queue.calls[i + 1],
+              (deferred_queue.count - i - 1) * sizeof(struct deferred_call *));
+      deferred_queue.count--;
+      return call;
+    }
+  }
+  return NULL;
+}
+
+// Exceptions are collected in @deferred_errors of the FFI module until they are drained
+static void execute_deferred_call(mrb_state *mrb, struct deferred_call *call) {
+  jvalue result = invoke_call_site(jni_env, &call->call_site, call->object, call->args);
+
+  if ((*jni_env)->ExceptionCheck(jni_env)) {
+    mrb_value errors = drb->mrb_iv_get(mrb, drb->mrb_obj_value(refs.jni), drb->mrb_intern_lit(mrb, "@deferred_errors"));
+    drb->mrb_ary_push(mrb, errors, take_pending_jni_exception(mrb));
+  } else if (call_site_returns_reference(&call->call_site) && result.l != NULL) {
+    (*jni_env)->DeleteLocalRef(jni_env, result.l);
+  }
+}
+
+// ----- Deferred Calls END -----
+
+static mrb_value jni_defer_call_m(mrb_state *mrb, mrb_value self) {
+  mrb_value call_site_object;
+  mrb_value object_reference;
+  mrb_int priority;
+  mrb_value key;
+  mrb_value *args;
+  mrb_int argc;
+  drb->mrb_get_args(mrb, "ooio*", &call_site_object, &object_reference, &priority, &key, &args, &argc);
+
+  struct call_site *call_site = unwrap_call_site_from_object(mrb, call_site_object);
+  jobject object = unwrap_jni_reference_from_object(mrb, object_reference);
+
+  if (argc != call_site->argc) {
+    drb->mrb_raisef(mrb, refs.jni_exception, "wrong number of arguments (given %d, expected %d)", (int)argc, (int)call_site->argc);
+  }
+
+  mrb_sym key_symbol = 0;
+  if (mrb_symbol_p(key)) {
+    key_symbol = mrb_symbol(key);
+  } else if (mrb_string_p(key)) {
+    key_symbol = drb->mrb_intern_str(mrb, key);
+  } else if (!mrb_nil_p(key)) {
+    drb->mrb_raise(mrb, refs.jni_exception, "key must be a Symbol, String or nil");
+  }
+
+  // Not allocated with mrb_malloc since the queue is not owned by any Ruby object
+  struct deferred_call *call = calloc(1, sizeof(struct deferred_call) + argc * (sizeof(jvalue) + sizeof(uint8_t)));
+  call->priority = priority;
+  call->key = key_symbol;
+  call->call_site = *call_site;
+  call->argc = argc;
+  call->args = (jvalue *)(call + 1);
+  call->argument_types = (uint8_t *)(call->args + argc);
+  call->call_site.args = call->args;
+  call->call_site.argument_types = call->argument_types;
+  memcpy(call->argument_types, call_site->argument_types, argc);
+
+  for (int i = 0; i < argc; i++) {
+    const char *error_message = convert_mrb_value_to_retained_jni_argument(mrb, call->argument_types[i], args[i], &call->args[i]);
+    if (error_message) {
+      release_retained_jni_args(jni_env, call->argument_types, call->args, i);
+      free(call);
+      raise_wrong_argument_type(mrb, i, error_message);
+    }
+  }
+  call->object = (*jni_env)->NewGlobalRef(jni_env, object);
+
+  struct deferred_call *replaced_call = key_symbol != 0 ? remove_deferred_call_with_key(key_symbol) : NULL;
+  if (replaced_call != NULL) {
+    // Only the latest call is executed, at the place of the first one
+    call->sequence = replaced_call->sequence;
+    deferred_call_free(replaced_call);
+  } else {
+    call->sequence = deferred_queue.next_sequence++;
+  }
+  insert_deferred_call(call);
+
+  return mrb_bool_value(replaced_call != NULL);
+}
+
+// Executes queued calls until the budget is used up, at least one call per pump.
+// Returns the number of executed calls.
+static mrb_value jni_pump_m(mrb_state *mrb, mrb_value self) {
+  mrb_int budget_us;
+  drb->mrb_get_args(mrb, "i", &budget_us);
+
+  uint64_t deadline_ns = monotonic_time_ns() + (uint64_t)budget_us * 1000;
+  int arena_index = drb->mrb_gc_arena_save(mrb);
+  mrb_int executed_count = 0;
+  while (executed_count < deferred_queue.count) {
+    struct deferred_call *call = deferred_queue.calls[executed_count];
+    execute_deferred_call(mrb, call);
+    deferred_call_free(call);
+    executed_count++;
+    drb->mrb_gc_arena_restore(mrb, arena_index);
+
+    if (monotonic_time_ns() >= deadline_ns) {
+      break;
+    }
+  }
+
+  memmove(&deferred_queue.calls[0],
+          &deferred_queue.calls[executed_count],
+          (deferred_queue.count - executed_count) * sizeof(struct deferred_call *));
+  deferred_queue.count -= executed_count;
+  return mrb_fixnum_value(executed_count);
+}
+
+static mrb_value jni_deferred_call_count_m(mrb_state *mrb, mrb_value self) {
+  return mrb_fixnum_value(deferred_queue.count);
+}
+
+static mrb_value jni_drain_deferred_errors_m(mrb_state *mrb, mrb_value self) {
+  mrb_sym errors_symbol = drb->mrb_intern_lit(mrb, "@deferred_errors");
+  mrb_value errors = drb->mrb_iv_get(mrb, self, errors_symbol);
+  drb->mrb_iv_set(mrb, self, errors_symbol, drb->mrb_ary_new(mrb));
+  return errors;
+}
+
+static mrb_value jni_clear_deferred_calls_m(mrb_state *mrb, mrb_value self) {
+  for (mrb_int i = 0; i < deferred_queue.count; i++) {
+    deferred_call_free(deferred_queue.calls[i]);
+  }
+  deferred_queue.count = 0;
+  return mrb_nil_value();
+}
+
+// ----- Class Warm-Up -----
+
+// Resolves classes and member IDs from a manifest on a background thread and publishes them in the
+// intern tables, where find_class and get_*_id pick them up.
+struct warm_up_entry {
+  // With slashes like the names passed to find_class
+  char *class_name;
+  // NULL for entries which only load the class
+  char *member_name;
+  char *signature;
+  enum member_kind kind;
+};
+
+struct warm_up_manifest {
+  struct warm_up_entry *entries;
+  mrb_int count;
+};
+
+struct warm_up_state {
+  atomic_bool running;
+  atomic_int resolved_count;
+  atomic_int failed_count;
+  int total_count;
+  // FindClass on a native thread only sees system classes, so classes are loaded with
+  // Class.forName(name, false, loader) using the class loader of the activity. Static initializers are
+  // not run on the warm-up thread.
+  jobject class_loader;
+  jclass class_class;
+  jmethodID class_for_name;
+};
+
+static struct warm_up_state warm_up_state;
+
+static void free_warm_up_manifest(struct warm_up_manifest *manifest) {
+  for (mrb_int i = 0; i < manifest->count; i++) {
+    free(manifest->entries[i].class_name);
+    free(manifest->entries[i].member_name);
+    free(manifest->entries[i].signature);
+  }
+  free(manifest->entries);
+  free(manifest);
+}
+
+// Returns the interned class or NULL if it could not be loaded
+static jclass warm_up_class(JNIEnv *env, const char *class_name) {
+  size_t class_name_length = strlen(class_name);
+  jclass interned_class = find_interned_value(&interned_classes, class_name, class_name_length);
+  if (interned_class != NULL) {
+    return interned_class;
+  }
+
+  char *binary_name = strdup(class_name);
+  for (char *position = binary_name; *position != '\0'; position++) {
+    if (*position == '/') {
+      *position = '.';
+    }
+  }
+  jstring java_binary_name = (*env)->NewStringUTF(env, binary_name);
+  free(binary_name);
+  if (java_binary_name == NULL) {
+    (*env)->ExceptionClear(env);
+    return NULL;
+  }
+
+  jclass class = (*env)->CallStaticObjectMethod(env,
+                                                warm_up_state.class_class,
+                                                warm_up_state.class_for_name,
+                                                java_binary_name,
+                                                JNI_FALSE,
+                                                warm_up_state.class_loader);
+  (*env)->DeleteLocalRef(env, java_binary_name);
+  if ((*env)->ExceptionCheck(env)) {
+    (*env)->ExceptionClear(env);
+    return NULL;
+  }
+
+  jclass global_class = (*env)->NewGlobalRef(env, class);
+  (*env)->DeleteLocalRef(env, class);
+  interned_class = publish_interned_value(&interned_classes, class_name, class_name_length, global_class);
+  if (interned_class != global_class) {
+    (*env)->DeleteGlobalRef(env, global_class);
+  }
+  return interned_class;
+}
+
+static bool warm_up_member_id(JNIEnv *env, jclass interned_class, struct warm_up_entry *entry) {
+  struct member_id_key key;
+  if (!build_member_id_key(&key, interned_class, entry->kind, entry->member_name, entry->signature)) {
+    return false;
+  }
+  if (find_interned_value(&interned_member_ids, key.bytes, key.length) != NULL) {
+    return true;
+  }
+
+  void *member_id = get_member_id(env, interned_class, entry->kind, entry->member_name, entry->signature);
+  if ((*env)->ExceptionCheck(env)) {
+    (*env)->ExceptionClear(env);
+    return false;
+  }
+
+  publish_interned_value(&interned_member_ids, key.bytes, key.length, member_id);
+  return true;
+}
+
+static void *warm_up_main(void *argument) {
+  struct warm_up_manifest *manifest = argument;
+  JNIEnv *env;
+  (*java_vm)->AttachCurrentThread(java_vm, (void *)&env, NULL);
+
+  for (mrb_int i = 0; i < manifest->count; i++) {
+    struct warm_up_entry *entry = &manifest->entries[i];
+    jclass class = warm_up_class(env, entry->class_name);
+    bool resolved = class != NULL;
+    if (resolved && entry->member_name != NULL) {
+      resolved = warm_up_member_id(env, class, entry);
+    }
+    atomic_fetch_add_explicit(resolved ? &warm_up_state.resolved_count : &warm_up_state.failed_count,
+                              1,
+                              memory_order_release);
+  }
+
+  free_warm_up_manifest(manifest);
+  (*java_vm)->DetachCurrentThread(java_vm);
+  atomic_store_explicit(&warm_up_state.running, false, memory_order_release);
+  return NULL;
+}
+
+// Raises before the warm-up thread is started if the class loader cannot be looked up
+static void init_warm_up_class_loader(mrb_state *mrb) {
+  if (warm_up_state.class_loader != NULL) {
+    return;
+  }
+
+  jobject activity = (jobject) drb->drb_android_get_sdl_activity();
+  if (activity == NULL) {
+    drb->mrb_raise(mrb, refs.jni_exception, "Could not get the activity to look up its class loader");
+  }
+
+  jclass activity_class = (*jni_env)->GetObjectClass(jni_env, activity);
+  jclass class_class = (*jni_env)->FindClass(jni_env, "java/lang/Class");
+  jmethodID get_class_loader = NULL;
+  jobject class_loader = NULL;
+  jmethodID class_for_name = NULL;
+  if (activity_class != NULL && class_class != NULL) {
+    get_class_loader = (*jni_env)->GetMethodID(jni_env, class_class, "getClassLoader", "()Ljava/lang/ClassLoader;");
+  }
+  if (get_class_loader != NULL) {
+    class_loader = (*jni_env)->CallObjectMethod(jni_env, activity_class, get_class_loader);
+  }
+  if (class_loader != NULL && !(*jni_env)->ExceptionCheck(jni_env)) {
+    class_for_name = (*jni_env)->GetStaticMethodID(jni_env,
+                                                   class_class,
+                                                   "forName",
+                                                   "(Ljava/lang/String;ZLjava/lang/ClassLoader;)Ljava/lang/Class;");
+  }
+  (*jni_env)->DeleteLocalRef(jni_env, activity_class);
+
+  if (class_for_name == NULL) {
+    (*jni_env)->DeleteLocalRef(jni_env, class_loader);
+    (*jni_env)->DeleteLocalRef(jni_env, class_class);
+    handle_jni_exception(mrb);
+    drb->mrb_raise(mrb, refs.jni_exception, "Could not look up the class loader of the activity");
+  }
+
+  warm_up_state.class_loader = (*jni_env)->NewGlobalRef(jni_env, class_loader);
+  warm_up_state.class_class = (*jni_env)->NewGlobalRef(jni_env, class_class);
+  warm_up_state.class_for_name = class_for_name;
+  (*jni_env)->DeleteLocalRef(jni_env, class_loader);
+  (*jni_env)->DeleteLocalRef(jni_env, class_class);
+}
+
+static char *copy_class_name(const char *class_name) {
+  char *result = strdup(class_name);
+  for (char *position = result; *position != '\0'; position++) {
+    if (*position == '.') {
+      *position = '/';
+    }
+  }
+  return result;
+}
+
+// Returns an error message or NULL
+static const char *parse_warm_up_entry(mrb_state *mrb, mrb_value value, struct warm_up_entry *entry) {
+  if (mrb_string_p(value)) {
+    entry->class_name = copy_class_name(drb->mrb_string_value_cstr(mrb, &value));
+    return NULL;
+  }
+
+  if (!mrb_array_p(value) || RARRAY_LEN(value) != 4) {
+    return "Manifest entries must be class names or [class_name, kind, name, signature]";
+  }
+
+  mrb_value *values = RARRAY_PTR(value);
+  if (!mrb_string_p(values[0]) || !mrb_symbol_p(values[1]) || !mrb_string_p(values[2]) || !mrb_string_p(values[3])) {
+    return "Manifest entries must be class names or [class_name, kind, name, signature]";
+  }
+
+  const char *kind_name = drb->mrb_sym2name(mrb, mrb_symbol(values[1]));
+  if (strcmp(kind_name, "method") == 0) {
+    entry->kind = MEMBER_METHOD;
+  } else if (strcmp(kind_name, "static_method") == 0) {
+    entry->kind = MEMBER_STATIC_METHOD;
+  } else if (strcmp(kind_name, "field") == 0) {
+    entry->kind = MEMBER_FIELD;
+  } else if (strcmp(kind_name, "static_field") == 0) {
+    entry->kind = MEMBER_STATIC_FIELD;
+  } else {
+    return "kind must be :method, :static_method, :field or :static_field";
+  }
+
+  entry->class_name = copy_class_name(drb->mrb_string_value_cstr(mrb, &values[0]));
+  entry->member_name = strdup(drb->mrb_string_value_cstr(mrb, &values[2]));
+  entry->signature = strdup(drb->mrb_string_value_cstr(mrb, &values[3]));
+  return NULL;
+}
+
+// ----- Class Warm-Up END -----
+
+static mrb_value jni_warm_up_m(mrb_state *mrb, mrb_value self) {
+  mrb_value manifest_array;
+  drb->mrb_get_args(mrb, "A", &manifest_array);
+
+  if (atomic_load_explicit(&warm_up_state.running, memory_order_acquire)) {
+    drb->mrb_raise(mrb, refs.jni_exception, "A warm-up is already running");
+  }
+
+  init_warm_up_class_loader(mrb);
+
+  struct warm_up_manifest *manifest = malloc(sizeof(struct warm_up_manifest));
+  manifest->count = RARRAY_LEN(manifest_array);
+  manifest->entries = calloc(manifest->count, sizeof(struct warm_up_entry));
+  for (mrb_int i = 0; i < manifest->count; i++) {
+    const char *error_message = parse_warm_up_entry(mrb, RARRAY_PTR(manifest_array)[i], &manifest->entries[i]);
+    if (error_message) {
+      free_warm_up_manifest(manifest);
+      drb->mrb_raisef(mrb, refs.jni_exception, "Manifest entry %d: %s", (int)i, error_message);
+    }
+  }
+
+  if (java_vm == NULL) {
+    (*jni_env)->GetJavaVM(jni_env, &java_vm);
+  }
+
+  atomic_store_explicit(&warm_up_state.resolved_count, 0, memory_order_relaxed);
+  atomic_store_explicit(&warm_up_state.failed_count, 0, memory_order_relaxed);
+  warm_up_state.total_count = (int)manifest->count;
+  atomic_store_explicit(&warm_up_state.running, true, memory_order_release);
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, warm_up_main, manifest) != 0) {
+    atomic_store_explicit(&warm_up_state.running, false, memory_order_release);
+    free_warm_up_manifest(manifest);
+    drb->mrb_raise(mrb, refs.jni_exception, "Could not start the warm-up thread");
+  }
+  pthread_detach(thread);
+  return mrb_nil_value();
+}
+
+static mrb_value jni_warm_up_done_m(mrb_state *mrb, mrb_value self) {
+  return mrb_bool_value(!atomic_load_explicit(&warm_up_state.running, memory_order_acquire));
+}
+
+static mrb_value jni_warm_up_progress_m(mrb_state *mrb, mrb_value self) {
+  mrb_value values[] = {
+      mrb_fixnum_value(atomic_load_explicit(&warm_up_state.resolved_count, memory_order_acquire)),
+      mrb_fixnum_value(atomic_load_explicit(&warm_up_state.failed_count, memory_order_acquire)),
+      mrb_fixnum_value(warm_up_state.total_count),
+  };
+  return drb->mrb_ary_new_from_values(mrb, 3, values);
+}
+
+// ----- Java Events -----
+
+// Must be a power of two
+#define EVENT_RING_CAPACITY 1024
+
+enum java_event_kind {
+  JAVA_EVENT_NUMERIC,
+  JAVA_EVENT_OBJECT
+};
+
+struct java_event {
+  enum java_event_kind kind;
+  jint type;
+  jlong value;
+  jdouble x;
+  jdouble y;
+  jdouble z;
+  // Global reference
+  jobject payload;
+};
+
+struct event_ring_cell {
+  _Atomic uint32_t sequence;
+  struct java_event event;
+};
+
+// Bounded queue after Dmitry Vyukov's design: every cell has a sequence number telling producers and the
+// consumer whether it is free or filled. Producers are any Java threads calling the registered native
+// methods, the only consumer is FFI.drain_events on the main thread.
+struct event_ring {
+  struct event_ring_cell cells[EVENT_RING_CAPACITY];
+  _Atomic uint32_t enqueue_position;
+  uint32_t dequeue_position;
+  // Events that arrived while the ring was full
+  _Atomic uint32_t dropped_count;
+  bool initialized;
+};
+
+static struct event_ring event_ring;
+
+static void init_event_ring() {
+  if (event_ring.initialized) {
+    return;
+  }
+
+  for (uint32_t i = 0; i < EVENT_RING_CAPACITY; i++) {
+    atomic_init(&event_ring.cells[i].sequence, i);
+  }
+  atomic_init(&event_ring.enqueue_position, 0);
+  atomic_init(&event_ring.dropped_count, 0);
+  event_ring.dequeue_position = 0;
+  event_ring.initialized = true;
 }
 
-#include "define_for_jni_types_with_void.c.inc"
+// Returns false if the ring is full
+static bool push_java_event(const struct java_event *event) {
+  struct event_ring_cell *cell;
+  uint32_t position = atomic_load_explicit(&event_ring.enqueue_position, memory_order_relaxed);
 
-#undef FOR_JNI_TYPE
+  for (;;) {
+    cell = &event_ring.cells[position & (EVENT_RING_CAPACITY - 1)];
+    uint32_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+    int32_t difference = (int32_t)(sequence - position);
 
-#define GET_FIELD_BEGINNING\
-  mrb_value object_reference;\
-  mrb_value field_id_reference;\
-  drb->mrb_get_args(mrb, "oo", &object_reference, &field_id_reference);\
-  \
-  jobject object = unwrap_jni_reference_from_object(mrb, object_reference);\
-  jfieldID field_id = (jfieldID)unwrap_jni_pointer_from_object(mrb, field_id_reference);
+    if (difference == 0) {
+      if (atomic_compare_exchange_weak_explicit(&event_ring.enqueue_position,
+                                                &position,
+                                                position + 1,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed)) {
+        break;
+      }
+    } else if (difference < 0) {
+      return false;
+    } else {
+      // Another producer claimed the cell in the meantime
+      position = atomic_load_explicit(&event_ring.enqueue_position, memory_order_relaxed);
+    }
+  }
 
-#define SET_FIELD_BEGINNING\
-  mrb_value object_reference;\
-  mrb_value field_id_reference;\
-  mrb_value value;\
-  drb->mrb_get_args(mrb, "ooo", &object_reference, &field_id_reference, &value);\
+  cell->event = *event;
+  atomic_store_explicit(&cell->sequence, position + 1, memory_order_release);
+  return true;
+}
+
+// Returns false if the ring is empty
+static bool pop_java_event(struct java_event *event) {
+  uint32_t position = event_ring.dequeue_position;
+  struct event_ring_cell *cell = &event_ring.cells[position & (EVENT_RING_CAPACITY - 1)];
+  uint32_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+  if ((int32_t)(sequence - (position + 1)) < 0) {
+    return false;
+  }
+
+  *event = cell->event;
+  atomic_store_explicit(&cell->sequence, position + EVENT_RING_CAPACITY, memory_order_release);
+  event_ring.dequeue_position = position + 1;
+  return true;
+}
+
+// Registered for native methods with the signature (IJDDD)V - works for static and instance methods
+static void JNICALL push_numeric_java_event(JNIEnv *env,
+                                            jobject receiver,
+                                            jint type,
+                                            jlong value,
+                                            jdouble x,
+                                            jdouble y,
+                                            jdouble z) {
+  struct java_event event = {JAVA_EVENT_NUMERIC, type, value, x, y, z, NULL};
+  if (!push_java_event(&event)) {
+    atomic_fetch_add_explicit(&event_ring.dropped_count, 1, memory_order_relaxed);
+  }
+}
+
+// Registered for native methods with the signature (ILjava/lang/Object;)V
+static void JNICALL push_object_java_event(JNIEnv *env, jobject receiver, jint type, jobject payload) {
+  struct java_event event = {JAVA_EVENT_OBJECT, type, 0, 0, 0, 0, NULL};
+  if (payload != NULL) {
+    event.payload = (*env)->NewGlobalRef(env, payload);
+  }
+
+  if (!push_java_event(&event)) {
+    if (event.payload != NULL) {
+      (*env)->DeleteGlobalRef(env, event.payload);
+    }
+    atomic_fetch_add_explicit(&event_ring.dropped_count, 1, memory_order_relaxed);
+  }
+}
+
+static mrb_value java_event_to_mrb_value(mrb_state *mrb, struct java_event *event) {
+  if (event->kind == JAVA_EVENT_OBJECT) {
+    mrb_value payload = mrb_nil_value();
+    if (event->payload != NULL) {
+      // The Reference takes over the global reference
+      payload = wrap_jni_reference_struct_in_object(mrb, event->payload, JNI_REFERENCE_JOBJECT, 0);
+      count_created_global_reference();
+    }
+    mrb_value values[] = {mrb_fixnum_value(event->type), payload};
+    return drb->mrb_ary_new_from_values(mrb, 2, values);
+  }
+
+  mrb_value values[] = {
+      mrb_fixnum_value(event->type),
+      mrb_fixnum_value(event->value),
+      drb->mrb_float_value(mrb, event->x),
+      drb->mrb_float_value(mrb, event->y),
+      drb->mrb_float_value(mrb, event->z),
+  };
+  return drb->mrb_ary_new_from_values(mrb, 5, values);
+}
+
+// ----- Java Events END -----
+
+static mrb_value jni_register_event_native_m(mrb_state *mrb, mrb_value self) {
+  mrb_value class_reference;
+  const char *method_name;
+  mrb_sym kind;
+  drb->mrb_get_args(mrb, "ozn", &class_reference, &method_name, &kind);
+
+  jclass class = (jclass)unwrap_jni_reference_from_object(mrb, class_reference);
+
+  JNINativeMethod method;
+  method.name = (char *)method_name;
+  if (kind == drb->mrb_intern_lit(mrb, "numeric")) {
+    method.signature = (char *)"(IJDDD)V";
+    method.fnPtr = (void *)push_numeric_java_event;
+  } else if (kind == drb->mrb_intern_lit(mrb, "object")) {
+    method.signature = (char *)"(ILjava/lang/Object;)V";
+    method.fnPtr = (void *)push_object_java_event;
+  } else {
+    drb->mrb_raise(mrb, refs.jni_exception, "kind must be :numeric or :object");
+  }
+
+  // Before any Java thread can push events
+  init_event_ring();
+
+  if ((*jni_env)->RegisterNatives(jni_env, class, &method, 1) != JNI_OK) {
+    handle_jni_exception(mrb);
+    drb->mrb_raise(mrb, refs.jni_exception, "Could not register native method");
+  }
+  return mrb_nil_value();
+}
+
+static mrb_value jni_drain_events_m(mrb_state *mrb, mrb_value self) {
+  mrb_value result = drb->mrb_ary_new(mrb);
+  if (!event_ring.initialized) {
+    return result;
+  }
+
+  struct java_event event;
+  while (pop_java_event(&event)) {
+    drb->mrb_ary_push(mrb, result, java_event_to_mrb_value(mrb, &event));
+  }
+  return result;
+}
+
+static mrb_value jni_dropped_event_count_m(mrb_state *mrb, mrb_value self) {
+  return mrb_fixnum_value(atomic_load_explicit(&event_ring.dropped_count, memory_order_relaxed));
+}
+
+static mrb_value jni_read_collection_m(mrb_state *mrb, mrb_value self) {
+  mrb_value collection_reference;
+  drb->mrb_get_args(mrb, "o", &collection_reference);
+
+  jobject collection = unwrap_jni_reference_from_object(mrb, collection_reference);
+  init_collection_references();
+
+  if ((*jni_env)->IsInstanceOf(jni_env, collection, collection_refs.map_class)) {
+    jobject entry_set = (*jni_env)->CallObjectMethod(jni_env, collection, collection_refs.map_entry_set);
+    handle_jni_exception(mrb);
+    jobjectArray entries = (*jni_env)->CallObjectMethod(jni_env, entry_set, collection_refs.collection_to_array);
+    (*jni_env)->DeleteLocalRef(jni_env, entry_set);
+    handle_jni_exception(mrb);
+
+    mrb_value result = drb->mrb_hash_new(mrb);
+    read_map_entries(mrb, entries, result);
+    (*jni_env)->DeleteLocalRef(jni_env, entries);
+    handle_jni_exception(mrb);
+    return result;
+  }
+
+  jobjectArray elements;
+  if ((*jni_env)->IsInstanceOf(jni_env, collection, collection_refs.object_array_class)) {
+    elements = (*jni_env)->NewLocalRef(jni_env, collection);
+  } else if ((*jni_env)->IsInstanceOf(jni_env, collection, collection_refs.collection_class)) {
+    // One copy on the Java side is cheaper than calling get or an Iterator for every element
+    elements = (*jni_env)->CallObjectMethod(jni_env, collection, collection_refs.collection_to_array);
+    handle_jni_exception(mrb);
+  } else {
+    drb->mrb_raise(mrb, refs.jni_exception, "Expected java.util.Collection, java.util.Map or Object[]");
+    return mrb_nil_value();
+  }
+
+  mrb_value result = drb->mrb_ary_new_capa(mrb, (*jni_env)->GetArrayLength(jni_env, elements));
+  read_object_array_elements(mrb, elements, result);
+  (*jni_env)->DeleteLocalRef(jni_env, elements);
+  return result;
+}
+
+static mrb_value jni_new_collection_m(mrb_state *mrb, mrb_value self) {
+  mrb_value value;
+  drb->mrb_get_args(mrb, "o", &value);
+
+  if (!mrb_array_p(value) && !mrb_hash_p(value)) {
+    drb->mrb_raise(mrb, refs.jni_exception, "Expected Array or Hash");
+  }
+
+  init_collection_references();
+  jobject collection;
+  const char *error_message = new_java_collection(mrb, value, &collection);
+  if (error_message) {
+    // Raises the pending Java exception through the exception mapping
+    handle_jni_exception(mrb);
+    drb->mrb_raise(mrb, refs.jni_exception, error_message);
+  }
+
+  return wrap_jni_local_reference_in_object(mrb, collection, JNI_REFERENCE_JOBJECT);
+}
+
+static mrb_value jni_get_array_length_m(mrb_state *mrb, mrb_value self) {
+  mrb_value array_reference;
+  drb->mrb_get_args(mrb, "o", &array_reference);
+
+  jarray array = unwrap_jni_reference_from_object(mrb, array_reference);
+  return mrb_fixnum_value((*jni_env)->GetArrayLength(jni_env, array));
+}
+
+#define GET_ARRAY_REGION_BEGINNING\
+  mrb_value array_reference;\
+  mrb_int start = 0;\
+  mrb_int length = -1;\
+  drb->mrb_get_args(mrb, "o|ii", &array_reference, &start, &length);\
   \
-  jobject object = unwrap_jni_reference_from_object(mrb, object_reference);\
-  jfieldID field_id = (jfieldID)unwrap_jni_pointer_from_object(mrb, field_id_reference);\
-  handle_jni_exception(mrb);
+  jarray array = unwrap_jni_reference_from_object(mrb, array_reference);\
+  if (length == -1) {\
+    length = (*jni_env)->GetArrayLength(jni_env, array) - start;\
+  }\
+  const char *error_message = check_array_region(array, start, length);\
+  if (error_message) {\
+    drb->mrb_raise(mrb, refs.jni_exception, error_message);\
+  }
 
 #define FOR_JNI_TYPE(type, type_pascal_case, type_upper_case)\
-static mrb_value jni_get_##type##_field_m(mrb_state *mrb, mrb_value self) {\
-  GET_FIELD_BEGINNING;\
+static mrb_value jni_new_##type##_array_m(mrb_state *mrb, mrb_value self) {\
+  mrb_value values;\
+  drb->mrb_get_args(mrb, "o", &values);\
   \
-  ASSIGN_JNI_##type_upper_case##_TO_VARIABLE(\
-    jni_result,\
-    (*jni_env)->Get##type_pascal_case##Field(jni_env, object, field_id)\
-  );\
+  jarray array;\
+  const char *error_message = new_jni_##type##_array(values, &array);\
+  if (error_message) {\
+    raise_wrong_argument_type(mrb, 0, error_message);\
+  }\
+  handle_jni_exception(mrb);\
   \
-  return CONVERT_JNI_##type_upper_case##_TO_MRB_VALUE(jni_result);\
+  return wrap_jni_local_reference_in_object(mrb, array, JNI_REFERENCE_JOBJECT);\
 }\
 \
-static mrb_value jni_set_##type##_field_m(mrb_state *mrb, mrb_value self) {\
-  SET_FIELD_BEGINNING;\
-  \
-  (*jni_env)->Set##type_pascal_case##Field(jni_env, object, field_id, CONVERT_MRB_VALUE_TO_JNI_##type_upper_case(value));\
+static mrb_value jni_get_##type##_array_region_m(mrb_state *mrb, mrb_value self) {\
+  GET_ARRAY_REGION_BEGINNING;\
   \
-  return mrb_nil_value();\
+  return read_jni_##type##_array_region(mrb, array, (jsize)start, (jsize)length);\
 }\
 \
-static mrb_value jni_get_static_##type##_field_m(mrb_state *mrb, mrb_value self) {\
-  GET_FIELD_BEGINNING;\
-  \
-  ASSIGN_JNI_##type_upper_case##_TO_VARIABLE(\
-    jni_result,\
-    (*jni_env)->GetStatic##type_pascal_case##Field(jni_env, (jclass)object, field_id)\
-  );\
+static mrb_value jni_get_##type##_array_values_m(mrb_state *mrb, mrb_value self) {\
+  GET_ARRAY_REGION_BEGINNING;\
   \
-  return CONVERT_JNI_##type_upper_case##_TO_MRB_VALUE(jni_result);\
+  return read_jni_##type##_array_values(mrb, array, (jsize)start, (jsize)length);\
 }\
 \
-static mrb_value jni_set_static_##type##_field_m(mrb_state *mrb, mrb_value self) {\
-  SET_FIELD_BEGINNING;\
+static mrb_value jni_set_##type##_array_region_m(mrb_state *mrb, mrb_value self) {\
+  mrb_value array_reference;\
+  mrb_int start;\
+  mrb_value values;\
+  drb->mrb_get_args(mrb, "oio", &array_reference, &start, &values);\
+  \
+  jarray array = unwrap_jni_reference_from_object(mrb, array_reference);\
+  mrb_int count;\
+  const char *error_message = count_jni_##type##_array_values(values, &count);\
+  if (error_message) {\
+    raise_wrong_argument_type(mrb, 2, error_message);\
+  }\
+  error_message = check_array_region(array, start, count);\
+  if (error_message) {\
+    drb->mrb_raise(mrb, refs.jni_exception, error_message);\
+  }\
   \
-  (*jni_env)->SetStatic##type_pascal_case##Field(jni_env, (jclass)object, field_id, CONVERT_MRB_VALUE_TO_JNI_##type_upper_case(value));\
+  write_jni_##type##_array_region(array, (jsize)start, (jsize)count, values);\
+  handle_jni_exception(mrb);\
   \
   return mrb_nil_value();\
 }
 
-#include "define_for_jni_types_without_void.c.inc"
+#include "define_for_jni_primitive_types.c.inc"
 
 #undef FOR_JNI_TYPE
 
-static mrb_value jni_new_object_m(mrb_state *mrb, mrb_value self) {
-  CALL_METHOD_BEGINNING;
+static mrb_value jni_new_direct_byte_buffer_m(mrb_state *mrb, mrb_value self) {
+  mrb_int capacity;
+  drb->mrb_get_args(mrb, "i", &capacity);
 
-  jobject jni_result = (*jni_env)->NewObjectA(jni_env, (jclass)object, method_id, jni_args);
+  if (capacity <= 0) {
+    drb->mrb_raise(mrb, refs.jni_exception, "Capacity must be positive");
+  }
 
-  CALL_METHOD_CLEANUP;
+  void *buffer = drb->mrb_calloc(mrb, 1, capacity);
+  jobject byte_buffer = (*jni_env)->NewDirectByteBuffer(jni_env, buffer, capacity);
+  if (byte_buffer == NULL) {
+    drb->mrb_free(mrb, buffer);
+    handle_jni_exception(mrb);
+    drb->mrb_raise(mrb, refs.jni_exception, "Direct buffers are not supported by this JVM");
+  }
+
+  // Always a global reference since the memory lives as long as the Ruby object
+  mrb_value result = wrap_jni_reference_in_object(mrb, byte_buffer, JNI_REFERENCE_JOBJECT);
+  (*jni_env)->DeleteLocalRef(jni_env, byte_buffer);
+  unwrap_jni_reference_struct_from_object(mrb, result)->owned_buffer = buffer;
+  return result;
+}
+
+// Returns the address of the region inside the direct buffer or raises an exception
+static uint8_t *get_direct_buffer_region(mrb_state *mrb, jobject buffer, mrb_int offset, mrb_int length) {
+  uint8_t *address = (*jni_env)->GetDirectBufferAddress(jni_env, buffer);
+  if (address == NULL) {
+    drb->mrb_raise(mrb, refs.jni_exception, "Not a direct buffer");
+  }
+
+  jlong capacity = (*jni_env)->GetDirectBufferCapacity(jni_env, buffer);
+  if (offset < 0 || length < 0 || offset + length > capacity) {
+    drb->mrb_raise(mrb, refs.jni_exception, "Region is outside of the buffer");
+  }
+
+  return address + offset;
+}
+
+static mrb_value jni_get_direct_buffer_capacity_m(mrb_state *mrb, mrb_value self) {
+  mrb_value buffer_reference;
+  drb->mrb_get_args(mrb, "o", &buffer_reference);
+
+  jobject buffer = unwrap_jni_reference_from_object(mrb, buffer_reference);
+  if ((*jni_env)->GetDirectBufferAddress(jni_env, buffer) == NULL) {
+    drb->mrb_raise(mrb, refs.jni_exception, "Not a direct buffer");
+  }
+  return mrb_fixnum_value((*jni_env)->GetDirectBufferCapacity(jni_env, buffer));
+}
+
+static mrb_value jni_read_direct_buffer_m(mrb_state *mrb, mrb_value self) {
+  mrb_value buffer_reference;
+  mrb_int offset = 0;
+  mrb_int length = -1;
+  drb->mrb_get_args(mrb, "o|ii", &buffer_reference, &offset, &length);
+
+  jobject buffer = unwrap_jni_reference_from_object(mrb, buffer_reference);
+  if (length == -1) {
+    length = (*jni_env)->GetDirectBufferCapacity(jni_env, buffer) - offset;
+  }
+  uint8_t *region = get_direct_buffer_region(mrb, buffer, offset, length);
+  return drb->mrb_str_new(mrb, (const char *)region, length);
+}
+
+static mrb_value jni_write_direct_buffer_m(mrb_state *mrb, mrb_value self) {
+  mrb_value buffer_reference;
+  mrb_int offset;
+  mrb_value data;
+  drb->mrb_get_args(mrb, "oiS", &buffer_reference, &offset, &data);
+
+  jobject buffer = unwrap_jni_reference_from_object(mrb, buffer_reference);
+  uint8_t *region = get_direct_buffer_region(mrb, buffer, offset, RSTRING_LEN(data));
+  memcpy(region, RSTRING_PTR(data), RSTRING_LEN(data));
+  return mrb_nil_value();
+}
+
+static mrb_value jni_map_exception_m(mrb_state *mrb, mrb_value self) {
+  const char *java_class_name;
+  mrb_value ruby_class;
+  drb->mrb_get_args(mrb, "zC", &java_class_name, &ruby_class);
+
+  if (!mrb_class_inherits_from(mrb_class_ptr(ruby_class), drb->mrb_class_get(mrb, "StandardError"))) {
+    drb->mrb_raise(mrb, refs.jni_exception, "Mapped Ruby class must inherit from StandardError");
+  }
+
+  // Accept both java.io.IOException and java/io/IOException
+  mrb_value class_path = drb->mrb_str_new_cstr(mrb, java_class_name);
+  for (mrb_int i = 0; i < RSTRING_LEN(class_path); i++) {
+    if (RSTRING_PTR(class_path)[i] == '.') {
+      RSTRING_PTR(class_path)[i] = '/';
+    }
+  }
+
+  jclass java_class = (*jni_env)->FindClass(jni_env, RSTRING_PTR(class_path));
+  handle_jni_exception(mrb);
+
+  jclass global_java_class = (*jni_env)->NewGlobalRef(jni_env, java_class);
+  (*jni_env)->DeleteLocalRef(jni_env, java_class);
+  map_exception(mrb, global_java_class, mrb_class_ptr(ruby_class));
+
+  // Keep the Ruby class alive for as long as it is mapped
+  drb->mrb_ary_push(mrb, drb->mrb_iv_get(mrb, self, drb->mrb_intern_lit(mrb, "@mapped_exception_classes")), ruby_class);
+  return mrb_nil_value();
+}
+
+static mrb_value jni_push_local_frame_m(mrb_state *mrb, mrb_value self) {
+  mrb_int capacity;
+  drb->mrb_get_args(mrb, "i", &capacity);
+
+  if (local_frames.depth >= MAX_LOCAL_FRAME_DEPTH) {
+    drb->mrb_raise(mrb, refs.jni_exception, "Too many nested local frames");
+  }
+
+  if ((*jni_env)->PushLocalFrame(jni_env, (jint)capacity) < 0) {
+    handle_jni_exception(mrb);
+  }
+
+  local_frames.serials[local_frames.depth] = local_frames.next_serial++;
+  local_frames.depth++;
+  return mrb_nil_value();
+}
+
+static mrb_value jni_pop_local_frame_m(mrb_state *mrb, mrb_value self) {
+  if (!inside_local_frame()) {
+    drb->mrb_raise(mrb, refs.jni_exception, "No local frame to pop");
+  }
+
+  (*jni_env)->PopLocalFrame(jni_env, NULL);
+  local_frames.depth--;
+  return mrb_nil_value();
+}
+
+static mrb_value jni_set_stats_enabled_m(mrb_state *mrb, mrb_value self) {
+  mrb_bool enabled;
+  drb->mrb_get_args(mrb, "b", &enabled);
+  ffi_stats.enabled = enabled;
+  return mrb_bool_value(enabled);
+}
+
+static mrb_value jni_stats_enabled_m(mrb_state *mrb, mrb_value self) {
+  return mrb_bool_value(ffi_stats.enabled);
+}
+
+#define SET_STATS_VALUE(hash, key, value)\
+  drb->mrb_hash_set(mrb, hash, mrb_symbol_value(drb->mrb_intern_lit(mrb, key)), value)
+
+static mrb_value jni_stats_m(mrb_state *mrb, mrb_value self) {
+  mrb_value members = drb->mrb_hash_new(mrb);
+  for (uint32_t i = 0; i < ffi_stats.capacity; i++) {
+    struct member_stats *entry = &ffi_stats.entries[i];
+    if (entry->member_id == NULL) {
+      continue;
+    }
+
+    mrb_value member = drb->mrb_hash_new(mrb);
+    SET_STATS_VALUE(member, "calls", mrb_fixnum_value((mrb_int)entry->call_count));
+    SET_STATS_VALUE(member, "exceptions", mrb_fixnum_value((mrb_int)entry->exception_count));
+    SET_STATS_VALUE(member, "total_ns", mrb_fixnum_value((mrb_int)entry->total_ns));
+    SET_STATS_VALUE(member, "max_ns", mrb_fixnum_value((mrb_int)entry->max_ns));
+    drb->mrb_hash_set(mrb, members, member_stats_key(mrb, entry), member);
+  }
+
+  mrb_value result = drb->mrb_hash_new(mrb);
+  SET_STATS_VALUE(result, "enabled", mrb_bool_value(ffi_stats.enabled));
+  SET_STATS_VALUE(result, "live_global_references", mrb_fixnum_value((mrb_int)global_reference_counts.live));
+  SET_STATS_VALUE(result, "created_global_references", mrb_fixnum_value((mrb_int)global_reference_counts.created));
+  SET_STATS_VALUE(result, "deleted_global_references", mrb_fixnum_value((mrb_int)global_reference_counts.deleted));
+  SET_STATS_VALUE(result, "members", members);
+  return result;
+}
+
+#undef SET_STATS_VALUE
+
+static mrb_value jni_set_identity_map_enabled_m(mrb_state *mrb, mrb_value self) {
+  mrb_bool enabled;
+  drb->mrb_get_args(mrb, "b", &enabled);
+
+  if (enabled && identity_map.system_class == NULL) {
+    jclass system_class = (*jni_env)->FindClass(jni_env, "java/lang/System");
+    identity_map.system_class = (*jni_env)->NewGlobalRef(jni_env, system_class);
+    identity_map.identity_hash_code = (*jni_env)->GetStaticMethodID(jni_env,
+                                                                    system_class,
+                                                                    "identityHashCode",
+                                                                    "(Ljava/lang/Object;)I");
+    (*jni_env)->DeleteLocalRef(jni_env, system_class);
+  }
+  if (!enabled) {
+    clear_identity_map();
+  }
+
+  identity_map.enabled = enabled;
+  return mrb_bool_value(enabled);
+}
 
-  return wrap_jni_reference_in_object(mrb, jni_result, "jobject");
+static mrb_value jni_identity_map_enabled_m(mrb_state *mrb, mrb_value self) {
+  return mrb_bool_value(identity_map.enabled);
+}
+
+static mrb_value jni_identity_map_size_m(mrb_state *mrb, mrb_value self) {
+  return mrb_fixnum_value(identity_map.size);
+}
+
+static mrb_value jni_reset_stats_m(mrb_state *mrb, mrb_value self) {
+  reset_member_stats();
+  // The live count stays correct across resets
+  global_reference_counts.created = 0;
+  global_reference_counts.deleted = 0;
+  return mrb_nil_value();
 }
 
 // ----- JNI Methods END -----
 
+static void init_java_references() {
+  if (java_refs.string_class != NULL) {
+    // Already initialized by an earlier load of the extension
+    return;
+  }
+
+  java_refs.string_class = find_global_class("java/lang/String");
+  init_boxed_types();
+
+  jclass class_class = (*jni_env)->FindClass(jni_env, "java/lang/Class");
+  java_refs.class_get_name = (*jni_env)->GetMethodID(jni_env, class_class, "getName", "()Ljava/lang/String;");
+  (*jni_env)->DeleteLocalRef(jni_env, class_class);
+
+  jclass object_class = (*jni_env)->FindClass(jni_env, "java/lang/Object");
+  java_refs.object_to_string = (*jni_env)->GetMethodID(jni_env, object_class, "toString", "()Ljava/lang/String;");
+  (*jni_env)->DeleteLocalRef(jni_env, object_class);
+
+  jclass throwable_class = (*jni_env)->FindClass(jni_env, "java/lang/Throwable");
+  java_refs.throwable_get_message = (*jni_env)->GetMethodID(jni_env, throwable_class, "getMessage", "()Ljava/lang/String;");
+  (*jni_env)->DeleteLocalRef(jni_env, throwable_class);
+
+  print_last_jni_exception();
+}
+
+static void map_default_exceptions(mrb_state *mrb) {
+  mrb_value jni_module = drb->mrb_obj_value(refs.jni);
+  mrb_sym mapped_exception_classes = drb->mrb_intern_lit(mrb, "@mapped_exception_classes");
+  if (!mrb_nil_p(drb->mrb_iv_get(mrb, jni_module, mapped_exception_classes))) {
+    return; // Extension was reloaded into the same Ruby state, keep the existing mappings
+  }
+
+  clear_exception_mappings();
+  map_exception(mrb,
+                find_global_class("java/lang/ClassNotFoundException"),
+                drb->mrb_class_get_under(mrb, refs.jni, "ClassNotFound"));
+  map_exception(mrb,
+                find_global_class("java/lang/NoSuchMethodError"),
+                drb->mrb_class_get_under(mrb, refs.jni, "NoSuchMethod"));
+  map_exception(mrb,
+                find_global_class("java/lang/NoSuchFieldError"),
+                drb->mrb_class_get_under(mrb, refs.jni, "NoSuchField"));
+  drb->mrb_iv_set(mrb, jni_module, mapped_exception_classes, drb->mrb_ary_new(mrb));
+}
+
+// ----- Generated Bindings -----
+
+// Classes and members which cannot be resolved when the extension is loaded are logged and raise
+// when their binding is called.
+static jclass find_binding_class(const char *class_name) {
+  jclass result = find_interned_class(class_name);
+  if (result == NULL) {
+    drb_log_writef("* WARNING - Could not find class %s for generated bindings", class_name);
+    print_last_jni_exception();
+  }
+  return result;
+}
+
+static jmethodID find_binding_method_id(jclass class, enum member_kind kind, const char *name, const char *signature) {
+  if (class == NULL) {
+    return NULL;
+  }
+
+  jmethodID result = get_member_id(jni_env, class, kind, name, signature);
+  if (result == NULL) {
+    drb_log_writef("* WARNING - Could not find method %s%s for generated bindings", name, signature);
+    print_last_jni_exception();
+  }
+  return result;
+}
+
+static void raise_unresolved_binding(mrb_state *mrb, const char *qualified_name) {
+  struct RClass *exception_class = drb->mrb_class_get_under(mrb, refs.jni, "NoSuchMethod");
+  drb->mrb_raisef(mrb, exception_class, "%s could not be resolved when the extension was loaded", qualified_name);
+}
+
+// Written by generate-bindings, GENERATED_BINDINGS_FILE can point to another file
+#if defined(GENERATED_BINDINGS_FILE)
+#include GENERATED_BINDINGS_FILE
+#elif __has_include("generated_bindings.c.inc")
+#include "generated_bindings.c.inc"
+#endif
+
+// ----- Generated Bindings END -----
+
 DRB_FFI_EXPORT
 void drb_register_c_extensions_with_api(mrb_state *mrb, struct drb_api_t *local_drb) {
   drb = local_drb;
   drb->drb_log_write("Game", 2, "* INFO - Retrieving JNIEnv");
   jni_env = (JNIEnv *)drb->drb_android_get_jni_env();
+  init_java_references();
 
   refs.jni = drb->mrb_module_get_under(mrb, drb->mrb_module_get(mrb, "JNI"), "FFI");
   refs.jni_pointer = drb->mrb_class_get_under(mrb, refs.jni, "Pointer");
   refs.jni_reference = drb->mrb_class_get_under(mrb, refs.jni, "Reference");
   refs.jni_exception = drb->mrb_class_get_under(mrb, refs.jni, "Exception");
+  refs.jni_java_exception = drb->mrb_class_get_under(mrb, refs.jni, "JavaException");
+  refs.jni_call_site = drb->mrb_class_get_under(mrb, refs.jni, "CallSite");
   MRB_SET_INSTANCE_TT(refs.jni_reference, MRB_TT_DATA);
+  MRB_SET_INSTANCE_TT(refs.jni_pointer, MRB_TT_DATA);
+  refs.jni_command_buffer = drb->mrb_class_get_under(mrb, refs.jni, "CommandBuffer");
+  MRB_SET_INSTANCE_TT(refs.jni_call_site, MRB_TT_DATA);
+  MRB_SET_INSTANCE_TT(refs.jni_command_buffer, MRB_TT_DATA);
+  refs.jni_future = drb->mrb_class_get_under(mrb, refs.jni, "Future");
+  MRB_SET_INSTANCE_TT(refs.jni_future, MRB_TT_DATA);
+  refs.jni_field_set = drb->mrb_class_get_under(mrb, refs.jni, "FieldSet");
+  MRB_SET_INSTANCE_TT(refs.jni_field_set, MRB_TT_DATA);
+  map_default_exceptions(mrb);
+#ifdef HAS_GENERATED_BINDINGS
+  register_generated_bindings(mrb);
+#endif
+
+  drb->mrb_define_method(mrb, refs.jni_reference, "type_name", jni_reference_type_name_m, MRB_ARGS_NONE());
+  drb->mrb_define_method(mrb, refs.jni_reference, "qualifier", jni_reference_qualifier_m, MRB_ARGS_NONE());
+  drb->mrb_define_method(mrb, refs.jni_reference, "retain", jni_reference_retain_m, MRB_ARGS_NONE());
+  drb->mrb_define_method(mrb, refs.jni_pointer, "type_name", jni_pointer_type_name_m, MRB_ARGS_NONE());
+  drb->mrb_define_method(mrb, refs.jni_pointer, "qualifier", jni_pointer_qualifier_m, MRB_ARGS_NONE());
+  drb->mrb_define_method(mrb, refs.jni_pointer, "signature", jni_pointer_signature_m, MRB_ARGS_NONE());
 
   drb->mrb_define_class_method(mrb, refs.jni, "find_class", jni_find_class_m, MRB_ARGS_REQ(1));
   drb->mrb_define_class_method(mrb, refs.jni, "new_object", jni_new_object_m, MRB_ARGS_REQ(3) | MRB_ARGS_REST());
@@ -541,6 +4312,61 @@ void drb_register_c_extensions_with_api(mrb_state *mrb, struct drb_api_t *local_
   drb->mrb_define_class_method(mrb, refs.jni, "get_method_id", jni_get_method_id_m, MRB_ARGS_REQ(3));
   drb->mrb_define_class_method(mrb, refs.jni, "get_static_field_id", jni_get_static_field_id_m, MRB_ARGS_REQ(3));
   drb->mrb_define_class_method(mrb, refs.jni, "get_static_method_id", jni_get_static_method_id_m, MRB_ARGS_REQ(3));
+  drb->mrb_define_class_method(mrb, refs.jni, "push_local_frame", jni_push_local_frame_m, MRB_ARGS_REQ(1));
+  drb->mrb_define_class_method(mrb, refs.jni, "pop_local_frame", jni_pop_local_frame_m, MRB_ARGS_NONE());
+  drb->mrb_define_class_method(mrb, refs.jni, "build_call_site", jni_build_call_site_m, MRB_ARGS_REQ(4));
+  drb->mrb_define_class_method(mrb, refs.jni, "call", jni_call_m, MRB_ARGS_REQ(2) | MRB_ARGS_REST());
+  drb->mrb_define_class_method(mrb, refs.jni, "call_async", jni_call_async_m, MRB_ARGS_REQ(2) | MRB_ARGS_REST());
+  drb->mrb_define_class_method(mrb, refs.jni, "new_command_buffer", jni_new_command_buffer_m, MRB_ARGS_NONE());
+  drb->mrb_define_class_method(mrb, refs.jni, "build_field_set", jni_build_field_set_m, MRB_ARGS_REQ(2));
+  drb->mrb_define_class_method(mrb, refs.jni, "read_fields", jni_read_fields_m, MRB_ARGS_REQ(2));
+  drb->mrb_define_class_method(mrb, refs.jni, "write_fields", jni_write_fields_m, MRB_ARGS_REQ(4));
+  drb->mrb_iv_set(mrb, drb->mrb_obj_value(refs.jni), drb->mrb_intern_lit(mrb, "@deferred_errors"), drb->mrb_ary_new(mrb));
+  drb->mrb_define_class_method(mrb, refs.jni, "defer_call", jni_defer_call_m, MRB_ARGS_REQ(4) | MRB_ARGS_REST());
+  drb->mrb_define_class_method(mrb, refs.jni, "pump", jni_pump_m, MRB_ARGS_REQ(1));
+  drb->mrb_define_class_method(mrb, refs.jni, "deferred_call_count", jni_deferred_call_count_m, MRB_ARGS_NONE());
+  drb->mrb_define_class_method(mrb, refs.jni, "drain_deferred_errors", jni_drain_deferred_errors_m, MRB_ARGS_NONE());
+  drb->mrb_define_class_method(mrb, refs.jni, "clear_deferred_calls", jni_clear_deferred_calls_m, MRB_ARGS_NONE());
+  drb->mrb_define_class_method(mrb, refs.jni, "warm_up", jni_warm_up_m, MRB_ARGS_REQ(1));
+  drb->mrb_define_class_method(mrb, refs.jni, "warm_up_done?", jni_warm_up_done_m, MRB_ARGS_NONE());
+  drb->mrb_define_class_method(mrb, refs.jni, "warm_up_progress", jni_warm_up_progress_m, MRB_ARGS_NONE());
+  drb->mrb_define_class_method(mrb, refs.jni, "map_exception", jni_map_exception_m, MRB_ARGS_REQ(2));
+  drb->mrb_define_class_method(mrb, refs.jni, "register_event_native", jni_register_event_native_m, MRB_ARGS_REQ(3));
+  drb->mrb_define_class_method(mrb, refs.jni, "drain_events", jni_drain_events_m, MRB_ARGS_NONE());
+  drb->mrb_define_class_method(mrb, refs.jni, "dropped_event_count", jni_dropped_event_count_m, MRB_ARGS_NONE());
+  drb->mrb_define_class_method(mrb, refs.jni, "identity_map_enabled=", jni_set_identity_map_enabled_m, MRB_ARGS_REQ(1));
+  drb->mrb_define_class_method(mrb, refs.jni, "identity_map_enabled?", jni_identity_map_enabled_m, MRB_ARGS_NONE());
+  drb->mrb_define_class_method(mrb, refs.jni, "identity_map_size", jni_identity_map_size_m, MRB_ARGS_NONE());
+  drb->mrb_define_class_method(mrb, refs.jni, "stats_enabled=", jni_set_stats_enabled_m, MRB_ARGS_REQ(1));
+  drb->mrb_define_class_method(mrb, refs.jni, "stats_enabled?", jni_stats_enabled_m, MRB_ARGS_NONE());
+  drb->mrb_define_class_method(mrb, refs.jni, "stats", jni_stats_m, MRB_ARGS_NONE());
+  drb->mrb_define_class_method(mrb, refs.jni, "reset_stats", jni_reset_stats_m, MRB_ARGS_NONE());
+  drb->mrb_define_class_method(mrb, refs.jni, "read_collection", jni_read_collection_m, MRB_ARGS_REQ(1));
+  drb->mrb_define_class_method(mrb, refs.jni, "new_collection", jni_new_collection_m, MRB_ARGS_REQ(1));
+  drb->mrb_define_class_method(mrb, refs.jni, "get_array_length", jni_get_array_length_m, MRB_ARGS_REQ(1));
+  drb->mrb_define_class_method(mrb, refs.jni, "new_direct_byte_buffer", jni_new_direct_byte_buffer_m, MRB_ARGS_REQ(1));
+  drb->mrb_define_class_method(mrb,
+                               refs.jni,
+                               "get_direct_buffer_capacity",
+                               jni_get_direct_buffer_capacity_m,
+                               MRB_ARGS_REQ(1));
+  drb->mrb_define_class_method(mrb, refs.jni, "read_direct_buffer", jni_read_direct_buffer_m, MRB_ARGS_REQ(1) | MRB_ARGS_OPT(2));
+  drb->mrb_define_class_method(mrb, refs.jni, "write_direct_buffer", jni_write_direct_buffer_m, MRB_ARGS_REQ(3));
+
+  drb->mrb_define_method(mrb, refs.jni_command_buffer, "add_call", jni_command_buffer_add_call_m, MRB_ARGS_REQ(2) | MRB_ARGS_REST());
+  drb->mrb_define_method(mrb, refs.jni_command_buffer, "add_set_field", jni_command_buffer_add_set_field_m, MRB_ARGS_REQ(4));
+  drb->mrb_define_method(mrb,
+                         refs.jni_command_buffer,
+                         "add_set_static_field",
+                         jni_command_buffer_add_set_static_field_m,
+                         MRB_ARGS_REQ(4));
+  drb->mrb_define_method(mrb, refs.jni_command_buffer, "add_checkpoint", jni_command_buffer_add_checkpoint_m, MRB_ARGS_NONE());
+  drb->mrb_define_method(mrb, refs.jni_command_buffer, "set_argument", jni_command_buffer_set_argument_m, MRB_ARGS_REQ(3));
+  drb->mrb_define_method(mrb, refs.jni_command_buffer, "size", jni_command_buffer_size_m, MRB_ARGS_NONE());
+  drb->mrb_define_method(mrb, refs.jni_command_buffer, "execute", jni_command_buffer_execute_m, MRB_ARGS_NONE());
+
+  drb->mrb_define_method(mrb, refs.jni_future, "done?", jni_future_done_m, MRB_ARGS_NONE());
+  drb->mrb_define_method(mrb, refs.jni_future, "value", jni_future_value_m, MRB_ARGS_NONE());
 
 #define FOR_JNI_TYPE(type, type_pascal_case, type_upper_case)\
   drb->mrb_define_class_method(mrb, refs.jni, "get_" #type "_field", jni_get_ ## type ## _field_m, MRB_ARGS_REQ(2));\
@@ -566,6 +4392,28 @@ void drb_register_c_extensions_with_api(mrb_state *mrb, struct drb_api_t *local_
 
 #include "define_for_jni_types_with_void.c.inc"
 
+#undef FOR_JNI_TYPE
+
+#define FOR_JNI_TYPE(type, type_pascal_case, type_upper_case)\
+  drb->mrb_define_class_method(mrb, refs.jni, "new_" #type "_array", jni_new_ ## type ## _array_m, MRB_ARGS_REQ(1));\
+  drb->mrb_define_class_method(mrb,\
+                               refs.jni,\
+                               "get_" #type "_array_region",\
+                               jni_get_ ## type ## _array_region_m,\
+                               MRB_ARGS_REQ(1) | MRB_ARGS_OPT(2));\
+  drb->mrb_define_class_method(mrb,\
+                               refs.jni,\
+                               "get_" #type "_array_values",\
+                               jni_get_ ## type ## _array_values_m,\
+                               MRB_ARGS_REQ(1) | MRB_ARGS_OPT(2));\
+  drb->mrb_define_class_method(mrb,\
+                               refs.jni,\
+                               "set_" #type "_array_region",\
+                               jni_set_ ## type ## _array_region_m,\
+                               MRB_ARGS_REQ(3));
+
+#include "define_for_jni_primitive_types.c.inc"
+
 #undef FOR_JNI_TYPE
 
 
@@ -573,5 +4421,5 @@ void drb_register_c_extensions_with_api(mrb_state *mrb, struct drb_api_t *local_
   drb->mrb_iv_set(mrb,
                   drb->mrb_obj_value(refs.jni),
                   drb->mrb_intern_lit(mrb, "@game_activity_reference"),
-                  wrap_jni_reference_in_object(mrb, activity, "jobject"));
+                  wrap_jni_reference_in_object(mrb, activity, JNI_REFERENCE_JOBJECT));
 }
@@ -9,6 +9,24 @@ test_case 'FFI.find_class' do
   end
 end
 
+test_case 'FFI interned classes and member IDs' do
+  first_lookup = JNI::FFI.find_class('java/lang/Integer')
+  second_lookup = JNI::FFI.find_class('java/lang/Integer')
+  expect_equal_values second_lookup.qualifier, first_lookup.qualifier
+
+  compare_method = JNI::FFI.get_static_method_id(first_lookup, 'compare', '(II)I')
+  cached_compare_method = JNI::FFI.get_static_method_id(second_lookup, 'compare', '(II)I')
+  puts "Cached method ID: #{cached_compare_method.inspect}"
+  expect_equal_values JNI::FFI.call_static_int_method(second_lookup, cached_compare_method, %i[int int], 2, 1), 1
+  expect_equal_values JNI::FFI.call_static_int_method(first_lookup, compare_method, %i[int int], 1, 2), -1
+
+  2.times do
+    expect_exception(JNI::FFI::NoSuchMethod) do
+      JNI::FFI.get_static_method_id(first_lookup, 'nonExistentMethod', '()V')
+    end
+  end
+end
+
 test_case 'FFI.get_static_method_id' do
   string_class = JNI::FFI.find_class('java/lang/String')
 
@@ -236,6 +254,22 @@ test_case 'FFI string parameters' do
   end
 end
 
+test_case 'FFI interned string parameters' do
+  string_class = JNI::FFI.find_class('java/lang/String')
+  string_from_str_constructor = JNI::FFI.get_method_id(string_class, '<init>', '(Ljava/lang/String;)V')
+
+  test_parameters(
+    valid_examples: ['en-US', 'en-US', nil],
+    invalid_examples: [42]
+  ) do |value|
+    JNI::FFI.new_object(string_class, string_from_str_constructor, %i[interned_string], value)
+  end
+
+  value_of_method = JNI::FFI.get_static_method_id(string_class, 'valueOf', '(Ljava/lang/Object;)Ljava/lang/String;')
+  value_of_call_site = JNI::FFI.build_call_site(value_of_method, %i[interned_string], :string, :static_method)
+  expect_equal_values JNI::FFI.call(value_of_call_site, string_class, 'Grüße'), 'Grüße'
+end
+
 test_case 'FFI.new_object' do
   string_class = JNI::FFI.find_class('java/lang/String')
   constructor_method = JNI::FFI.get_method_id(string_class, '<init>', '()V')
@@ -283,19 +317,56 @@ test_case 'FFI.call_static_object_method (returning String)' do
 end
 
 test_case 'FFI.call_static_object_method (returning an object)' do
+  collections_class = JNI::FFI.find_class('java/util/Collections')
+  empty_list_method = JNI::FFI.get_static_method_id(collections_class, 'emptyList', '()Ljava/util/List;')
+
+  list_object = JNI::FFI.call_static_object_method(collections_class, empty_list_method, [])
+
+  list_class_name = JNI::FFI.get_object_class(list_object)
+  puts 'Successfully called Collections.emptyList:'
+  puts "  emptyList() = #{list_object.inspect}"
+  puts "  Object class: #{list_class_name.inspect}"
+end
+
+test_case 'FFI.call_static_object_method (returning a boxed primitive)' do
   integer_class = JNI::FFI.find_class('java/lang/Integer')
   value_of_method = JNI::FFI.get_static_method_id(
     integer_class,
     'valueOf',
     '(I)Ljava/lang/Integer;'
   )
+  expect_equal_values JNI::FFI.call_static_object_method(integer_class, value_of_method, %i[int], 42), 42
+
+  double_class = JNI::FFI.find_class('java/lang/Double')
+  double_value_of_method = JNI::FFI.get_static_method_id(double_class, 'valueOf', '(D)Ljava/lang/Double;')
+  expect_equal_values JNI::FFI.call_static_object_method(double_class, double_value_of_method, %i[double], 1.5), 1.5
 
-  integer_object = JNI::FFI.call_static_object_method(integer_class, value_of_method, %i[int], 42)
+  boolean_class = JNI::FFI.find_class('java/lang/Boolean')
+  boolean_value_of_method = JNI::FFI.get_static_method_id(boolean_class, 'valueOf', '(Z)Ljava/lang/Boolean;')
+  expect_equal_values JNI::FFI.call_static_object_method(boolean_class, boolean_value_of_method, %i[boolean], true), true
+
+  # Boxed arguments are built from Ruby values
+  objects_class = JNI::FFI.find_class('java/util/Objects')
+  objects_to_string_method = JNI::FFI.get_static_method_id(objects_class, 'toString', '(Ljava/lang/Object;)Ljava/lang/String;')
+  expect_equal_values JNI::FFI.call_static_object_method(objects_class,
+                                                         objects_to_string_method,
+                                                         ['java.lang.Integer'],
+                                                         7),
+                      '7'
+  expect_equal_values JNI::FFI.call_static_object_method(objects_class,
+                                                         objects_to_string_method,
+                                                         ['java.lang.Long'],
+                                                         nil),
+                      'null'
+  expect_exception(JNI::FFI::WrongArgumentType) do
+    JNI::FFI.call_static_object_method(objects_class, objects_to_string_method, ['java.lang.Integer'], 'seven')
+  end
 
-  integer_class_name = JNI::FFI.get_object_class(integer_object)
-  puts 'Successfully called Integer.valueOf:'
-  puts "  valueOf(42) = #{integer_object.inspect}"
-  puts "  Object class: #{integer_class_name.inspect}"
+  # Call sites declaring a boxed return class unbox without checking the class of the result
+  value_of_call_site = JNI::FFI.build_call_site(value_of_method, %i[int], 'java.lang.Integer', :static_method)
+  expect_equal_values JNI::FFI.call(value_of_call_site, integer_class, 42), 42
+  object_value_of_call_site = JNI::FFI.build_call_site(value_of_method, %i[int], 'java.lang.Object', :static_method)
+  expect_equal_values JNI::FFI.call(object_value_of_call_site, integer_class, 42), 42
 end
 
 test_case 'FFI.call_static_boolean_method' do
@@ -398,6 +469,36 @@ test_case 'FFI.call_static_double_method' do
   puts "  parseDouble(\"3.14\") = #{result}"
 end
 
+test_case 'FFI.call' do
+  integer_class = JNI::FFI.find_class('java/lang/Integer')
+  compare_method = JNI::FFI.get_static_method_id(integer_class, 'compare', '(II)I')
+  compare_call_site = JNI::FFI.build_call_site(compare_method, %i[int int], :int, :static_method)
+  puts "Built call site: #{compare_call_site.inspect}"
+
+  expect_equal_values JNI::FFI.call(compare_call_site, integer_class, 1, 2), -1
+
+  string_class = JNI::FFI.find_class('java/lang/String')
+  constructor_method = JNI::FFI.get_method_id(string_class, '<init>', '(Ljava/lang/String;)V')
+  constructor_call_site = JNI::FFI.build_call_site(constructor_method, %i[string], :void, :constructor)
+  string_object = JNI::FFI.call(constructor_call_site, string_class, 'Hello')
+
+  length_method = JNI::FFI.get_method_id(string_class, 'length', '()I')
+  length_call_site = JNI::FFI.build_call_site(length_method, [], :int, :method)
+  expect_equal_values JNI::FFI.call(length_call_site, string_object), 5
+
+  expect_exception(JNI::FFI::WrongArgumentType) do
+    JNI::FFI.call(compare_call_site, integer_class, 1, 'not an int')
+  end
+
+  expect_exception(JNI::FFI::WrongArgumentType) do
+    JNI::FFI.call(constructor_call_site, string_class, "null\0byte")
+  end
+
+  expect_exception(JNI::FFI::Exception) do
+    JNI::FFI.call(compare_call_site, integer_class, 1)
+  end
+end
+
 test_case 'FFI.get_..._field' do
   string_class = JNI::FFI.find_class('java/lang/String')
   constructor_method = JNI::FFI.get_method_id(string_class, '<init>', '()V')
@@ -425,3 +526,451 @@ test_case 'FFI.get_static_..._field' do
   out_object = JNI::FFI.get_static_object_field(system_class, out_field)
   puts "Out object: #{out_object.inspect}"
 end
+
+test_case 'FFI Java exception without message' do
+  array_list_class = JNI::FFI.find_class('java/util/ArrayList')
+  constructor_method = JNI::FFI.get_method_id(array_list_class, '<init>', '()V')
+  array_list = JNI::FFI.new_object(array_list_class, constructor_method, [])
+  iterator_method = JNI::FFI.get_method_id(array_list_class, 'iterator', '()Ljava/util/Iterator;')
+  iterator = JNI::FFI.call_object_method(array_list, iterator_method, [])
+
+  iterator_class = JNI::FFI.get_object_class(iterator)
+  next_method = JNI::FFI.get_method_id(iterator_class, 'next', '()Ljava/lang/Object;')
+
+  expect_exception(JNI::FFI::JavaException) do
+    JNI::FFI.call_object_method(iterator, next_method, [])
+  end
+end
+
+test_case 'FFI Reference and Pointer qualifiers' do
+  string_class = JNI::FFI.find_class('java/lang/String')
+  expect_equal_values string_class.type_name, 'jclass'
+  expect_equal_values string_class.qualifier, 'class java.lang.String'
+
+  length_method = JNI::FFI.get_method_id(string_class, 'length', '()I')
+  expect_equal_values length_method.type_name, 'jmethodID'
+  expect_equal_values length_method.qualifier, 'class java.lang.String length()'
+
+  case_insensitive_order_field = JNI::FFI.get_static_field_id(
+    string_class,
+    'CASE_INSENSITIVE_ORDER',
+    'Ljava/util/Comparator;'
+  )
+  expect_equal_values case_insensitive_order_field.type_name, 'jfieldID'
+  expect_equal_values case_insensitive_order_field.qualifier, 'class java.lang.String static CASE_INSENSITIVE_ORDER'
+end
+
+test_case 'FFI.with_frame' do
+  string_class = JNI::FFI.find_class('java/lang/String')
+  constructor_method = JNI::FFI.get_method_id(string_class, '<init>', '()V')
+
+  retained_object = nil
+  local_object = nil
+  JNI::FFI.with_frame(4) do
+    local_object = JNI::FFI.new_object(string_class, constructor_method, [])
+    retained_object = JNI::FFI.new_object(string_class, constructor_method, []).retain
+    puts "Local object inside frame: #{local_object.inspect}"
+  end
+
+  puts "Retained object after frame: #{retained_object.inspect}"
+  expect_exception(JNI::FFI::Exception) do
+    local_object.qualifier
+  end
+
+  objects_class = JNI::FFI.find_class('java/util/Objects')
+  to_string_method = JNI::FFI.get_static_method_id(objects_class, 'toString', '(Ljava/lang/Object;)Ljava/lang/String;')
+  to_string_call_site = JNI::FFI.build_call_site(to_string_method, ['java.lang.Object'], :string, :static_method)
+  expect_exception(JNI::FFI::WrongArgumentType) do
+    JNI::FFI.call(to_string_call_site, objects_class, local_object)
+  end
+end
+
+test_case 'FFI.new_command_buffer' do
+  string_builder_class = JNI::FFI.find_class('java/lang/StringBuilder')
+  constructor_method = JNI::FFI.get_method_id(string_builder_class, '<init>', '()V')
+  string_builder = JNI::FFI.new_object(string_builder_class, constructor_method, [])
+
+  append_method = JNI::FFI.get_method_id(string_builder_class, 'append', '(I)Ljava/lang/StringBuilder;')
+  append_call_site = JNI::FFI.build_call_site(append_method, %i[int], 'java.lang.StringBuilder', :method)
+  to_string_method = JNI::FFI.get_method_id(string_builder_class, 'toString', '()Ljava/lang/String;')
+
+  buffer = JNI::FFI.new_command_buffer
+  append_index = buffer.add_call(append_call_site, string_builder, 1)
+  buffer.add_call(append_call_site, string_builder, 2)
+  puts "Recorded command buffer: #{buffer.inspect}"
+
+  buffer.execute
+  expect_equal_values JNI::FFI.call_object_method(string_builder, to_string_method, []), '12'
+
+  buffer.set_argument(append_index, 0, 3)
+  buffer.execute
+  expect_equal_values JNI::FFI.call_object_method(string_builder, to_string_method, []), '1232'
+
+  expect_exception(JNI::FFI::WrongArgumentType) do
+    buffer.set_argument(append_index, 0, 'not an int')
+  end
+end
+
+test_case 'FFI primitive arrays' do
+  int_array = JNI::FFI.new_int_array([1, 2, 3, 4])
+  expect_equal_values JNI::FFI.get_array_length(int_array), 4
+  expect_equal_values JNI::FFI.get_int_array_values(int_array), [1, 2, 3, 4]
+  expect_equal_values JNI::FFI.get_int_array_region(int_array, 1, 2), [2, 3].pack('l<*')
+
+  JNI::FFI.set_int_array_region(int_array, 2, [30, 40].pack('l<*'))
+  JNI::FFI.set_int_array_region(int_array, 0, [10])
+  expect_equal_values JNI::FFI.get_int_array_values(int_array), [10, 2, 30, 40]
+
+  char_array = JNI::FFI.new_char_array([0x41, 0xE9, 0x20AC].pack('S<*'))
+  expect_equal_values JNI::FFI.get_char_array_values(char_array), ['A', "\u00E9", "\u20AC"]
+  round_tripped_char_array = JNI::FFI.new_char_array(JNI::FFI.get_char_array_values(char_array))
+  expect_equal_values JNI::FFI.get_char_array_region(round_tripped_char_array, 0, 3), [0x41, 0xE9, 0x20AC].pack('S<*')
+  expect_exception(JNI::FFI::WrongArgumentType) do
+    JNI::FFI.new_char_array(["\xE9"])
+  end
+
+  arrays_class = JNI::FFI.find_class('java/util/Arrays')
+  copy_of_method = JNI::FFI.get_static_method_id(arrays_class, 'copyOfRange', '([FII)[F')
+  copy_of_call_site = JNI::FFI.build_call_site(copy_of_method, [[:float], :int, :int], [:float], :static_method)
+  result = JNI::FFI.call(copy_of_call_site, arrays_class, [0.5, 1.5, 2.5], 1, 3)
+  puts "Copied float array: #{result.unpack('e*')}"
+  expect_equal_values result.unpack('e*'), [1.5, 2.5]
+
+  expect_exception(JNI::FFI::WrongArgumentType) do
+    JNI::FFI.new_int_array([1, 'not an int'])
+  end
+
+  expect_exception(JNI::FFI::WrongArgumentType) do
+    JNI::FFI.new_int_array('odd')
+  end
+
+  expect_exception(JNI::FFI::Exception) do
+    JNI::FFI.get_int_array_region(int_array, 3, 2)
+  end
+end
+
+test_case 'FFI collections' do
+  list = JNI::FFI.new_collection([1, 'two', 3.5, true, nil, 2**40, :three, [4]])
+  expect_equal_values list.qualifier.include?('java.util.ArrayList'), true
+  values = JNI::FFI.read_collection(list)
+  expect_equal_values values[0..6], [1, 'two', 3.5, true, nil, 2**40, 'three']
+  expect_equal_values JNI::FFI.read_collection(values[7]), [4]
+
+  map = JNI::FFI.new_collection({ 'volume' => 0.5, music: false, 'level' => 3 })
+  expect_equal_values JNI::FFI.read_collection(map), { 'volume' => 0.5, 'music' => false, 'level' => 3 }
+
+  # String[] returned by split
+  string_class = JNI::FFI.find_class('java/lang/String')
+  split_method = JNI::FFI.get_method_id(string_class, 'split', '(Ljava/lang/String;)[Ljava/lang/String;')
+  string = JNI::FFI.new_object(string_class,
+                               JNI::FFI.get_method_id(string_class, '<init>', '(Ljava/lang/String;)V'),
+                               %i[string],
+                               'a,b,c')
+  parts = JNI::FFI.call_object_method(string, split_method, %i[string], ',')
+  expect_equal_values JNI::FFI.read_collection(parts), %w[a b c]
+
+  expect_exception(JNI::FFI::Exception) do
+    JNI::FFI.new_collection([Object.new])
+  end
+
+  expect_exception(JNI::FFI::Exception) do
+    JNI::FFI.read_collection(JNI::FFI.find_class('java/lang/Object'))
+  end
+end
+
+test_case 'FFI.new_direct_byte_buffer' do
+  buffer = JNI::FFI.new_direct_byte_buffer(8)
+  expect_equal_values JNI::FFI.get_direct_buffer_capacity(buffer), 8
+
+  JNI::FFI.write_direct_buffer(buffer, 4, [1, 2, 3, 4].pack('C*'))
+  expect_equal_values JNI::FFI.read_direct_buffer(buffer, 4, 2), [1, 2].pack('C*')
+
+  byte_buffer_class = JNI::FFI.find_class('java/nio/ByteBuffer')
+  get_method = JNI::FFI.get_method_id(byte_buffer_class, 'get', '(I)B')
+  put_method = JNI::FFI.get_method_id(byte_buffer_class, 'put', '(IB)Ljava/nio/ByteBuffer;')
+  expect_equal_values JNI::FFI.call_byte_method(buffer, get_method, %i[int], 7), 4
+
+  JNI::FFI.call_object_method(buffer, put_method, %i[int byte], 0, 42)
+  expect_equal_values JNI::FFI.read_direct_buffer(buffer, 0, 1), [42].pack('C')
+
+  expect_exception(JNI::FFI::Exception) do
+    JNI::FFI.write_direct_buffer(buffer, 6, 'abc')
+  end
+
+  string_class = JNI::FFI.find_class('java/lang/String')
+  expect_exception(JNI::FFI::Exception) do
+    JNI::FFI.read_direct_buffer(string_class)
+  end
+end
+
+class TestIllegalArgument < JNI::FFI::JavaException; end
+class TestNumberFormat < TestIllegalArgument; end
+
+test_case 'FFI.map_exception' do
+  JNI::FFI.map_exception('java.lang.NumberFormatException', TestNumberFormat)
+  JNI::FFI.map_exception('java/lang/IllegalArgumentException', TestIllegalArgument)
+
+  integer_class = JNI::FFI.find_class('java/lang/Integer')
+  parse_int_method = JNI::FFI.get_static_method_id(integer_class, 'parseInt', '(Ljava/lang/String;)I')
+  expect_exception(TestNumberFormat) do
+    JNI::FFI.call_static_int_method(integer_class, parse_int_method, %i[string], 'not a number')
+  end
+
+  character_class = JNI::FFI.find_class('java/lang/Character')
+  to_chars_method = JNI::FFI.get_static_method_id(character_class, 'toChars', '(I)[C')
+  expect_exception(TestIllegalArgument) do
+    JNI::FFI.call_static_object_method(character_class, to_chars_method, %i[int], -1)
+  end
+
+  expect_exception(JNI::FFI::ClassNotFound) do
+    JNI::FFI.map_exception('com.example.NonExistentException', TestIllegalArgument)
+  end
+
+  expect_exception(JNI::FFI::Exception) do
+    JNI::FFI.map_exception('java.lang.IllegalStateException', String)
+  end
+end
+
+test_case 'FFI.stats' do
+  integer_class = JNI::FFI.find_class('java/lang/Integer')
+  parse_int_method = JNI::FFI.get_static_method_id(integer_class, 'parseInt', '(Ljava/lang/String;)I')
+  value_of_int_method = JNI::FFI.get_static_method_id(integer_class, 'valueOf', '(I)Ljava/lang/Integer;')
+  value_of_string_method = JNI::FFI.get_static_method_id(integer_class, 'valueOf', '(Ljava/lang/String;)Ljava/lang/Integer;')
+  max_value_field = JNI::FFI.get_static_field_id(integer_class, 'MAX_VALUE', 'I')
+  expect_equal_values value_of_int_method.signature, '(I)Ljava/lang/Integer;'
+
+  JNI::FFI.reset_stats
+  JNI::FFI.call_static_int_method(integer_class, parse_int_method, %i[string], '1')
+  expect_equal_values JNI::FFI.stats[:members], {}
+
+  JNI::FFI.stats_enabled = true
+  begin
+    JNI::FFI.call_static_int_method(integer_class, parse_int_method, %i[string], '1')
+    parse_int_call_site = JNI::FFI.build_call_site(parse_int_method, %i[string], :int, :static_method)
+    JNI::FFI.call(parse_int_call_site, integer_class, '2')
+    expect_exception(JNI::FFI::JavaException) do
+      JNI::FFI.call_static_int_method(integer_class, parse_int_method, %i[string], 'not a number')
+    end
+    JNI::FFI.call_static_object_method(integer_class, value_of_int_method, %i[int], 1)
+    2.times do
+      JNI::FFI.call_static_object_method(integer_class, value_of_string_method, %i[string], '1')
+    end
+    3.times do
+      JNI::FFI.get_static_int_field(integer_class, max_value_field)
+    end
+  ensure
+    JNI::FFI.stats_enabled = false
+  end
+
+  stats = JNI::FFI.stats
+  puts "Stats: #{stats.inspect}"
+  member_stats = stats[:members]['class java.lang.Integer static parseInt(Ljava/lang/String;)I']
+  expect_equal_values member_stats[:calls], 3
+  expect_equal_values member_stats[:exceptions], 1
+  raise "Expected max_ns <= total_ns but got #{member_stats.inspect}" unless member_stats[:max_ns] <= member_stats[:total_ns]
+  expect_equal_values stats[:members]['class java.lang.Integer static valueOf(I)Ljava/lang/Integer;'][:calls], 1
+  expect_equal_values stats[:members]['class java.lang.Integer static valueOf(Ljava/lang/String;)Ljava/lang/Integer;'][:calls], 2
+  expect_equal_values stats[:members]['class java.lang.Integer static MAX_VALUE:I'][:calls], 3
+  expect_equal_values stats[:members].size, 4
+
+  live_references = stats[:live_global_references]
+  object_class = JNI::FFI.find_class('java/lang/Object')
+  constructor = JNI::FFI.get_method_id(object_class, '<init>', '()V')
+  object = JNI::FFI.new_object(object_class, constructor, [])
+  puts "Created #{object.inspect}"
+  expect_equal_values JNI::FFI.stats[:live_global_references], live_references + 1
+
+  JNI::FFI.reset_stats
+  expect_equal_values JNI::FFI.stats[:members], {}
+  expect_equal_values JNI::FFI.stats[:created_global_references], 0
+  expect_equal_values JNI::FFI.stats[:live_global_references], live_references + 1
+end
+
+def wait_for_future(future)
+  thread_class = JNI::FFI.find_class('java/lang/Thread')
+  sleep_method = JNI::FFI.get_static_method_id(thread_class, 'sleep', '(J)V')
+  1000.times do
+    return if future.done?
+
+    JNI::FFI.call_static_void_method(thread_class, sleep_method, %i[long], 1)
+  end
+  raise 'Async call did not finish in time'
+end
+
+test_case 'FFI.warm_up' do
+  JNI::FFI.warm_up(
+    [
+      'java.util.concurrent.ConcurrentSkipListMap',
+      ['java.util.concurrent.ConcurrentSkipListMap', :method, 'size', '()I'],
+      ['java/lang/Integer', :static_method, 'parseInt', '(Ljava/lang/String;)I'],
+      ['java.lang.Integer', :static_field, 'MAX_VALUE', 'I'],
+      ['java.lang.Integer', :method, 'noSuchMethod', '()V'],
+      'com.example.NonExistentClass'
+    ]
+  )
+
+  thread_class = JNI::FFI.find_class('java/lang/Thread')
+  sleep_method = JNI::FFI.get_static_method_id(thread_class, 'sleep', '(J)V')
+  1000.times do
+    break if JNI::FFI.warm_up_done?
+
+    JNI::FFI.call_static_void_method(thread_class, sleep_method, %i[long], 1)
+  end
+  expect_equal_values JNI::FFI.warm_up_progress, [4, 2, 6]
+
+  map_class = JNI::FFI.find_class('java/util/concurrent/ConcurrentSkipListMap')
+  size_method = JNI::FFI.get_method_id(map_class, 'size', '()I')
+  expect_equal_values size_method.qualifier, 'class java.util.concurrent.ConcurrentSkipListMap size()'
+
+  expect_exception(JNI::FFI::Exception) do
+    JNI::FFI.warm_up([['java.lang.Integer', :constructor, '<init>', '()V']])
+  end
+end
+
+test_case 'FFI.call_async' do
+  integer_class = JNI::FFI.find_class('java/lang/Integer')
+  parse_int_method = JNI::FFI.get_static_method_id(integer_class, 'parseInt', '(Ljava/lang/String;)I')
+  parse_int_call_site = JNI::FFI.build_call_site(parse_int_method, %i[string], :int, :static_method)
+
+  future = JNI::FFI.call_async(parse_int_call_site, integer_class, '42')
+  puts "Submitted async call: #{future.inspect}"
+  wait_for_future(future)
+  expect_equal_values future.value, 42
+  expect_equal_values future.value, 42
+
+  string_class = JNI::FFI.find_class('java/lang/String')
+  value_of_method = JNI::FFI.get_static_method_id(string_class, 'valueOf', '(I)Ljava/lang/String;')
+  value_of_call_site = JNI::FFI.build_call_site(value_of_method, %i[int], :string, :static_method)
+  string_future = JNI::FFI.call_async(value_of_call_site, string_class, 7)
+  wait_for_future(string_future)
+  expect_equal_values string_future.value, '7'
+
+  failing_future = JNI::FFI.call_async(parse_int_call_site, integer_class, 'not a number')
+  wait_for_future(failing_future)
+  2.times do
+    expect_exception(JNI::FFI::JavaException) do
+      failing_future.value
+    end
+  end
+
+  expect_exception(JNI::FFI::WrongArgumentType) do
+    JNI::FFI.call_async(parse_int_call_site, integer_class, 42)
+  end
+end
+
+test_case 'FFI.defer' do
+  string_builder_class = JNI::FFI.find_class('java/lang/StringBuilder')
+  constructor_method = JNI::FFI.get_method_id(string_builder_class, '<init>', '()V')
+  string_builder = JNI::FFI.new_object(string_builder_class, constructor_method, [])
+
+  append_method = JNI::FFI.get_method_id(string_builder_class, 'append', '(I)Ljava/lang/StringBuilder;')
+  append_call_site = JNI::FFI.build_call_site(append_method, %i[int], 'java.lang.StringBuilder', :method)
+  to_string_method = JNI::FFI.get_method_id(string_builder_class, 'toString', '()Ljava/lang/String;')
+
+  JNI::FFI.defer(append_call_site, string_builder, 1)
+  JNI::FFI.defer(append_call_site, string_builder, 2, key: :volume)
+  JNI::FFI.defer(append_call_site, string_builder, 3, priority: 1)
+  expect_equal_values JNI::FFI.defer(append_call_site, string_builder, 4, key: :volume), true
+  expect_equal_values JNI::FFI.deferred_call_count, 3
+
+  # A budget of 0 still executes one call per pump
+  expect_equal_values JNI::FFI.pump(0), 1
+  expect_equal_values JNI::FFI.call_object_method(string_builder, to_string_method, []), '3'
+  expect_equal_values JNI::FFI.pump(10_000), 2
+  expect_equal_values JNI::FFI.call_object_method(string_builder, to_string_method, []), '314'
+  expect_equal_values JNI::FFI.pump(10_000), 0
+
+  integer_class = JNI::FFI.find_class('java/lang/Integer')
+  parse_int_method = JNI::FFI.get_static_method_id(integer_class, 'parseInt', '(Ljava/lang/String;)I')
+  parse_int_call_site = JNI::FFI.build_call_site(parse_int_method, %i[string], :int, :static_method)
+  JNI::FFI.defer(parse_int_call_site, integer_class, 'not a number')
+  JNI::FFI.defer(parse_int_call_site, integer_class, '42')
+  expect_equal_values JNI::FFI.pump(10_000), 2
+  errors = JNI::FFI.drain_deferred_errors
+  expect_equal_values errors.map(&:class), [JNI::FFI::JavaException]
+  expect_equal_values JNI::FFI.drain_deferred_errors, []
+
+  JNI::FFI.defer(parse_int_call_site, integer_class, '1', key: 'parse')
+  JNI::FFI.clear_deferred_calls
+  expect_equal_values JNI::FFI.deferred_call_count, 0
+
+  expect_exception(JNI::FFI::WrongArgumentType) do
+    JNI::FFI.defer(parse_int_call_site, integer_class, 42)
+  end
+  expect_equal_values JNI::FFI.deferred_call_count, 0
+end
+
+test_case 'FFI.register_event_native' do
+  expect_equal_values JNI::FFI.drain_events, []
+  expect_equal_values JNI::FFI.dropped_event_count, 0
+
+  # String declares no such native method
+  string_class = JNI::FFI.find_class('java/lang/String')
+  expect_exception(JNI::FFI::NoSuchMethod) do
+    JNI::FFI.register_event_native(string_class, 'onEvent', :object)
+  end
+
+  expect_exception(JNI::FFI::Exception) do
+    JNI::FFI.register_event_native(string_class, 'onEvent', :unknown)
+  end
+end
+
+test_case 'FFI.identity_map_enabled=' do
+  collections_class = JNI::FFI.find_class('java/util/Collections')
+  empty_list_method = JNI::FFI.get_static_method_id(collections_class, 'emptyList', '()Ljava/util/List;')
+  empty_map_method = JNI::FFI.get_static_method_id(collections_class, 'emptyMap', '()Ljava/util/Map;')
+
+  # Collections.emptyList returns the shared EMPTY_LIST
+  first = JNI::FFI.call_static_object_method(collections_class, empty_list_method, [])
+  second = JNI::FFI.call_static_object_method(collections_class, empty_list_method, [])
+  raise 'Expected different references while disabled' if first.equal? second
+
+  JNI::FFI.identity_map_enabled = true
+  begin
+    expect_equal_values JNI::FFI.identity_map_enabled?, true
+    first = JNI::FFI.call_static_object_method(collections_class, empty_list_method, [])
+    second = JNI::FFI.call_static_object_method(collections_class, empty_list_method, [])
+    raise 'Expected the same reference while enabled' unless first.equal? second
+
+    empty_map = JNI::FFI.call_static_object_method(collections_class, empty_map_method, [])
+    raise "Expected #{empty_map} to be mapped" unless JNI::FFI.identity_map_size == 2
+
+    JNI::FFI.with_frame do
+      local = JNI::FFI.call_static_object_method(collections_class, empty_list_method, [])
+      raise 'Expected local references not to be mapped' if local.equal? first
+    end
+  ensure
+    JNI::FFI.identity_map_enabled = false
+  end
+  expect_equal_values JNI::FFI.identity_map_size, 0
+end
+
+test_case 'FFI::Bindings' do
+  # Generated from test-game/bindings.rb by build-and-run-on-device and the Build Extensions workflow
+  unless defined?(JNI::FFI::Bindings::JavaLangInteger)
+    puts 'Skipped: extension was built without ./generate-bindings test-game/bindings.rb'
+    next
+  end
+
+  integer_bindings = JNI::FFI::Bindings::JavaLangInteger
+  expect_equal_values integer_bindings.parse_int('42'), 42
+  expect_equal_values integer_bindings.value_of(7), 7
+  expect_equal_values integer_bindings.to_binary_string(5), '101'
+  expect_exception(JNI::FFI::JavaException) do
+    integer_bindings.parse_int('not a number')
+  end
+  expect_exception(JNI::FFI::WrongArgumentType) do
+    integer_bindings.to_binary_string('5')
+  end
+
+  string_builder_bindings = JNI::FFI::Bindings::JavaLangStringBuilder
+  builder = string_builder_bindings.new_object('ab')
+  string_builder_bindings.append(builder, 'c')
+  string_builder_bindings.reverse(builder)
+  expect_equal_values string_builder_bindings.to_string(builder), 'cba'
+  string_builder_bindings.set_length(builder, 1)
+  expect_equal_values string_builder_bindings.to_string(builder), 'c'
+
+  copy = JNI::FFI::Bindings::JavaUtilArrays.copy_of([1, 2, 3], 2)
+  expect_equal_values copy.unpack('l<*'), [1, 2]
+end
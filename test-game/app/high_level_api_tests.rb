@@ -22,7 +22,7 @@ test_case 'Calling static methods' do
                    return_type: 'java.lang.Integer'
   end
   result = JNI['java.lang.Integer'].value_of 42
-  expect_equal_values result.java_class.name, 'java.lang.Integer'
+  expect_equal_values result, 42
 end
 
 test_case 'Building object instances' do
@@ -32,3 +32,45 @@ test_case 'Building object instances' do
   instance = JNI['java.net.URL'].build_new_instance 'https://echo.free.beeceptor.com'
   expect_equal_values instance.java_class.name, 'java.net.URL'
 end
+
+test_case 'Field snapshot and sync' do
+  JNI['android.graphics.Point'].register do
+    constructor argument_types: %i[int int]
+    field :x, type: :int
+    field :y, type: :int
+    method :to_string, return_type: :string
+  end
+  point = JNI['android.graphics.Point'].build_new_instance 1, 2
+
+  state = point.snapshot
+  expect_equal_values state, { x: 1, y: 2 }
+
+  state[:y] = 5
+  point.sync
+  expect_equal_values point.to_string, 'Point(1, 5)'
+  expect_equal_values point.snapshot, { x: 1, y: 5 }
+end
+
+test_case 'Lazy registration and preload' do
+  JNI['java.lang.Long'].register(lazy: true) do
+    static_method :parse_long,
+                   argument_types: [:string],
+                   return_type: :long
+    static_method :to_hex_string,
+                   argument_types: [:long],
+                   return_type: :string
+    constructor argument_types: [:long]
+    method :int_value, return_type: :int
+  end
+  JNI.preload([{ 'java.lang.Long' => %i[to_hex_string] }])
+
+  expect_equal_values JNI['java.lang.Long'].parse_long('12'), 12
+  expect_equal_values JNI['java.lang.Long'].parse_long('13'), 13
+  expect_equal_values JNI['java.lang.Long'].to_hex_string(255), 'ff'
+
+  instance = JNI['java.lang.Long'].build_new_instance 7
+  expect_equal_values instance.int_value, 7
+  expect_equal_values instance.int_value, 7
+
+  JNI.preload(['java.lang.Long'])
+end
@@ -0,0 +1,19 @@
+# Members bound by generate-bindings for the on-device tests (see build-and-run-on-device)
+bind 'java.lang.Integer' do
+  static_method :parse_int, argument_types: [:string], return_type: :int
+  static_method :value_of, argument_types: [:int], return_type: 'java.lang.Integer'
+  static_method :to_binary_string, argument_types: [:int], return_type: :string
+  method :compare_to, argument_types: ['java.lang.Integer'], return_type: :int
+end
+
+bind 'java.lang.StringBuilder' do
+  constructor argument_types: [:string]
+  method :append, argument_types: [:char], return_type: 'java.lang.StringBuilder'
+  method :reverse, return_type: 'java.lang.StringBuilder'
+  method :to_string, return_type: :string
+  method :set_length, argument_types: [:int]
+end
+
+bind 'java.util.Arrays' do
+  static_method :copy_of, argument_types: [[:int], :int], return_type: [:int]
+end
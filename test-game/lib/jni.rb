@@ -2,6 +2,10 @@ require_relative 'jni/ffi'
 
 module JNI
   class << self
+    # When true, JavaClass#register only records the signatures of the members and their IDs are resolved
+    # on first use. Can be overridden per class with register(lazy: ...).
+    attr_accessor :lazy_registration
+
     def game_activity
       @game_activity ||= JavaObject.new(FFI.game_activity_reference)
     end
@@ -11,6 +15,33 @@ module JNI
       @classes[java_class_name] ||= JavaClass.new(FFI.find_class(java_class_name.gsub('.', '/')))
     end
 
+    # Resolves the IDs of lazily registered members ahead of their first use.
+    # Entries are class names (all registered members) or hashes of class names to member names:
+    #
+    #   JNI.preload(['android.os.Vibrator', { 'java.lang.Integer' => %i[parse_int] }])
+    def preload(list)
+      list.each do |entry|
+        if entry.is_a? Hash
+          entry.each do |java_class_name, member_names|
+            self[java_class_name].preload(*member_names)
+          end
+        else
+          self[entry].preload
+        end
+      end
+    end
+
+    # Wraps an object returned by Java. Objects of classes retrieved via JNI[] are instances of the
+    # wrapper class of that JavaClass. Strings and boxed primitives are already converted by FFI.
+    def wrap_object(reference, java_class_name, ffi: FFI)
+      return reference if CONVERTED_VALUE_CLASSES.any? { |value_class| reference.is_a? value_class }
+
+      java_class = @classes && @classes[java_class_name]
+      return JavaObject.new(reference, ffi: ffi) unless java_class
+
+      java_class.instance_class.new(reference, ffi: ffi, java_class: java_class)
+    end
+
     def snake_case_to_camel_case(snake_case)
       parts = snake_case.to_s.split('_')
       [parts[0], *parts[1..].map(&:capitalize)].join
@@ -48,9 +79,12 @@ module JNI
     float: 'F',
     double: 'D',
     string: 'Ljava/lang/String;',
+    interned_string: 'Ljava/lang/String;',
     void: 'V'
   }
 
+  CONVERTED_VALUE_CLASSES = [String, Integer, Float, TrueClass, FalseClass].freeze
+
   class JavaObject
     attr_reader :reference
 
@@ -64,35 +98,24 @@ module JNI
       signature = JNI.method_signature(argument_types, return_type)
       java_method_name = JNI.snake_case_to_camel_case(name)
       method_id = @ffi.get_method_id(java_class.reference, java_method_name, signature)
+      call_site = @ffi.build_call_site(method_id, argument_types, return_type, :method)
 
-      case return_type
-      when :string
-        define_singleton_method name do |*args|
-          @ffi.call_object_method(@reference, method_id, argument_types, *args)
-        end
-      when String
-        define_singleton_method name do |*args|
-          result_reference = @ffi.call_object_method(@reference, method_id, argument_types, *args)
-          JavaObject.new(result_reference, ffi: @ffi)
-        end
-      else
-        define_singleton_method name do |*args|
-          @ffi.send(:"call_#{return_type}_method", @reference, method_id, argument_types, *args)
-        end
-      end
+      register_methods(name => { call_site: call_site, return_type: return_type })
     end
 
     def register_methods(methods)
       methods.each do |name, method|
+        call_site = method[:call_site]
         case method[:return_type]
         when String
+          return_class_name = method[:return_type]
           define_singleton_method name do |*args|
-            result = @ffi.send(method[:ffi_method_name], @reference, method[:method_id], method[:argument_types], *args)
-            JavaObject.new(result, ffi: @ffi)
+            result = @ffi.call(call_site, @reference, *args)
+            JNI.wrap_object(result, return_class_name, ffi: @ffi)
           end
         else
           define_singleton_method name do |*args|
-            @ffi.send(method[:ffi_method_name], @reference, method[:method_id], method[:argument_types], *args)
+            @ffi.call(call_site, @reference, *args)
           end
         end
       end
@@ -102,6 +125,23 @@ module JNI
       @java_class ||= JavaClass.new(@ffi.get_object_class(reference), ffi: @ffi)
     end
 
+    # Reads all fields registered for the class in one call and returns them as hash.
+    # Changes to the returned hash can be written back with #sync.
+    def snapshot
+      values = @ffi.read_fields(java_class.field_set, @reference)
+      @synced_values = copy_field_values(values)
+      @snapshot = java_class.fields.keys.zip(values).to_h
+    end
+
+    # Writes the fields which were changed in the hash returned by #snapshot
+    def sync
+      raise 'Call snapshot before sync' unless @snapshot
+
+      values = java_class.fields.keys.map { |name| @snapshot[name] }
+      @ffi.write_fields(java_class.field_set, @reference, values, @synced_values)
+      @synced_values = copy_field_values(values)
+    end
+
     def inspect
       class_name = java_class.name
       qualifier = @reference.qualifier
@@ -112,30 +152,157 @@ module JNI
         "#<#{self.class} #{qualifier} (#{class_name})>"
       end
     end
+
+    private
+
+    # Strings could be changed in place, so the previous values need their own copies
+    def copy_field_values(values)
+      values.map { |value| value.is_a?(String) ? value.dup : value }
+    end
   end
 
   class JavaClass
-    attr_reader :reference
+    attr_reader :reference, :fields
 
     def initialize(reference, ffi: FFI)
       @reference = reference
       @ffi = ffi
       @methods = {}
+      @static_methods = {}
       @constructor_by_argument_count = {}
+      @fields = {}
     end
 
-    def register(&block)
-      RegisterDSL.new(self, @methods, @constructor_by_argument_count, @ffi).instance_eval(&block)
+    def register(lazy: JNI.lazy_registration, &block)
+      dsl = RegisterDSL.new(self, @methods, @static_methods, @constructor_by_argument_count, @fields, lazy: lazy)
+      dsl.instance_eval(&block)
+      @field_set = nil
     end
 
-    def build_new_instance(*args)
-      constructor = @constructor_by_argument_count[args.size]
-      raise NoSuchMethod, "No constructor for #{inspect} with #{args.size} arguments" unless constructor
+    # Resolves the given lazily registered members (all registered members including constructors if none
+    # are given)
+    def preload(*names)
+      if names.empty?
+        @constructor_by_argument_count.each_key { |argument_count| constructor_call_site(argument_count) }
+        names = @methods.keys + @static_methods.keys + @fields.keys
+      end
+
+      names.each do |name|
+        if @methods.key? name
+          resolve_instance_method(name)
+        elsif @static_methods.key? name
+          resolve_static_method(name)
+        elsif @fields.key? name
+          field_id(name)
+        else
+          raise FFI::NoSuchMethod, "#{name} is not registered for #{inspect}"
+        end
+      end
+    end
+
+    def method_call_site(name)
+      method = @methods.fetch(name)
+      method[:call_site] ||= begin
+        method_id = @ffi.get_method_id(@reference, method[:java_name], method[:signature])
+        @ffi.build_call_site(method_id, method[:argument_types], method[:return_type], :method)
+      end
+    end
+
+    def static_method_call_site(name)
+      method = @static_methods.fetch(name)
+      method[:call_site] ||= begin
+        method_id = @ffi.get_static_method_id(@reference, method[:java_name], method[:signature])
+        @ffi.build_call_site(method_id, method[:argument_types], method[:return_type], :static_method)
+      end
+    end
+
+    def constructor_call_site(argument_count)
+      constructor = @constructor_by_argument_count[argument_count]
+      raise FFI::NoSuchMethod, "No constructor for #{inspect} with #{argument_count} arguments" unless constructor
+
+      constructor[:call_site] ||= begin
+        method_id = @ffi.get_method_id(@reference, '<init>', constructor[:signature])
+        @ffi.build_call_site(method_id, constructor[:argument_types], :void, :constructor)
+      end
+    end
+
+    def field_id(name)
+      field = @fields.fetch(name)
+      field[:field_id] ||= @ffi.get_field_id(@reference, field[:java_name], JNI.type_signature(field[:type]))
+    end
+
+    # Subclass of JavaObject shared by all instances built by or returned as this class.
+    # Registered instance methods are defined on it once.
+    def instance_class
+      @instance_class ||= begin
+        java_class = self
+        Class.new(JavaObject) do
+          define_singleton_method(:name) { "JNI::JavaObject(#{java_class.name})" }
+          define_singleton_method(:to_s) { name }
+          define_singleton_method(:inspect) { name }
+        end
+      end
+    end
+
+    # Defines the registered method on the instance class. Lazily registered methods are resolved on
+    # their first call, which replaces the method with the direct call.
+    def define_instance_method(name)
+      return resolve_instance_method(name) if @methods[name][:call_site]
 
-      reference = @ffi.new_object(@reference, constructor[:method_id], constructor[:argument_types], *args)
-      instance = JavaObject.new(reference, ffi: @ffi, java_class: self)
-      instance.register_methods(@methods)
-      instance
+      java_class = self
+      instance_class.define_method name do |*args|
+        java_class.resolve_instance_method(name)
+        send(name, *args)
+      end
+    end
+
+    # Defines the instance method calling the resolved call site directly
+    def resolve_instance_method(name)
+      call_site = method_call_site(name)
+
+      case @methods[name][:return_type]
+      when String
+        return_class_name = @methods[name][:return_type]
+        instance_class.define_method name do |*args|
+          result = @ffi.call(call_site, @reference, *args)
+          JNI.wrap_object(result, return_class_name, ffi: @ffi)
+        end
+      else
+        instance_class.define_method name do |*args|
+          @ffi.call(call_site, @reference, *args)
+        end
+      end
+    end
+
+    # Defines the static method as singleton method calling the resolved call site directly
+    def resolve_static_method(name)
+      call_site = static_method_call_site(name)
+      reference = @reference
+
+      case @static_methods[name][:return_type]
+      when String
+        return_class_name = @static_methods[name][:return_type]
+        define_singleton_method name do |*args|
+          result_reference = @ffi.call(call_site, reference, *args)
+          JNI.wrap_object(result_reference, return_class_name, ffi: @ffi)
+        end
+      else
+        define_singleton_method name do |*args|
+          @ffi.call(call_site, reference, *args)
+        end
+      end
+    end
+
+    def field_set
+      @field_set ||= @ffi.build_field_set(
+        @fields.keys.map { |name| field_id(name) },
+        @fields.values.map { |field| field[:type] }
+      )
+    end
+
+    def build_new_instance(*args)
+      reference = @ffi.call(constructor_call_site(args.size), @reference, *args)
+      instance_class.new(reference, ffi: @ffi, java_class: self)
     end
 
     def name
@@ -147,64 +314,57 @@ module JNI
       "#<#{self.class} #{name}>"
     end
 
+    # Records the registered members in the tables of the JavaClass. Unless lazy their IDs are resolved
+    # right away.
     class RegisterDSL
-      def initialize(java_class, methods, constructor_by_argument_count, ffi)
+      def initialize(java_class, methods, static_methods, constructor_by_argument_count, fields, lazy: false)
         @java_class = java_class
         @methods = methods
+        @static_methods = static_methods
         @constructor_by_argument_count = constructor_by_argument_count
-        @ffi = ffi
+        @fields = fields
+        @lazy = lazy
+      end
+
+      def field(name, type:)
+        @fields[name] = { java_name: JNI.snake_case_to_camel_case(name), type: type, field_id: nil }
+        @java_class.field_id(name) unless @lazy
       end
 
       def method(name, argument_types: [], return_type: :void)
-        signature = JNI.method_signature(argument_types, return_type)
-        java_method_name = JNI.snake_case_to_camel_case(name)
-        method_id = @ffi.get_method_id(@java_class.reference, java_method_name, signature)
-        ffi_method_name = case return_type
-                          when :string, String
-                            :call_object_method
-                          else
-                            :"call_#{return_type}_method"
-                          end
-        @methods[name] = { method_id: method_id, argument_types: argument_types, return_type: return_type, ffi_method_name: ffi_method_name }
+        @methods[name] = member_signature(name, argument_types, return_type)
+        @java_class.method_call_site(name) unless @lazy
+        @java_class.define_instance_method(name)
       end
 
       def constructor(argument_types: [])
-        signature = JNI.method_signature(argument_types, :void)
-        method_id = @ffi.get_method_id(@java_class.reference, '<init>', signature)
-        @constructor_by_argument_count[argument_types.size] = {
-          method_id: method_id,
-          argument_types: argument_types
-        }
+        @constructor_by_argument_count[argument_types.size] = member_signature('<init>', argument_types, :void)
+        @java_class.constructor_call_site(argument_types.size) unless @lazy
       end
 
       def static_method(name, argument_types: [], return_type: :void)
-        reference = @java_class.reference
-        java_method_name = JNI.snake_case_to_camel_case(name)
-        signature = JNI.method_signature(argument_types, return_type)
-        method_id = @ffi.get_static_method_id(reference, java_method_name, signature)
-
-        %i[boolean byte char short int long float double].each do |type|
-          if type == return_type
-            method_name = "call_static_#{type}_method"
-            @java_class.define_singleton_method name do |*args|
-              @ffi.send(method_name, reference, method_id, argument_types, *args)
-            end
-            return
-          end
-        end
+        @static_methods[name] = member_signature(name, argument_types, return_type)
+        return @java_class.resolve_static_method(name) unless @lazy
 
-        case return_type
-        when :string
-          @java_class.define_singleton_method name do |*args|
-            @ffi.call_static_object_method(reference, method_id, argument_types, *args)
-          end
-        when String
-          @java_class.define_singleton_method name do |*args|
-            result_reference = @ffi.call_static_object_method(reference, method_id, argument_types, *args)
-            JavaObject.new(result_reference, ffi: @ffi)
-          end
+        java_class = @java_class
+        # The first call resolves the method and replaces itself with the direct call
+        @java_class.define_singleton_method name do |*args|
+          java_class.resolve_static_method(name)
+          send(name, *args)
         end
       end
+
+      private
+
+      def member_signature(name, argument_types, return_type)
+        {
+          java_name: name == '<init>' ? name : JNI.snake_case_to_camel_case(name),
+          signature: JNI.method_signature(argument_types, return_type),
+          argument_types: argument_types,
+          return_type: return_type,
+          call_site: nil
+        }
+      end
     end
   end
 end
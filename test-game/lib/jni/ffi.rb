@@ -4,6 +4,8 @@ module JNI
       attr_reader :game_activity_reference
 
       # Class Operations
+      # Classes and the IDs of their members are cached natively for the life of the process,
+      # so repeated lookups (e.g. after a hot reload) do not call into the JVM again.
       # def find_class(name) -> Reference
 
       # Object Operations
@@ -75,6 +77,186 @@ module JNI
       # def call_static_long_method(class_reference, method_id, argument_types, *args) -> Integer
       # def call_static_float_method(class_reference, method_id, argument_types, *args) -> Float
       # def call_static_double_method(class_reference, method_id, argument_types, *args) -> Float
+
+      # Returned boxed primitives (java.lang.Integer, Boolean, Double, ...) are unboxed to Integer, Float,
+      # true/false or a String (Character). Arguments typed like 'java.lang.Integer' accept these Ruby values
+      # and are boxed with valueOf (References and nil are passed as is). Call sites with a declared return
+      # class like 'java.util.List' skip the unboxing check, 'java.lang.Integer' unboxes without it.
+
+      # :interned_string arguments are converted only once per distinct string and the Java string is kept
+      # for the rest of the session. Use it for constant strings like keys, tags or intent actions.
+
+      # Precompiled Calls
+      # kind is one of :method, :static_method or :constructor
+      # def build_call_site(method_id, argument_types, return_type, kind) -> CallSite
+      # def call(call_site, object_or_class_reference, *args)
+      # Runs the call on a worker thread. Poll the returned future every tick.
+      # def call_async(call_site, object_or_class_reference, *args) -> Future
+
+      # Deferred Calls
+      # Queues low priority calls (e.g. analytics or saving preferences) which are executed on the main thread
+      # by pump, typically at the end of each tick with the time left in the frame. Higher priorities run first,
+      # calls of equal priority in the order they were queued. A call with the key of a queued call replaces it
+      # (keeping its place) so that only the latest value is sent. Return values are discarded and Java
+      # exceptions are collected until drain_deferred_errors. Deferred calls are not counted in stats.
+      # def defer_call(call_site, object_or_class_reference, priority, key, *args) -> true if a call was replaced
+      # def pump(budget_us) -> number of executed calls (at least one if any are queued)
+      # def deferred_call_count -> Integer
+      # def drain_deferred_errors -> Array of exceptions
+      # def clear_deferred_calls
+      def defer(call_site, object_or_class_reference, *args, priority: 0, key: nil)
+        defer_call(call_site, object_or_class_reference, priority, key, *args)
+      end
+
+      # Generated Bindings
+      # Members declared in the spec given to generate-bindings are defined on modules named after their
+      # class, e.g. Bindings::JavaLangInteger.parse_int('42'). Instance methods take the object reference as
+      # first argument, constructors are called new_object. Calls through bindings are not counted in stats.
+
+      # Primitive Arrays
+      # Array argument and return types are written like [:int]. Arguments can be a Reference to an
+      # existing array, a packed String (e.g. [1, 2].pack('l<*')) or an Array of values. Returned
+      # primitive arrays are copied into a packed String. Single chars (values, arguments and fields) are
+      # UTF-8 Strings of one character up to U+FFFF.
+      # def get_array_length(array_reference) -> Integer
+      # def new_boolean_array(packed_string_or_values) -> Reference
+      # def new_byte_array(packed_string_or_values) -> Reference
+      # def new_char_array(packed_string_or_values) -> Reference
+      # def new_short_array(packed_string_or_values) -> Reference
+      # def new_int_array(packed_string_or_values) -> Reference
+      # def new_long_array(packed_string_or_values) -> Reference
+      # def new_float_array(packed_string_or_values) -> Reference
+      # def new_double_array(packed_string_or_values) -> Reference
+      # def get_boolean_array_region(array_reference, start = 0, length = rest) -> String (packed)
+      # def get_byte_array_region(array_reference, start = 0, length = rest) -> String (packed)
+      # def get_char_array_region(array_reference, start = 0, length = rest) -> String (packed)
+      # def get_short_array_region(array_reference, start = 0, length = rest) -> String (packed)
+      # def get_int_array_region(array_reference, start = 0, length = rest) -> String (packed)
+      # def get_long_array_region(array_reference, start = 0, length = rest) -> String (packed)
+      # def get_float_array_region(array_reference, start = 0, length = rest) -> String (packed)
+      # def get_double_array_region(array_reference, start = 0, length = rest) -> String (packed)
+      # def get_boolean_array_values(array_reference, start = 0, length = rest) -> Array
+      # def get_byte_array_values(array_reference, start = 0, length = rest) -> Array
+      # def get_char_array_values(array_reference, start = 0, length = rest) -> Array
+      # def get_short_array_values(array_reference, start = 0, length = rest) -> Array
+      # def get_int_array_values(array_reference, start = 0, length = rest) -> Array
+      # def get_long_array_values(array_reference, start = 0, length = rest) -> Array
+      # def get_float_array_values(array_reference, start = 0, length = rest) -> Array
+      # def get_double_array_values(array_reference, start = 0, length = rest) -> Array
+      # def set_boolean_array_region(array_reference, start, packed_string_or_values)
+      # def set_byte_array_region(array_reference, start, packed_string_or_values)
+      # def set_char_array_region(array_reference, start, packed_string_or_values)
+      # def set_short_array_region(array_reference, start, packed_string_or_values)
+      # def set_int_array_region(array_reference, start, packed_string_or_values)
+      # def set_long_array_region(array_reference, start, packed_string_or_values)
+      # def set_float_array_region(array_reference, start, packed_string_or_values)
+      # def set_double_array_region(array_reference, start, packed_string_or_values)
+
+      # Collections
+      # Converts a java.util.List, Set or other Collection or an Object[] into an Array and a java.util.Map
+      # into a Hash in one call. Strings and boxed primitives are converted to Ruby values, all other
+      # elements (including nested collections) are returned as Reference.
+      # new_collection builds an ArrayList from an Array or a HashMap from a Hash. Elements can be nil,
+      # Strings, Symbols (converted to strings), true/false, Integers (Integer or Long if they don't fit),
+      # Floats (Double), nested Arrays/Hashes or References.
+      # def read_collection(collection_reference) -> Array or Hash
+      # def new_collection(array_or_hash) -> Reference
+
+      # Direct Buffers
+      # new_direct_byte_buffer returns a java.nio.ByteBuffer aliasing memory owned by the extension.
+      # The memory is freed together with the Reference, so keep the Reference around as long as
+      # Java code uses the buffer. Reading and writing also works for direct buffers allocated in Java.
+      # def new_direct_byte_buffer(capacity) -> Reference
+      # def get_direct_buffer_capacity(buffer_reference) -> Integer
+      # def read_direct_buffer(buffer_reference, offset = 0, length = rest) -> String
+      # def write_direct_buffer(buffer_reference, offset, string)
+
+      # Field Sets
+      # Reads or writes several instance fields of an object in one call.
+      # write_fields only writes the values which differ from previous_values and returns their count.
+      # def build_field_set(field_ids, types) -> FieldSet
+      # def read_fields(field_set, object_reference) -> Array
+      # def write_fields(field_set, object_reference, values, previous_values) -> Integer
+
+      # Command Buffers
+      # def new_command_buffer -> CommandBuffer
+
+      # Java Events
+      # Lets Java code (e.g. listeners) send events to Ruby. Declare a native method in your Java code
+      # and register it:
+      #
+      #   public static native void onSensorEvent(int type, long timestamp, double x, double y, double z); // :numeric
+      #   public static native void onEvent(int type, Object payload);                                    // :object
+      #
+      # The native methods can be called from any thread. Events are queued in a fixed size ring buffer
+      # and returned in order by drain_events, which should be called once per tick. Events arriving while
+      # the ring is full (1024 events) are dropped and counted.
+      # def register_event_native(class_reference, method_name, kind) # kind is :numeric or :object
+      # def drain_events -> Array of [type, value, x, y, z] (numeric) or [type, Reference or nil] (object)
+      # def dropped_event_count -> Integer
+
+      # Class Warm-Up
+      # Loads classes and resolves member IDs on a background thread (e.g. during a loading screen) so that
+      # later find_class and get_*_id calls (and JNI[...]) are answered from the cache. Classes are loaded
+      # with the class loader of the activity. Entries which cannot be resolved are counted as failed.
+      # Classes are only loaded and linked, their static initializers run on first use on the main thread.
+      # Resolving member IDs initializes the class though (as required by JNI), on the warm-up thread.
+      #
+      #   FFI.warm_up([
+      #     'com.example.MyClass',
+      #     ['java.lang.Integer', :static_method, 'parseInt', '(Ljava/lang/String;)I']
+      #   ])
+      #
+      # def warm_up(manifest) # kind is one of :method, :static_method, :field or :static_field
+      # def warm_up_done? -> true/false
+      # def warm_up_progress -> [resolved_count, failed_count, total_count]
+
+      # Exception Mapping
+      # Java exceptions (including subclasses) of a mapped class are raised as the given Ruby exception class.
+      # The most specific mapping wins. Unmapped exceptions are raised as JavaException.
+      # The Ruby exception class must inherit from StandardError. Mappings are kept when the extension is reloaded.
+      # def map_exception(java_class_name, ruby_exception_class)
+
+      # Statistics
+      # While enabled, calls through the FFI methods, call sites and command buffers are counted per
+      # method or field ID together with the time spent in Java. Async calls are not counted.
+      # Live global references are always counted.
+      # def stats_enabled=(enabled)
+      # def stats_enabled? -> true/false
+      # def stats -> Hash
+      #   {
+      #     enabled: true,
+      #     live_global_references: 12,
+      #     created_global_references: 40, # since the last reset
+      #     deleted_global_references: 28, # since the last reset
+      #     members: {
+      #       'class java.lang.Integer static parseInt(Ljava/lang/String;)I' => { calls:, exceptions:, total_ns:, max_ns: },
+      #       'class java.lang.Integer static MAX_VALUE:I' => { calls:, exceptions:, total_ns:, max_ns: }
+      #     }
+      #   }
+      # def reset_stats
+
+      # Identity Map
+      # While enabled, a Java object returned several times outside of local frames is wrapped in the same
+      # Reference so that equal? and hash lookups keyed by the Reference work. Disabling clears the map.
+      # def identity_map_enabled=(enabled)
+      # def identity_map_enabled? -> true/false
+      # def identity_map_size -> number of mapped objects
+
+      # Local Reference Frames
+      # def push_local_frame(capacity)
+      # def pop_local_frame
+
+      # Inside the block all returned objects are local references which become invalid
+      # when the block exits. Call #retain on references that should outlive the block.
+      def with_frame(capacity = 16)
+        push_local_frame(capacity)
+        begin
+          yield
+        ensure
+          pop_local_frame
+        end
+      end
     end
 
     class Exception < StandardError; end
@@ -86,21 +268,73 @@ module JNI
 
     # Stores a JNI global reference internally
     # Do not use this class directly
+    #
+    # Defined natively:
+    # def type_name -> String
+    # def qualifier -> String (calls toString() on the Java object)
+    # def retain -> self (promotes a local reference created inside FFI.with_frame to a global reference)
     class Reference
-      attr_reader :type_name, :qualifier
+      def inspect
+        "#<#{self.class.name} #{type_name} #{qualifier}>"
+      end
+    end
+
+    # Stores a method ID together with its precompiled argument and return types
+    # Do not use this class directly
+    class CallSite
+      def inspect
+        "#<#{self.class.name} #{@method_id.qualifier}>"
+      end
+    end
+
+    # Records calls and field assignments which are then executed together in a single native loop
+    #
+    # Defined natively:
+    # def add_call(call_site, object_or_class_reference, *args) -> Integer (command index)
+    # def add_set_field(object_reference, field_id, type, value) -> Integer (command index)
+    # def add_set_static_field(class_reference, field_id, type, value) -> Integer (command index)
+    # def add_checkpoint -> Integer (command index)
+    # def set_argument(command_index, argument_index, value)
+    # def size -> Integer
+    # def execute
+    #
+    # An exception skips the remaining commands up to the next checkpoint.
+    # The first exception is raised after the whole buffer was executed.
+    class CommandBuffer
+      def inspect
+        "#<#{self.class.name} #{size} commands>"
+      end
+    end
 
+    # Stores field IDs together with their types
+    # Do not use this class directly
+    class FieldSet
       def inspect
-        "#<#{self.class.name} #{@type_name} #{@qualifier}>"
+        "#<#{self.class.name} #{@field_ids.map(&:qualifier).join(', ')}>"
+      end
+    end
+
+    # Result of FFI.call_async
+    #
+    # Defined natively:
+    # def done? -> true/false
+    # def value (raises the Java exception of the call, or an Exception if the call has not finished yet)
+    class Future
+      def inspect
+        "#<#{self.class.name} #{done? ? 'done' : 'pending'}>"
       end
     end
 
     # Stores a JNI method or field ID internally
     # Do not use this class directly
+    #
+    # Defined natively:
+    # def type_name -> String
+    # def qualifier -> String (calls toString() on the declaring class)
+    # def signature -> String
     class Pointer
-      attr_reader :type_name, :qualifier
-
       def inspect
-        "#<#{self.class.name} #{@type_name} #{@qualifier}>"
+        "#<#{self.class.name} #{type_name} #{qualifier}>"
       end
     end
   end
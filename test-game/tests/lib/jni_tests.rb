@@ -8,6 +8,7 @@ describe JNI do
       [%i[string], :string, '(Ljava/lang/String;)Ljava/lang/String;'],
       [[], 'my.package.MyClass', '()Lmy/package/MyClass;'],
       [[%i[int]], :void, '([I)V'],
+      [%i[interned_string], :void, '(Ljava/lang/String;)V'],
     ].each do |argument_types, return_type, expected|
       it "for #{argument_types} -> #{return_type}" do
         result = JNI.method_signature(argument_types, return_type)
@@ -38,11 +39,15 @@ module JNI
   describe JavaClass do
     it 'can build a new instance' do
       method_id = 1234
+      call_site = Object.new
       ffi = a_mock {
         responding_to(:get_method_id) {
           always_returning(method_id)
         }
-        responding_to(:new_object) {
+        responding_to(:build_call_site) {
+          always_returning(call_site)
+        }
+        responding_to(:call) {
           always_returning({ qualifier: 'com.example.MyClass' })
         }
       }
@@ -54,19 +59,231 @@ module JNI
         constructor argument_types: []
       end
       assert.received_call! ffi, :get_method_id, [class_reference, '<init>', '()V']
+      assert.received_call! ffi, :build_call_site, [method_id, [], :void, :constructor]
+
+      instance = java_class.build_new_instance
+      assert.received_call! ffi, :call, [call_site, class_reference]
+      assert.equal! instance.class, java_class.instance_class
+      assert.equal! instance.class.superclass, JavaObject
+    end
+
+    it 'can register and call an instance method' do
+      method_id = 1234
+      constructor_call_site = Object.new
+      method_call_site = Object.new
+      instance_reference = { qualifier: 'com.example.MyClass@1' }
+      ffi = a_mock {
+        responding_to(:get_method_id) {
+          always_returning(method_id)
+        }
+        responding_to(:build_call_site) {
+          returning_values(constructor_call_site, method_call_site)
+        }
+        responding_to(:call) {
+          returning_values(instance_reference, 42)
+        }
+      }
+      class_reference = { qualifier: 'class com.example.MyClass' }
+      java_class = JavaClass.new(class_reference, ffi: ffi)
+
+      java_class.register do
+        constructor argument_types: []
+        method :get_value, argument_types: %i[int], return_type: :int
+      end
+
+      assert.received_call! ffi, :get_method_id, [class_reference, 'getValue', '(I)I']
+      assert.received_call! ffi, :build_call_site, [method_id, %i[int], :int, :method]
+
+      instance = java_class.build_new_instance
+      result = instance.get_value(1)
+
+      assert.received_call! ffi, :call, [method_call_site, instance_reference, 1]
+      assert.equal! result, 42
+      assert.equal! instance.singleton_methods, []
+    end
+
+    it 'can snapshot and sync registered fields' do
+      constructor_call_site = Object.new
+      field_set = Object.new
+      instance_reference = { qualifier: 'com.example.MyClass@1' }
+      ffi = a_mock {
+        responding_to(:get_method_id) {
+          always_returning(1234)
+        }
+        responding_to(:get_field_id) {
+          returning_values(1, 2)
+        }
+        responding_to(:build_call_site) {
+          always_returning(constructor_call_site)
+        }
+        responding_to(:call) {
+          always_returning(instance_reference)
+        }
+        responding_to(:build_field_set) {
+          always_returning(field_set)
+        }
+        responding_to(:read_fields) {
+          always_returning([10, 'Player'])
+        }
+        responding_to(:write_fields) {
+          always_returning(1)
+        }
+      }
+      class_reference = { qualifier: 'class com.example.MyClass' }
+      java_class = JavaClass.new(class_reference, ffi: ffi)
+
+      java_class.register do
+        constructor argument_types: []
+        field :score, type: :int
+        field :player_name, type: :string
+      end
+
+      assert.received_call! ffi, :get_field_id, [class_reference, 'score', 'I']
+      assert.received_call! ffi, :get_field_id, [class_reference, 'playerName', 'Ljava/lang/String;']
 
       instance = java_class.build_new_instance
-      assert.received_call! ffi, :new_object, [class_reference, method_id, []]
-      assert.equal! instance.class, JavaObject
+      snapshot = instance.snapshot
+
+      assert.received_call! ffi, :build_field_set, [[1, 2], %i[int string]]
+      assert.received_call! ffi, :read_fields, [field_set, instance_reference]
+      assert.equal! snapshot, { score: 10, player_name: 'Player' }
+
+      snapshot[:score] = 20
+      instance.sync
+
+      assert.received_call! ffi, :write_fields, [field_set, instance_reference, [20, 'Player'], [10, 'Player']]
+    end
+
+    it 'returns boxed primitives as Ruby values' do
+      ffi = a_mock {
+        responding_to(:get_static_method_id) {
+          always_returning(1234)
+        }
+        responding_to(:build_call_site) {
+          always_returning(Object.new)
+        }
+        responding_to(:call) {
+          always_returning(42)
+        }
+      }
+      class_reference = { qualifier: 'class java.lang.Integer' }
+      java_class = JavaClass.new(class_reference, ffi: ffi)
+
+      java_class.register do
+        static_method :value_of, argument_types: [:int], return_type: 'java.lang.Integer'
+      end
+
+      assert.equal! java_class.value_of(42), 42
+    end
+
+    it 'resolves lazily registered methods on first call' do
+      method_id = 1234
+      call_site = Object.new
+      ffi = a_mock {
+        responding_to(:get_static_method_id) {
+          always_returning(method_id)
+        }
+        responding_to(:build_call_site) {
+          always_returning(call_site)
+        }
+        responding_to(:call) {
+          always_returning(3)
+        }
+      }
+      class_reference = { qualifier: 'class com.example.MyClass' }
+      java_class = JavaClass.new(class_reference, ffi: ffi)
+
+      java_class.register(lazy: true) do
+        static_method :add, argument_types: %i[int int], return_type: :int
+      end
+
+      assert.was_not_called! ffi, :get_static_method_id
+      assert.was_not_called! ffi, :build_call_site
+
+      2.times do
+        assert.equal! java_class.add(1, 2), 3
+      end
+
+      assert.equal! ffi.method_calls(:get_static_method_id), [[[class_reference, 'add', '(II)I'], {}]]
+      assert.equal! ffi.method_calls(:build_call_site), [[[method_id, %i[int int], :int, :static_method], {}]]
+      assert.equal! ffi.method_calls(:call).size, 2
+    end
+
+    it 'resolves lazily registered instance methods once for all instances' do
+      method_call_site = Object.new
+      ffi = a_mock {
+        responding_to(:get_method_id) {
+          always_returning(1234)
+        }
+        responding_to(:build_call_site) {
+          always_returning(method_call_site)
+        }
+        responding_to(:call) {
+          always_returning(7)
+        }
+      }
+      class_reference = { qualifier: 'class com.example.MyClass' }
+      java_class = JavaClass.new(class_reference, ffi: ffi)
+
+      java_class.register(lazy: true) do
+        constructor argument_types: []
+        method :get_value, return_type: :int
+      end
+      first_instance = java_class.build_new_instance
+      second_instance = java_class.build_new_instance
+      ffi.clear_method_calls
+
+      assert.equal! first_instance.get_value, 7
+      assert.equal! second_instance.get_value, 7
+
+      assert.equal! ffi.method_calls(:get_method_id), [[[class_reference, 'getValue', '()I'], {}]]
+      assert.equal! ffi.method_calls(:call).size, 2
+    end
+
+    it 'can preload lazily registered members' do
+      ffi = a_mock {
+        responding_to(:get_method_id) {
+          always_returning(1234)
+        }
+        responding_to(:get_field_id) {
+          always_returning(1)
+        }
+        responding_to(:build_call_site) {
+          always_returning(Object.new)
+        }
+      }
+      class_reference = { qualifier: 'class com.example.MyClass' }
+      java_class = JavaClass.new(class_reference, ffi: ffi)
+
+      java_class.register(lazy: true) do
+        constructor argument_types: []
+        method :get_value, return_type: :int
+        field :score, type: :int
+      end
+
+      java_class.preload(:get_value)
+
+      assert.equal! ffi.method_calls(:get_method_id), [[[class_reference, 'getValue', '()I'], {}]]
+      assert.was_not_called! ffi, :get_field_id
+
+      java_class.preload
+
+      assert.received_call! ffi, :get_method_id, [class_reference, '<init>', '()V']
+      assert.received_call! ffi, :get_field_id, [class_reference, 'score', 'I']
+      assert.equal! ffi.method_calls(:get_method_id).size, 2
     end
 
     it 'can register and call a static boolean method' do
       method_id = 1234
+      call_site = Object.new
       ffi = a_mock {
         responding_to(:get_static_method_id) {
           always_returning(method_id)
         }
-        responding_to(:call_static_boolean_method) {
+        responding_to(:build_call_site) {
+          always_returning(call_site)
+        }
+        responding_to(:call) {
           always_returning(true)
         }
       }
@@ -78,20 +295,25 @@ module JNI
       end
 
       assert.received_call! ffi, :get_static_method_id, [class_reference, 'myMethod', '(IZ)Z']
+      assert.received_call! ffi, :build_call_site, [method_id, %i[int boolean], :boolean, :static_method]
 
       result = java_class.my_method(1, true)
 
-      assert.received_call! ffi, :call_static_boolean_method, [class_reference, method_id, %i[int boolean], 1, true]
+      assert.received_call! ffi, :call, [call_site, class_reference, 1, true]
       assert.equal! result, true
     end
 
     it 'can register and call a static string method' do
       method_id = 1234
+      call_site = Object.new
       ffi = a_mock {
         responding_to(:get_static_method_id) {
           always_returning(method_id)
         }
-        responding_to(:call_static_object_method) {
+        responding_to(:build_call_site) {
+          always_returning(call_site)
+        }
+        responding_to(:call) {
           always_returning('Hello, World!')
         }
       }
@@ -103,20 +325,25 @@ module JNI
       end
 
       assert.received_call! ffi, :get_static_method_id, [class_reference, 'myMethod', '(I)Ljava/lang/String;']
+      assert.received_call! ffi, :build_call_site, [method_id, %i[int], :string, :static_method]
 
       result = java_class.my_method(1)
 
-      assert.received_call! ffi, :call_static_object_method, [class_reference, method_id, %i[int], 1]
+      assert.received_call! ffi, :call, [call_site, class_reference, 1]
       assert.equal! result, 'Hello, World!'
     end
 
     it 'can register and call a static object method' do
       method_id = 1234
+      call_site = Object.new
       ffi = a_mock {
         responding_to(:get_static_method_id) do
           always_returning(method_id)
         end
-        responding_to(:call_static_object_method) {
+        responding_to(:build_call_site) {
+          always_returning(call_site)
+        }
+        responding_to(:call) {
           always_returning({ qualifier: 'some result representation' })
         }
       }
@@ -128,10 +355,11 @@ module JNI
       end
 
       assert.received_call! ffi, :get_static_method_id, [class_reference, 'myMethod', '(I)Ljava/lang/Integer;']
+      assert.received_call! ffi, :build_call_site, [method_id, %i[int], 'java.lang.Integer', :static_method]
 
       result = java_class.my_method(1)
 
-      assert.received_call! ffi, :call_static_object_method, [class_reference, method_id, %i[int], 1]
+      assert.received_call! ffi, :call, [call_site, class_reference, 1]
       assert.equal! result.class, JavaObject
       assert.equal! result.reference.qualifier, 'some result representation'
     end